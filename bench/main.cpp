@@ -0,0 +1,391 @@
+#include <QCoreApplication>
+
+#include <QDebug>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSysInfo>
+#include <QVector>
+#include <XSys>
+
+#include <algorithm>
+#include <functional>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
+
+namespace {
+
+struct BenchConfig {
+    QString workDir;
+    QString device;
+    int iterations;
+    int smallFiles;
+    qint64 smallSize;
+    int largeFiles;
+    qint64 largeSize;
+    int lookups;
+    bool dropCaches;
+};
+
+// one measured run, ops and bytes are what a single run moves.
+struct BenchSample {
+    BenchSample() : nsecs(0), ops(0), bytes(0), success(true) {}
+
+    qint64 nsecs;
+    qint64 ops;
+    qint64 bytes;
+    bool success;
+};
+
+typedef std::function<void()> Setup;
+typedef std::function<BenchSample()> Body;
+
+// pseudo random, so neither compression nor zero detection can help.
+QByteArray patternBlock(qint64 size, quint32 seed) {
+    QByteArray block(int(size), Qt::Uninitialized);
+    quint32 x = seed | 1;
+    for (int i = 0; i + 4 <= block.size(); i += 4) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        memcpy(block.data() + i, &x, 4);
+    }
+    return block;
+}
+
+bool writePatternFile(const QString &path, qint64 size, quint32 seed) {
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Create" << path << "failed:" << file.errorString();
+        return false;
+    }
+    const qint64 chunk = 4 * 1024 * 1024;
+    QByteArray block = patternBlock(qMin(size, chunk), seed);
+    qint64 left = size;
+    while (left > 0) {
+        // vary every chunk so no two chunks of the file are equal.
+        block[0] = char(left / chunk);
+        qint64 n = qMin(left, qint64(block.size()));
+        if (n != file.write(block.constData(), n)) {
+            qWarning() << "Write" << path << "failed:" << file.errorString();
+            return false;
+        }
+        left -= n;
+    }
+    return true;
+}
+
+void dropCaches(const BenchConfig &config) {
+#ifdef Q_OS_LINUX
+    if (!config.dropCaches) {
+        return;
+    }
+    sync();
+    QFile drop("/proc/sys/vm/drop_caches");
+    if (!drop.open(QIODevice::WriteOnly) || 2 != drop.write("3\n")) {
+        qWarning() << "Drop caches failed:" << drop.errorString();
+    }
+#else
+    Q_UNUSED(config);
+#endif
+}
+
+// device of the filesystem holding path, the longest matching mount point wins.
+QString deviceOf(const QString &path) {
+    QString canonical = QFileInfo(path).canonicalFilePath();
+    QString device;
+    int best = -1;
+    Q_FOREACH(const XSys::DiskUtil::MountEntry &entry, XSys::DiskUtil::Mounts()) {
+        QString mountPoint = entry.mountPoint;
+        bool under = canonical == mountPoint || "/" == mountPoint
+                || canonical.startsWith(mountPoint + "/");
+        if (under && mountPoint.size() > best && entry.device.startsWith("/dev/")) {
+            best = mountPoint.size();
+            device = entry.device;
+        }
+    }
+    return device;
+}
+
+QJsonObject runBench(const QString &name, const BenchConfig &config, const Setup &setup, const Body &body) {
+    QVector<qint64> nsecs;
+    BenchSample last;
+    bool success = true;
+    for (int i = 0; i < config.iterations; ++i) {
+        if (setup) setup();
+        dropCaches(config);
+        last = body();
+        success = success && last.success;
+        nsecs.append(last.nsecs);
+    }
+    std::sort(nsecs.begin(), nsecs.end());
+    double median = nsecs.isEmpty() ? 0 : nsecs.at(nsecs.size() / 2) / 1e6;
+    double seconds = median / 1e3;
+
+    QJsonObject result;
+    result["name"] = name;
+    result["iterations"] = config.iterations;
+    result["ops"] = double(last.ops);
+    result["bytes"] = double(last.bytes);
+    result["min_ms"] = nsecs.isEmpty() ? 0 : nsecs.first() / 1e6;
+    result["median_ms"] = median;
+    result["max_ms"] = nsecs.isEmpty() ? 0 : nsecs.last() / 1e6;
+    result["ops_per_s"] = seconds > 0 ? last.ops / seconds : 0;
+    result["mb_per_s"] = seconds > 0 ? last.bytes / seconds / (1024 * 1024) : 0;
+    result["success"] = success;
+    qDebug() << name << "median" << median << "ms" << (success ? "" : "FAILED");
+    return result;
+}
+
+bool makeTree(const QString &root, const BenchConfig &config, QStringList &files) {
+    // spread the small files over directories like a live system tree.
+    for (int i = 0; i < config.smallFiles; ++i) {
+        QString dir = QString("%1/d%2/s%3").arg(root).arg(i % 16).arg(i % 128);
+        if (!QDir().mkpath(dir)) {
+            qWarning() << "Create" << dir << "failed";
+            return false;
+        }
+        QString path = QString("%1/f%2.bin").arg(dir).arg(i);
+        if (!writePatternFile(path, config.smallSize, quint32(i))) {
+            return false;
+        }
+        files.append(path);
+    }
+    return true;
+}
+
+BenchSample timed(const std::function<bool(BenchSample &)> &work) {
+    BenchSample sample;
+    QElapsedTimer timer;
+    timer.start();
+    sample.success = work(sample);
+    sample.nsecs = timer.nsecsElapsed();
+    return sample;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("libxsys FileSystem and DiskUtil benchmarks, results as JSON.");
+    parser.addHelpOption();
+    // /tmp is often a tmpfs, copies there measure memcpy and may run out of
+    // memory, so the inputs go to the current directory unless told otherwise.
+    QCommandLineOption dirOption("dir", "Directory for the synthetic inputs, on the disk to measure.", "path", QDir::currentPath());
+    QCommandLineOption outputOption("output", "Write the JSON results to file instead of stdout.", "file");
+    QCommandLineOption deviceOption("device", "Partition for MountPoint and GetPartitionFreeSpace.", "dev");
+    QCommandLineOption iterationsOption("iterations", "Runs of every benchmark.", "n", "3");
+    QCommandLineOption smallFilesOption("small-files", "Number of small files in the tree.", "n", "5000");
+    QCommandLineOption smallSizeOption("small-size", "Size of a small file in bytes.", "bytes", "8192");
+    QCommandLineOption largeFilesOption("large-files", "Number of large image files.", "n", "2");
+    QCommandLineOption largeSizeOption("large-size", "Size of a large file in MiB, the files should outgrow the page cache.", "mib", "2048");
+    QCommandLineOption lookupsOption("lookups", "Calls per MountPoint and free space run.", "n", "10000");
+    QCommandLineOption dropCachesOption("drop-caches", "Drop the page cache before every run, needs root.");
+    QCommandLineOption traceOption("trace", "Also write a Chrome trace of the runs to file.", "file");
+    parser.addOption(dirOption);
+    parser.addOption(outputOption);
+    parser.addOption(deviceOption);
+    parser.addOption(iterationsOption);
+    parser.addOption(smallFilesOption);
+    parser.addOption(smallSizeOption);
+    parser.addOption(largeFilesOption);
+    parser.addOption(largeSizeOption);
+    parser.addOption(lookupsOption);
+    parser.addOption(dropCachesOption);
+    parser.addOption(traceOption);
+    parser.process(a);
+
+    BenchConfig config;
+    config.workDir = QDir(parser.value(dirOption)).filePath(QString("xsys-bench-%1").arg(QCoreApplication::applicationPid()));
+    config.iterations = qMax(1, parser.value(iterationsOption).toInt());
+    config.smallFiles = qMax(1, parser.value(smallFilesOption).toInt());
+    config.smallSize = qMax(qint64(1), parser.value(smallSizeOption).toLongLong());
+    config.largeFiles = qMax(0, parser.value(largeFilesOption).toInt());
+    config.largeSize = qMax(qint64(1), parser.value(largeSizeOption).toLongLong()) * 1024 * 1024;
+    config.lookups = qMax(1, parser.value(lookupsOption).toInt());
+    config.dropCaches = parser.isSet(dropCachesOption);
+    if (parser.isSet(traceOption)) {
+        XSys::Trace::SetEnabled(true);
+    }
+
+    QString srcTree = config.workDir + "/tree";
+    QString largeDir = config.workDir + "/large";
+    QStringList smallFiles;
+    QStringList largeFiles;
+    if (!QDir().mkpath(largeDir) || !makeTree(srcTree, config, smallFiles)) {
+        XSys::FS::RmDir(config.workDir);
+        return 1;
+    }
+    for (int i = 0; i < config.largeFiles; ++i) {
+        QString path = QString("%1/image%2.img").arg(largeDir).arg(i);
+        if (!writePatternFile(path, config.largeSize, quint32(0x5eed + i))) {
+            XSys::FS::RmDir(config.workDir);
+            return 1;
+        }
+        largeFiles.append(path);
+    }
+    config.device = parser.isSet(deviceOption) ? parser.value(deviceOption) : deviceOf(config.workDir);
+
+    QString copyDir = config.workDir + "/copy";
+    QString moveDir = config.workDir + "/moved";
+    Setup clean = [&]() {
+        XSys::FS::RmDir(copyDir);
+        XSys::FS::RmDir(moveDir);
+        QDir().mkpath(copyDir);
+    };
+    // a fresh copy of the tree for the benchmarks that consume it.
+    Setup copyTree = [&]() {
+        clean();
+        XSys::FS::CopyTree(srcTree, copyDir);
+    };
+
+    QJsonArray results;
+
+    results.append(runBench("CpFile/small", config, clean, [&]() {
+        return timed([&](BenchSample &sample) {
+            for (int i = 0; i < smallFiles.size(); ++i) {
+                if (!XSys::FS::CpFile(smallFiles.at(i), QString("%1/f%2.bin").arg(copyDir).arg(i))) return false;
+                sample.ops++;
+                sample.bytes += config.smallSize;
+            }
+            return true;
+        });
+    }));
+
+    if (!largeFiles.isEmpty()) {
+        results.append(runBench("CpFile/large", config, clean, [&]() {
+            return timed([&](BenchSample &sample) {
+                Q_FOREACH(const QString &path, largeFiles) {
+                    if (!XSys::FS::CpFile(path, copyDir + "/" + QFileInfo(path).fileName())) return false;
+                    sample.ops++;
+                    sample.bytes += config.largeSize;
+                }
+                return true;
+            });
+        }));
+    }
+
+    results.append(runBench("InsertFile/small", config, clean, [&]() {
+        return timed([&](BenchSample &sample) {
+            for (int i = 0; i < smallFiles.size(); ++i) {
+                if (!XSys::FS::InsertFile(smallFiles.at(i), QString("%1/f%2.bin").arg(copyDir).arg(i))) return false;
+                sample.ops++;
+                sample.bytes += config.smallSize;
+            }
+            return true;
+        });
+    }));
+
+    results.append(runBench("InsertTmpFile/small", config, clean, [&]() {
+        QStringList inserted;
+        BenchSample result = timed([&](BenchSample &sample) {
+            Q_FOREACH(const QString &path, smallFiles.mid(0, 1000)) {
+                QString tmp = XSys::FS::InsertTmpFile(path);
+                if (tmp.isEmpty()) return false;
+                inserted.append(tmp);
+                sample.ops++;
+                sample.bytes += config.smallSize;
+            }
+            return true;
+        });
+        Q_FOREACH(const QString &tmp, inserted) {
+            XSys::FS::RmFile(tmp);
+        }
+        return result;
+    }));
+
+    results.append(runBench("MoveDir/tree", config, copyTree, [&]() {
+        return timed([&](BenchSample &sample) {
+            sample.ops = smallFiles.size();
+            sample.bytes = smallFiles.size() * config.smallSize;
+            return XSys::FS::MoveDir(copyDir, moveDir);
+        });
+    }));
+
+    results.append(runBench("RmDir/tree", config, copyTree, [&]() {
+        return timed([&](BenchSample &sample) {
+            sample.ops = smallFiles.size();
+            return XSys::FS::RmDir(copyDir);
+        });
+    }));
+
+    if (!config.device.isEmpty()) {
+        results.append(runBench("MountPoint", config, Setup(), [&]() {
+            return timed([&](BenchSample &sample) {
+                for (int i = 0; i < config.lookups; ++i) {
+                    if (XSys::DiskUtil::MountPoint(config.device).isEmpty()) return false;
+                    sample.ops++;
+                }
+                return true;
+            });
+        }));
+
+        results.append(runBench("GetPartitionFreeSpace", config, Setup(), [&]() {
+            return timed([&](BenchSample &sample) {
+                for (int i = 0; i < config.lookups; ++i) {
+                    if (XSys::DiskUtil::GetPartitionFreeSpace(config.device) <= 0) return false;
+                    sample.ops++;
+                }
+                return true;
+            });
+        }));
+    } else {
+        qWarning() << "No device found for" << config.workDir << ", skip MountPoint and GetPartitionFreeSpace";
+    }
+
+    XSys::FS::RmDir(config.workDir);
+
+    QJsonObject setup;
+    setup["iterations"] = config.iterations;
+    setup["small_files"] = config.smallFiles;
+    setup["small_size"] = double(config.smallSize);
+    setup["large_files"] = config.largeFiles;
+    setup["large_size"] = double(config.largeSize);
+    setup["lookups"] = config.lookups;
+    setup["device"] = config.device;
+    setup["drop_caches"] = config.dropCaches;
+
+    QJsonObject report;
+    report["host"] = QSysInfo::machineHostName();
+    report["kernel"] = QSysInfo::kernelVersion();
+    report["cpu_arch"] = QSysInfo::currentCpuArchitecture();
+    report["qt"] = QString(qVersion());
+    report["config"] = setup;
+    report["results"] = results;
+
+    QByteArray json = QJsonDocument(report).toJson();
+    if (parser.isSet(outputOption)) {
+        QFile output(parser.value(outputOption));
+        if (!output.open(QIODevice::WriteOnly | QIODevice::Truncate) || json.size() != output.write(json)) {
+            qWarning() << "Write" << output.fileName() << "failed:" << output.errorString();
+            return 1;
+        }
+    } else {
+        QFile output;
+        output.open(stdout, QIODevice::WriteOnly);
+        output.write(json);
+    }
+    if (parser.isSet(traceOption)) {
+        XSys::Trace::ExportChromeTrace(parser.value(traceOption));
+    }
+
+    // the report is complete either way, a failed body still fails the run.
+    Q_FOREACH(const QJsonValue &result, results) {
+        if (!result.toObject().value("success").toBool()) {
+            return 1;
+        }
+    }
+    return 0;
+}
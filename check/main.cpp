@@ -0,0 +1,595 @@
+#include <QCoreApplication>
+
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QMap>
+#include <QStringList>
+#include <QTemporaryDir>
+#include <QThread>
+#include <XSys>
+
+#include "Common/RawIo.h"
+
+#include <atomic>
+#include <thread>
+#include <string.h>
+
+namespace {
+
+using XSys::RawIo::le16;
+using XSys::RawIo::le32;
+using XSys::RawIo::put16;
+using XSys::RawIo::put32;
+
+// a FAT32 needs 65525 clusters, with 512 byte clusters 64 MiB is enough.
+const qint64 FatImageSize = 64 * 1024 * 1024;
+const quint32 FatClusterSize = 512;
+const qint64 FatAlignment = 1024 * 1024;
+
+const int IsoSectorSize = 2048;
+
+// pseudo random content, so a misplaced cluster can not match by chance.
+QByteArray pattern(int size, quint32 seed) {
+    QByteArray data(size, Qt::Uninitialized);
+    quint32 x = seed | 1;
+    for (int i = 0; i < size; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        data[i] = char(x);
+    }
+    return data;
+}
+
+bool writeFile(const QString &path, const QByteArray &data, QString &errmsg) {
+    QFileInfo info(path);
+    QFile file(path);
+    if (!QDir().mkpath(info.absolutePath()) || !file.open(QIODevice::WriteOnly | QIODevice::Truncate)
+            || data.size() != file.write(data)) {
+        errmsg = "Write " + path + " failed: " + file.errorString();
+        return false;
+    }
+    return true;
+}
+
+// one short entry with the long name in front of it, if any.
+struct FatEntry {
+    FatEntry() : attr(0), cluster(0), size(0) {}
+
+    QString name;
+    quint8 attr;
+    quint32 cluster;
+    quint32 size;
+};
+
+// an unmounted FAT32 image parsed here and not by the library, so a
+// mistake on the writing side can not hide itself on the reading side.
+class FatReader {
+public:
+    FatReader() : bytesPerSector_(0), sectorsPerCluster_(0), dataStart_(0), rootCluster_(0), clusters_(0), fsInfoFree_(0) {}
+
+    bool open(const QString &image, QString &errmsg) {
+        QFile file(image);
+        if (!file.open(QIODevice::ReadOnly)) {
+            errmsg = "Can not open " + image + ": " + file.errorString();
+            return false;
+        }
+        image_ = file.readAll();
+        const uchar *boot = bytes(0);
+        if (image_.size() < 4096 || 0x55 != boot[510] || 0xAA != boot[511]
+                || 0 != memcmp(boot + 82, "FAT32   ", 8)) {
+            errmsg = "No FAT32 boot sector in " + image;
+            return false;
+        }
+        bytesPerSector_ = le16(boot + 11);
+        sectorsPerCluster_ = boot[13];
+        quint32 reserved = le16(boot + 14);
+        quint32 fats = boot[16];
+        quint32 totalSectors = le32(boot + 32);
+        quint32 fatSectors = le32(boot + 36);
+        rootCluster_ = le32(boot + 44);
+        if (512 != bytesPerSector_ || 0 == sectorsPerCluster_ || 2 != fats || 0xF8 != boot[21]
+                || 0 != memcmp(boot, bytes(6 * bytesPerSector_), 512)) {
+            errmsg = "Unexpected BPB or backup boot sector";
+            return false;
+        }
+        const uchar *fsInfo = bytes(qint64(le16(boot + 48)) * bytesPerSector_);
+        if (0 != memcmp(fsInfo, "RRaA", 4) || 0 != memcmp(fsInfo + 484, "rrAa", 4)) {
+            errmsg = "No FSInfo sector";
+            return false;
+        }
+        fsInfoFree_ = le32(fsInfo + 488);
+        dataStart_ = qint64(reserved + fats * fatSectors) * bytesPerSector_;
+        clusters_ = (totalSectors - reserved - fats * fatSectors) / sectorsPerCluster_;
+        if (dataStart_ % FatAlignment || clusters_ < 65525 || qint64(totalSectors) * bytesPerSector_ > image_.size()) {
+            errmsg = QString("Bad layout, data at %1, %2 clusters").arg(dataStart_).arg(clusters_);
+            return false;
+        }
+        fat_ = image_.mid(int(reserved * bytesPerSector_), int(fatSectors * bytesPerSector_));
+        if (fat_ != image_.mid(int((reserved + fatSectors) * bytesPerSector_), int(fatSectors * bytesPerSector_))) {
+            errmsg = "The two FATs differ";
+            return false;
+        }
+        if (0x0FFFFFF8 != next(0) || 0x0FFFFFF8 > next(rootCluster_)) {
+            errmsg = "Bad FAT head";
+            return false;
+        }
+        return true;
+    }
+
+    QString label() const {
+        return QString::fromLatin1(image_.mid(71, 11)).trimmed();
+    }
+
+    // FSInfo may only be a hint, but FatVolume keeps it exact.
+    bool checkFreeCount(QString &errmsg) const {
+        quint32 free = 0;
+        for (quint32 c = 2; c < clusters_ + 2; ++c) {
+            if (0 == next(c)) ++free;
+        }
+        if (free != fsInfoFree_) {
+            errmsg = QString("FSInfo counts %1 free clusters, the FAT %2").arg(fsInfoFree_).arg(free);
+            return false;
+        }
+        return true;
+    }
+
+    // the content of a file, its chain must be exactly as long as the size.
+    bool readFile(const QString &path, QByteArray &data, QString &errmsg) const {
+        FatEntry entry;
+        if (!find(path, entry) || (entry.attr & AttrDirectory)) {
+            errmsg = "No file " + path;
+            return false;
+        }
+        qint64 clusterBytes = qint64(sectorsPerCluster_) * bytesPerSector_;
+        quint32 expected = quint32((entry.size + clusterBytes - 1) / clusterBytes);
+        quint32 count = 0;
+        data = chain(entry.cluster, count);
+        if (count != expected || (0 == entry.size) != (0 == entry.cluster)) {
+            errmsg = QString("%1 has %2 clusters for %3 bytes").arg(path).arg(count).arg(entry.size);
+            return false;
+        }
+        data.truncate(int(entry.size));
+        return true;
+    }
+
+private:
+    static const quint8 AttrVolumeLabel = 0x08;
+    static const quint8 AttrDirectory = 0x10;
+    static const quint8 AttrLongName = 0x0F;
+
+    const uchar *bytes(qint64 offset) const {
+        return reinterpret_cast<const uchar *>(image_.constData()) + offset;
+    }
+
+    quint32 next(quint32 cluster) const {
+        return le32(reinterpret_cast<const uchar *>(fat_.constData()) + cluster * 4) & 0x0FFFFFFF;
+    }
+
+    // the clusters from first on, count stops a loop in the FAT.
+    QByteArray chain(quint32 first, quint32 &count) const {
+        QByteArray data;
+        qint64 clusterBytes = qint64(sectorsPerCluster_) * bytesPerSector_;
+        count = 0;
+        for (quint32 c = first; c >= 2 && c < clusters_ + 2 && count <= clusters_; c = next(c)) {
+            data.append(image_.mid(int(dataStart_ + (c - 2) * clusterBytes), int(clusterBytes)));
+            ++count;
+        }
+        return data;
+    }
+
+    static QString shortName(const uchar *p) {
+        QString base = QString::fromLatin1(reinterpret_cast<const char *>(p), 8).trimmed();
+        QString ext = QString::fromLatin1(reinterpret_cast<const char *>(p + 8), 3).trimmed();
+        // the case flags Windows NT keeps in byte 12.
+        if (p[12] & 0x08) base = base.toLower();
+        if (p[12] & 0x10) ext = ext.toLower();
+        return ext.isEmpty() ? base : base + "." + ext;
+    }
+
+    QList<FatEntry> list(quint32 cluster) const {
+        static const int NameOffsets[] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+        QList<FatEntry> entries;
+        quint32 count = 0;
+        QByteArray dir = chain(cluster, count);
+        QString longName;
+        int checksum = -1;
+        for (int i = 0; i + 32 <= dir.size(); i += 32) {
+            const uchar *p = reinterpret_cast<const uchar *>(dir.constData()) + i;
+            if (0 == p[0]) break;
+            if (0xE5 == p[0]) {
+                longName.clear();
+                continue;
+            }
+            if (AttrLongName == p[11]) {
+                // stored last part first.
+                if (p[0] & 0x40) longName.clear();
+                QString part;
+                for (size_t k = 0; k < sizeof(NameOffsets) / sizeof(NameOffsets[0]); ++k) {
+                    quint16 c = le16(p + NameOffsets[k]);
+                    if (0 == c || 0xFFFF == c) break;
+                    part.append(QChar(c));
+                }
+                longName.prepend(part);
+                checksum = p[13];
+                continue;
+            }
+            if (p[11] & AttrVolumeLabel) {
+                longName.clear();
+                continue;
+            }
+            quint8 sum = 0;
+            for (int k = 0; k < 11; ++k) {
+                sum = quint8(((sum & 1) << 7) + (sum >> 1) + p[k]);
+            }
+            FatEntry entry;
+            entry.name = !longName.isEmpty() && sum == checksum ? longName : shortName(p);
+            entry.attr = p[11];
+            entry.cluster = (quint32(le16(p + 20)) << 16) | le16(p + 26);
+            entry.size = le32(p + 28);
+            longName.clear();
+            if ("." != entry.name && ".." != entry.name) {
+                entries.append(entry);
+            }
+        }
+        return entries;
+    }
+
+    bool find(const QString &path, FatEntry &found) const {
+        found = FatEntry();
+        found.attr = AttrDirectory;
+        found.cluster = rootCluster_;
+        Q_FOREACH(const QString &part, path.split('/', QString::SkipEmptyParts)) {
+            if (!(found.attr & AttrDirectory)) {
+                return false;
+            }
+            bool match = false;
+            Q_FOREACH(const FatEntry &entry, list(found.cluster)) {
+                if (0 == entry.name.compare(part, Qt::CaseInsensitive)) {
+                    found = entry;
+                    match = true;
+                    break;
+                }
+            }
+            if (!match) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    QByteArray image_;
+    QByteArray fat_;
+    quint32 bytesPerSector_;
+    quint32 sectorsPerCluster_;
+    qint64 dataStart_;
+    quint32 rootCluster_;
+    quint32 clusters_;
+    quint32 fsInfoFree_;
+};
+
+// FormatFat32 on a regular file, then the layout read back by hand.
+bool checkFormatFat32(const QString &workDir, QString &errmsg) {
+    QString image = QDir(workDir).filePath("fat32.img");
+    XSys::DiskUtil::FormatFat32Options options;
+    options.label = "xsys check";
+    options.clusterSize = FatClusterSize;
+    options.alignment = FatAlignment;
+    options.size = FatImageSize;
+    XSys::Result ret = XSys::DiskUtil::FormatFat32(image, options);
+    if (!ret.isSuccess()) {
+        errmsg = ret.errmsg();
+        return false;
+    }
+    FatReader reader;
+    if (!reader.open(image, errmsg)) {
+        return false;
+    }
+    if (reader.label() != "XSYS CHECK") {
+        errmsg = "Label is " + reader.label();
+        return false;
+    }
+    XSys::DiskUtil::PartitionInfo info = XSys::DiskUtil::ProbePartition(image);
+    if (!info.valid || XSys::DiskUtil::PF_FAT32 != info.format) {
+        errmsg = "ProbePartition does not see a FAT32";
+        return false;
+    }
+    return true;
+}
+
+bool compareTree(const FatReader &reader, const QMap<QString, QByteArray> &files, QString &errmsg) {
+    for (QMap<QString, QByteArray>::const_iterator it = files.constBegin(); it != files.constEnd(); ++it) {
+        QByteArray data;
+        if (!reader.readFile(it.key(), data, errmsg)) {
+            return false;
+        }
+        if (data != it.value()) {
+            errmsg = it.key() + " differs from its source";
+            return false;
+        }
+    }
+    return reader.checkFreeCount(errmsg);
+}
+
+// FatVolume::copyTree into a fresh image, read back without a mount, then
+// one file replaced by a shorter one, which must free the rest of its chain.
+bool checkFatVolume(const QString &workDir, QString &errmsg) {
+    QString tree = QDir(workDir).filePath("tree");
+    QMap<QString, QByteArray> files;
+    files.insert("boot/grub/grub.cfg", "set timeout=5\n");
+    files.insert("EFI/BOOT/BOOTX64.EFI", pattern(70000, 1));
+    files.insert("casper/Long File Name.squashfs", pattern(300000, 2));
+    files.insert("empty.txt", QByteArray());
+    for (QMap<QString, QByteArray>::const_iterator it = files.constBegin(); it != files.constEnd(); ++it) {
+        if (!writeFile(QDir(tree).filePath(it.key()), it.value(), errmsg)) {
+            return false;
+        }
+    }
+
+    QString image = QDir(workDir).filePath("fat32.img");
+    XSys::DiskUtil::FormatFat32Options options;
+    options.clusterSize = FatClusterSize;
+    options.alignment = FatAlignment;
+    options.size = FatImageSize;
+    XSys::Result ret = XSys::DiskUtil::FormatFat32(image, options);
+    if (ret.isSuccess()) {
+        XSys::DiskUtil::FatVolume volume;
+        ret = volume.open(image);
+        if (ret.isSuccess()) ret = volume.copyTree(tree, "/");
+        XSys::Result closed = volume.close();
+        if (ret.isSuccess()) ret = closed;
+    }
+    if (!ret.isSuccess()) {
+        errmsg = ret.errmsg();
+        return false;
+    }
+    FatReader reader;
+    if (!reader.open(image, errmsg) || !compareTree(reader, files, errmsg)) {
+        return false;
+    }
+
+    QString replacement = QDir(workDir).filePath("replacement");
+    files.insert("casper/Long File Name.squashfs", pattern(5000, 3));
+    if (!writeFile(replacement, files.value("casper/Long File Name.squashfs"), errmsg)) {
+        return false;
+    }
+    XSys::DiskUtil::FatVolume volume;
+    ret = volume.open(image);
+    if (ret.isSuccess()) ret = volume.copyFile(replacement, "CASPER/long file name.squashfs");
+    XSys::Result closed = volume.close();
+    if (ret.isSuccess()) ret = closed;
+    if (!ret.isSuccess()) {
+        errmsg = ret.errmsg();
+        return false;
+    }
+    return reader.open(image, errmsg) && compareTree(reader, files, errmsg);
+}
+
+// ISO9660 stores most numbers twice, little endian then big endian.
+void putBoth16(char *p, quint16 v) {
+    put16(p, v);
+    p[2] = char(v >> 8);
+    p[3] = char(v);
+}
+
+void putBoth32(char *p, quint32 v) {
+    put32(p, v);
+    p[4] = char(v >> 24);
+    p[5] = char(v >> 16);
+    p[6] = char(v >> 8);
+    p[7] = char(v);
+}
+
+QByteArray isoRecord(quint32 extent, quint32 size, bool isDir, const QByteArray &name) {
+    // padded to an even length.
+    int length = 33 + name.size() + (name.size() % 2 ? 0 : 1);
+    QByteArray record(length, '\0');
+    char *p = record.data();
+    p[0] = char(length);
+    putBoth32(p + 2, extent);
+    putBoth32(p + 10, size);
+    p[25] = char(isDir ? 0x02 : 0);
+    putBoth16(p + 28, 1);
+    p[32] = char(name.size());
+    memcpy(p + 33, name.constData(), name.size());
+    return record;
+}
+
+// a plain ISO9660 image without Rock Ridge or Joliet, laid out by hand:
+// descriptors at 16 and 17, the root at 18, BOOT at 19, then the files.
+QByteArray isoImage(const QByteArray &readme, const QByteArray &kernel) {
+    const quint32 root = 18, boot = 19, readmeAt = 20;
+    const quint32 kernelAt = readmeAt + (readme.size() + IsoSectorSize - 1) / IsoSectorSize;
+    const quint32 sectors = kernelAt + (kernel.size() + IsoSectorSize - 1) / IsoSectorSize;
+    QByteArray image(int(sectors) * IsoSectorSize, '\0');
+    char *p = image.data();
+
+    char *pvd = p + 16 * IsoSectorSize;
+    pvd[0] = 1;
+    memcpy(pvd + 1, "CD001", 5);
+    pvd[6] = 1;
+    memcpy(pvd + 40, QByteArray("XSYS_CHECK").leftJustified(32, ' ').constData(), 32);
+    putBoth32(pvd + 80, sectors);
+    putBoth16(pvd + 120, 1);
+    putBoth16(pvd + 124, 1);
+    putBoth16(pvd + 128, IsoSectorSize);
+    QByteArray rootRecord = isoRecord(root, IsoSectorSize, true, QByteArray(1, '\0'));
+    memcpy(pvd + 156, rootRecord.constData(), rootRecord.size());
+
+    char *end = p + 17 * IsoSectorSize;
+    end[0] = char(255);
+    memcpy(end + 1, "CD001", 5);
+    end[6] = 1;
+
+    QByteArray rootDir = rootRecord + isoRecord(root, IsoSectorSize, true, QByteArray(1, '\1'))
+            + isoRecord(boot, IsoSectorSize, true, "BOOT")
+            + isoRecord(readmeAt, readme.size(), false, "README.TXT;1");
+    memcpy(p + root * IsoSectorSize, rootDir.constData(), rootDir.size());
+    QByteArray bootDir = isoRecord(boot, IsoSectorSize, true, QByteArray(1, '\0'))
+            + isoRecord(root, IsoSectorSize, true, QByteArray(1, '\1'))
+            + isoRecord(kernelAt, kernel.size(), false, "KERNEL.BIN;1");
+    memcpy(p + boot * IsoSectorSize, bootDir.constData(), bootDir.size());
+
+    memcpy(p + readmeAt * IsoSectorSize, readme.constData(), readme.size());
+    memcpy(p + kernelAt * IsoSectorSize, kernel.constData(), kernel.size());
+    return image;
+}
+
+// IsoImage on a generated image: the index, data() and a verified extract.
+bool checkIsoImage(const QString &workDir, QString &errmsg) {
+    QMap<QString, QByteArray> files;
+    files.insert("readme.txt", "xsys check\n");
+    files.insert("boot/kernel.bin", pattern(5000, 4));
+    QString isoPath = QDir(workDir).filePath("check.iso");
+    if (!writeFile(isoPath, isoImage(files.value("readme.txt"), files.value("boot/kernel.bin")), errmsg)) {
+        return false;
+    }
+
+    XSys::FS::IsoImage iso;
+    XSys::Result ret = iso.open(isoPath);
+    if (!ret.isSuccess()) {
+        errmsg = ret.errmsg();
+        return false;
+    }
+    if (iso.volumeId() != "XSYS_CHECK" || 3 != iso.entries().size() || iso.entries().first().path != "boot"
+            || !iso.entries().first().isDir) {
+        errmsg = QString("Unexpected index, %1 entries").arg(iso.entries().size());
+        return false;
+    }
+    for (QMap<QString, QByteArray>::const_iterator it = files.constBegin(); it != files.constEnd(); ++it) {
+        const XSys::FS::IsoEntry *entry = iso.find(it.key());
+        if (!entry || iso.data(*entry) != it.value()) {
+            errmsg = "data() of " + it.key() + " differs from the source";
+            return false;
+        }
+    }
+
+    QString desDir = QDir(workDir).filePath("extracted");
+    XSys::FS::CopyTreeOptions options;
+    options.verify = true;
+    ret = iso.extract(desDir, options);
+    if (!ret.isSuccess()) {
+        errmsg = ret.errmsg();
+        return false;
+    }
+    for (QMap<QString, QByteArray>::const_iterator it = files.constBegin(); it != files.constEnd(); ++it) {
+        QFile file(QDir(desDir).filePath(it.key()));
+        if (!file.open(QIODevice::ReadOnly) || file.readAll() != it.value()) {
+            errmsg = "Extracted " + it.key() + " differs from the source";
+            return false;
+        }
+    }
+    return true;
+}
+
+// the kernel sends a "change" uevent for disk when its uevent file is written.
+bool triggerChange(const QString &disk) {
+    QFile file("/sys/block/" + disk + "/uevent");
+    return file.open(QIODevice::WriteOnly) && 6 == file.write("change", 6);
+}
+
+// a disk Devices() lists and whose uevent file can be written.
+QString pokeableDisk() {
+    Q_FOREACH(const QString &name, QDir("/sys/block").entryList(QDir::Dirs | QDir::NoDotAndDotDot | QDir::System)) {
+        QFile size("/sys/block/" + name + "/size");
+        QFile uevent("/sys/block/" + name + "/uevent");
+        if (name.startsWith("loop") || name.startsWith("ram") || name.startsWith("zram")
+                || !size.open(QIODevice::ReadOnly) || size.readAll().trimmed().toLongLong() <= 0
+                || !uevent.open(QIODevice::WriteOnly)) {
+            continue;
+        }
+        return name;
+    }
+    return "";
+}
+
+// events while the first Devices() scan runs must not silence the signals
+// that follow. Needs root and a disk, skipped otherwise.
+bool checkDeviceMonitor(const QString &, QString &errmsg) {
+    QString disk = pokeableDisk();
+    if (disk.isEmpty()) {
+        qDebug() << "Skip DeviceMonitor, no disk whose uevent can be written";
+        return true;
+    }
+    QString device = "/dev/" + disk;
+    std::atomic<int> changed(0);
+    std::atomic<bool> scanning(true);
+    std::thread poker([&scanning, disk]() {
+        while (scanning) {
+            triggerChange(disk);
+            QThread::msleep(20);
+        }
+    });
+    QObject::connect(XSys::DiskUtil::DeviceMonitor::instance(), &XSys::DiskUtil::DeviceMonitor::deviceChanged,
+                     [&changed, device](const QString &name) {
+        if (name == device) ++changed;
+    });
+    bool listed = false;
+    Q_FOREACH(const XSys::DiskUtil::BlockDevice &entry, XSys::DiskUtil::Devices()) {
+        listed = listed || entry.device == device;
+    }
+    scanning = false;
+    poker.join();
+    if (!listed) {
+        errmsg = device + " is missing from Devices()";
+        return false;
+    }
+
+    // let the raced events settle, then one more must be reported.
+    QThread::msleep(1000);
+    changed = 0;
+    if (!triggerChange(disk)) {
+        errmsg = "Write /sys/block/" + disk + "/uevent failed";
+        return false;
+    }
+    QElapsedTimer timer;
+    timer.start();
+    while (0 == changed && timer.elapsed() < 5000) {
+        QThread::msleep(10);
+    }
+    if (0 == changed) {
+        errmsg = "No deviceChanged for " + device + " after the first scan";
+        return false;
+    }
+    return true;
+}
+
+struct Check {
+    const char *name;
+    bool (*run)(const QString &workDir, QString &errmsg);
+};
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    QTemporaryDir tmp(QDir(QDir::tempPath()).filePath("xsys-check-XXXXXX"));
+    if (!tmp.isValid()) {
+        qWarning() << "Create temporary dir failed";
+        return 1;
+    }
+    const Check checks[] = {
+        // first, so the listener starts while Devices() scans.
+        {"DeviceMonitor", checkDeviceMonitor},
+        {"FormatFat32", checkFormatFat32},
+        {"FatVolume", checkFatVolume},
+        {"IsoImage", checkIsoImage},
+    };
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); ++i) {
+        QString workDir = QDir(tmp.path()).filePath(checks[i].name);
+        QString errmsg;
+        if (QDir().mkpath(workDir) && checks[i].run(workDir, errmsg)) {
+            qDebug() << "PASS" << checks[i].name;
+        } else {
+            qWarning() << "FAIL" << checks[i].name << errmsg;
+            ++failed;
+        }
+    }
+    return failed ? 1 : 0;
+}
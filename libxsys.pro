@@ -3,4 +3,6 @@ TEMPLATE = subdirs
 CONFIG += ordered
 
 SUBDIRS += src \
-    example
+    example \
+    bench \
+    check
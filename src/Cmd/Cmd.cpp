@@ -1,6 +1,7 @@
 #include "Cmd.h"
 
 #include "../Common/Result.h"
+#include "../Common/Trace.h"
 #include "../FileSystem/FileSystem.h"
 
 #include <QDebug>
@@ -8,6 +9,26 @@
 #include <QTextStream>
 #include <QFile>
 #include <QProcess>
+#include <QTimer>
+#include <QEventLoop>
+#include <QElapsedTimer>
+#include <QVector>
+
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+extern char **environ;
+#endif
 
 namespace XSys {
 
@@ -15,6 +36,8 @@ namespace XSys {
 static Result runApp(const QString &execPath, const QString &execParam, const QString &execPipeIn="") {
  //   QString outPipePath = FS::TmpFilePath("pipeOut");
 
+    QElapsedTimer timer;
+    timer.start();
     QProcess app;
     app.setStandardInputFile(execPipeIn);
 //    app.setStandardOutputFile(outPipePath);
@@ -31,13 +54,15 @@ static Result runApp(const QString &execPath, const QString &execParam, const QS
     }
 
     if (QProcess::NormalExit != app.exitStatus()) {
-        qWarning()<<"Cmd Exec Failed:"<<app.readAllStandardError();
-        return Result(Result::Faiiled, app.readAllStandardError(), "", app.program());
+        QByteArray error = app.readAllStandardError();
+        qWarning()<<"Cmd Exec Failed:"<<error;
+        return Result::fromOutput(Result::Faiiled, error, QByteArray(), app.program(), -1, timer.elapsed());
     }
 
     if (0 != app.exitCode()) {
-        qWarning()<<"Cmd Exec Failed:"<<app.readAllStandardError();
-        return Result(Result::Faiiled, app.readAllStandardError(), "", app.program());
+        QByteArray error = app.readAllStandardError();
+        qWarning()<<"Cmd Exec Failed:"<<error;
+        return Result::fromOutput(Result::Faiiled, error, QByteArray(), app.program(), app.exitCode(), timer.elapsed());
     }
 //    QFile locale(outPipePath);
 //    if (!locale.open(QIODevice::ReadOnly)) {
@@ -62,14 +87,373 @@ static Result runApp(const QString &execPath, const QString &execParam, const QS
 
 //    locale.remove();
 //    utf8.remove();
-    Result rest (Result::Success, app.readAllStandardError(), app.readAllStandardOutput());
-    return rest;
+    QByteArray error = app.readAllStandardError();
+    return Result::fromOutput(Result::Success, error, app.readAllStandardOutput(), app.program(), 0, timer.elapsed());
+}
+
+#ifdef Q_OS_UNIX
+static bool cloexecPipe(int fds[2]) {
+    if (0 != pipe(fds)) {
+        return false;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+}
+
+static void closeFd(int &fd) {
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+// a child that exits early must not kill us with SIGPIPE, but the process
+// wide disposition belongs to the application: SIGPIPE is blocked in this
+// thread for the write, and one raised by it is consumed before unblocking.
+static ssize_t writeNoSigpipe(int fd, const char *data, size_t size) {
+    sigset_t pipeSet;
+    sigset_t oldSet;
+    sigset_t pending;
+    sigemptyset(&pipeSet);
+    sigaddset(&pipeSet, SIGPIPE);
+    sigemptyset(&pending);
+    sigpending(&pending);
+    bool wasPending = sigismember(&pending, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeSet, &oldSet);
+    ssize_t n = ::write(fd, data, size);
+    int err = errno;
+    if (n < 0 && EPIPE == err && !wasPending) {
+        struct timespec zero = {0, 0};
+        while (sigtimedwait(&pipeSet, NULL, &zero) < 0 && EINTR == errno) {}
+    }
+    pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+    errno = err;
+    return n;
+}
+
+// drain stdout and stderr and feed stdin until all pipes are closed.
+static void pumpPipes(int &inFd, int &outFd, int &errFd, const QByteArray &input,
+                      QByteArray &output, QByteArray &error) {
+    qint64 inOffset = 0;
+    char buffer[16 * 1024];
+    while (inFd >= 0 || outFd >= 0 || errFd >= 0) {
+        struct pollfd pfds[3];
+        int *fds[3] = {&inFd, &outFd, &errFd};
+        nfds_t count = 0;
+        int index[3];
+        for (int i = 0; i < 3; ++i) {
+            if (*fds[i] < 0) continue;
+            pfds[count].fd = *fds[i];
+            pfds[count].events = (0 == i) ? POLLOUT : POLLIN;
+            pfds[count].revents = 0;
+            index[count++] = i;
+        }
+        if (poll(pfds, count, -1) < 0) {
+            if (EINTR == errno) continue;
+            break;
+        }
+        for (nfds_t i = 0; i < count; ++i) {
+            if (!pfds[i].revents) continue;
+            int &fd = *fds[index[i]];
+            if (0 == index[i]) {
+                ssize_t n = writeNoSigpipe(fd, input.constData() + inOffset, input.size() - inOffset);
+                if (n > 0) inOffset += n;
+                if ((n < 0 && EINTR != errno && EAGAIN != errno) || inOffset >= input.size()) closeFd(fd);
+                continue;
+            }
+            ssize_t n = ::read(fd, buffer, sizeof(buffer));
+            if (n > 0) {
+                (1 == index[i] ? output : error).append(buffer, n);
+            } else if (0 == n || (EINTR != errno && EAGAIN != errno)) {
+                closeFd(fd);
+            }
+        }
+    }
+    closeFd(inFd);
+    closeFd(outFd);
+    closeFd(errFd);
+}
+#endif
+
+static Result spawnProcess(const QStringList &argv, const SpawnOptions &options) {
+    QString cmd = argv.join(" ");
+    QElapsedTimer timer;
+    timer.start();
+#ifdef Q_OS_UNIX
+    QList<QByteArray> args;
+    QVector<char *> argp;
+    Q_FOREACH(const QString &arg, argv) {
+        args.append(arg.toLocal8Bit());
+        argp.append(args.last().data());
+    }
+    argp.append(NULL);
+    QList<QByteArray> envs;
+    QVector<char *> envp;
+    Q_FOREACH(const QString &env, options.env) {
+        envs.append(env.toLocal8Bit());
+        envp.append(envs.last().data());
+    }
+    envp.append(NULL);
+
+    int inPipe[2] = {-1, -1};
+    int outPipe[2] = {-1, -1};
+    int errPipe[2] = {-1, -1};
+    bool feedStdin = options.stdinFile.isEmpty() && !options.stdinData.isEmpty();
+    if (!cloexecPipe(outPipe) || !cloexecPipe(errPipe) || (feedStdin && !cloexecPipe(inPipe))) {
+        QString errmsg = QString::fromLocal8Bit(strerror(errno));
+        for (int i = 0; i < 2; ++i) {
+            closeFd(inPipe[i]);
+            closeFd(outPipe[i]);
+            closeFd(errPipe[i]);
+        }
+        return Result(Result::Faiiled, "Create Pipe Failed: " + errmsg, "", cmd);
+    }
+    if (feedStdin) {
+        fcntl(inPipe[1], F_SETFL, O_NONBLOCK);
+    }
+
+    QByteArray stdinPath = options.stdinFile.isEmpty() ? QByteArray("/dev/null") : options.stdinFile.toLocal8Bit();
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (feedStdin) {
+        posix_spawn_file_actions_adddup2(&actions, inPipe[0], 0);
+    } else {
+        posix_spawn_file_actions_addopen(&actions, 0, stdinPath.constData(), O_RDONLY, 0);
+    }
+    posix_spawn_file_actions_adddup2(&actions, outPipe[1], 1);
+    posix_spawn_file_actions_adddup2(&actions, errPipe[1], 2);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+#ifdef POSIX_SPAWN_USEVFORK
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_USEVFORK);
+#endif
+
+    pid_t pid = -1;
+    int rc = posix_spawnp(&pid, argp.at(0), &actions, &attr, argp.data(),
+                          options.env.isEmpty() ? environ : envp.data());
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    closeFd(inPipe[0]);
+    closeFd(outPipe[1]);
+    closeFd(errPipe[1]);
+    if (0 != rc) {
+        closeFd(inPipe[1]);
+        closeFd(outPipe[0]);
+        closeFd(errPipe[0]);
+        qWarning()<<"Cmd Exec Failed:"<<cmd<<strerror(rc);
+        return Result(Result::Faiiled, QString::fromLocal8Bit(strerror(rc)), "", cmd);
+    }
+
+    QByteArray output;
+    QByteArray error;
+    pumpPipes(inPipe[1], outPipe[0], errPipe[0], options.stdinData, output, error);
+
+    int status = 0;
+    pid_t waited;
+    while ((waited = waitpid(pid, &status, 0)) < 0 && EINTR == errno) {}
+    if (waited != pid) {
+        // ECHILD when the application reaps children itself, e.g. SIGCHLD
+        // set to SIG_IGN, the exit status is lost then.
+        QString errmsg = QString::fromLocal8Bit(strerror(errno));
+        qWarning()<<"Cmd Wait Failed:"<<cmd<<errmsg;
+        return Result::fromOutput(Result::Faiiled, "Wait Process Failed: " + errmsg.toLocal8Bit(), output, cmd, -1, timer.elapsed());
+    }
+    int exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    if (0 != exitCode) {
+        qWarning()<<"Cmd Exec Failed:"<<cmd<<error;
+        return Result::fromOutput(Result::Faiiled, error, QByteArray(), cmd, exitCode, timer.elapsed());
+    }
+    return Result::fromOutput(Result::Success, error, output, cmd, exitCode, timer.elapsed());
+#else
+    QProcess app;
+    if (!options.env.isEmpty()) {
+        app.setEnvironment(options.env);
+    }
+    if (!options.stdinFile.isEmpty()) {
+        app.setStandardInputFile(options.stdinFile);
+    }
+    app.start(argv.first(), argv.mid(1));
+    if (!app.waitForStarted()) {
+        qWarning()<<"Cmd Exec Failed:"<<app.errorString();
+        return Result(Result::Faiiled, app.errorString(), "", cmd);
+    }
+    if (!options.stdinData.isEmpty()) {
+        app.write(options.stdinData);
+    }
+    app.closeWriteChannel();
+    bool exited = app.waitForFinished(-1) && QProcess::NormalExit == app.exitStatus();
+    int exitCode = exited ? app.exitCode() : -1;
+    QByteArray error = app.readAllStandardError();
+    if (0 != exitCode) {
+        qWarning()<<"Cmd Exec Failed:"<<cmd<<error;
+        return Result::fromOutput(Result::Faiiled, error, QByteArray(), cmd, exitCode, timer.elapsed());
+    }
+    return Result::fromOutput(Result::Success, error, app.readAllStandardOutput(), cmd, exitCode, timer.elapsed());
+#endif
+}
+
+Result Spawn(const QStringList &argv, const SpawnOptions &options) {
+    if (argv.isEmpty()) {
+        return Result(Result::Faiiled, "Spawn Without Program");
+    }
+    Trace::Span span("cmd", argv.first());
+    if (span.isActive()) {
+        span.setArg("argv", argv.join(" "));
+    }
+    Result ret = spawnProcess(argv, options);
+    if (span.isActive()) {
+        span.setBytes(ret.rawResult().size() + ret.rawErrmsg().size());
+        span.setResult(ret);
+    }
+    return ret;
 }
 
 Result SynExec(const QString &exec, const QString &param, const QString &execPipeIn) {
+    Trace::Span span("cmd", exec);
+    span.setArg("param", param);
     Result ret = runApp(exec, param, execPipeIn);
-    qDebug()<<exec<<param<<execPipeIn<<ret.isSuccess()<<ret.errmsg();
+    if (span.isActive()) {
+        span.setBytes(ret.rawResult().size() + ret.rawErrmsg().size());
+        span.setResult(ret);
+    }
     return ret;
 }
 
+ExecOptions::ExecOptions()
+    : timeout(0) {
+}
+
+ExecHandle::ExecHandle(const ExecOptions &options, QObject *parent)
+    : QObject(parent), options_(options), process_(new QProcess(this)),
+      timer_(new QTimer(this)), finished_(false) {
+    timer_->setSingleShot(true);
+    connect(process_, SIGNAL(readyReadStandardOutput()), this, SLOT(onReadyReadStandardOutput()));
+    connect(process_, SIGNAL(readyReadStandardError()), this, SLOT(onReadyReadStandardError()));
+    connect(process_, SIGNAL(error(QProcess::ProcessError)), this, SLOT(onError(QProcess::ProcessError)));
+    connect(process_, SIGNAL(finished(int,QProcess::ExitStatus)), this, SLOT(onFinished(int,QProcess::ExitStatus)));
+    connect(timer_, SIGNAL(timeout()), this, SLOT(onTimeout()));
+}
+
+ExecHandle::~ExecHandle() {
+    if (!finished_) {
+        process_->disconnect(this);
+        process_->kill();
+        process_->waitForFinished();
+    }
+}
+
+void ExecHandle::start(const QString &exec, const QString &param) {
+    process_->setStandardInputFile(options_.pipeIn);
+    process_->start(exec + " " + param);
+    elapsed_.start();
+    if (options_.timeout > 0) {
+        timer_->start(options_.timeout);
+    }
+}
+
+void ExecHandle::cancel() {
+    if (finished_) {
+        return;
+    }
+    abortReason_ = "Canceled";
+    process_->kill();
+}
+
+bool ExecHandle::isFinished() const {
+    return finished_;
+}
+
+bool ExecHandle::waitForFinished(int msecs) {
+    if (finished_) {
+        return true;
+    }
+    QEventLoop loop;
+    connect(this, SIGNAL(finished()), &loop, SLOT(quit()));
+    if (msecs >= 0) {
+        QTimer::singleShot(msecs, &loop, SLOT(quit()));
+    }
+    loop.exec();
+    return finished_;
+}
+
+const Result& ExecHandle::result() const {
+    return result_;
+}
+
+void ExecHandle::onReadyReadStandardOutput() {
+    QByteArray chunk = process_->readAllStandardOutput();
+    if (options_.onStdout) {
+        options_.onStdout(chunk);
+    } else {
+        stdout_.append(chunk);
+    }
+}
+
+void ExecHandle::onReadyReadStandardError() {
+    QByteArray chunk = process_->readAllStandardError();
+    if (options_.onStderr) {
+        options_.onStderr(chunk);
+    } else {
+        stderr_.append(chunk);
+    }
+}
+
+void ExecHandle::onError(QProcess::ProcessError error) {
+    // only a failed start never reaches finished().
+    if (QProcess::FailedToStart == error) {
+        qWarning()<<"Cmd Exec Failed:"<<process_->errorString();
+        finish(Result(Result::Faiiled, process_->errorString(), "", process_->program()));
+    }
+}
+
+void ExecHandle::onFinished(int exitCode, QProcess::ExitStatus exitStatus) {
+    onReadyReadStandardOutput();
+    onReadyReadStandardError();
+    if (!abortReason_.isEmpty()) {
+        finish(Result::fromOutput(Result::Faiiled, abortReason_.toUtf8(), QByteArray(), process_->program(),
+                                  -1, elapsed_.elapsed()));
+        return;
+    }
+    if (QProcess::NormalExit != exitStatus) {
+        exitCode = -1;
+    }
+    if (0 != exitCode) {
+        qWarning()<<"Cmd Exec Failed:"<<stderr_;
+        finish(Result::fromOutput(Result::Faiiled, stderr_, QByteArray(), process_->program(),
+                                  exitCode, elapsed_.elapsed()));
+        return;
+    }
+    finish(Result::fromOutput(Result::Success, stderr_, stdout_, process_->program(), exitCode, elapsed_.elapsed()));
+}
+
+void ExecHandle::onTimeout() {
+    if (finished_) {
+        return;
+    }
+    abortReason_ = "Timeout";
+    process_->kill();
+}
+
+void ExecHandle::finish(const Result &r) {
+    if (finished_) {
+        return;
+    }
+    finished_ = true;
+    timer_->stop();
+    result_ = r;
+    stdout_.clear();
+    stderr_.clear();
+    if (options_.onFinished) {
+        options_.onFinished(result_);
+    }
+    emit finished();
+}
+
+ExecHandle *AsynExec(const QString &exec, const QString &param, const ExecOptions &options, QObject *parent) {
+    ExecHandle *handle = new ExecHandle(options, parent);
+    handle->start(exec, param);
+    return handle;
+}
+
 }
@@ -1,11 +1,84 @@
 #pragma once
 
-class QString;
+#include <QObject>
+#include <QByteArray>
+#include <QStringList>
+#include <QProcess>
+#include <QElapsedTimer>
+#include <functional>
 
 #include "../Common/Result.h"
 
+class QString;
+class QTimer;
+
 namespace XSys {
 
 Result SynExec(const QString &exec, const QString &param, const QString &execPipeIn="");
 
+struct SpawnOptions {
+    // "KEY=VALUE" entries replacing the environment, empty inherits it.
+    QStringList env;
+    // stdin of the child, a file path or the bytes to feed it; /dev/null otherwise.
+    QString stdinFile;
+    QByteArray stdinData;
+};
+
+// run argv[0] with argv as is, no shell and no re-splitting of arguments.
+// Blocks without an event loop, result() is stdout and errmsg() is stderr.
+Result Spawn(const QStringList &argv, const SpawnOptions &options = SpawnOptions());
+
+struct ExecOptions {
+    ExecOptions();
+
+    QString pipeIn;
+    // kill the command after timeout msecs, 0 means never.
+    int timeout;
+    // output chunks as they arrive, when set the stream is not kept in result().
+    std::function<void(const QByteArray &)> onStdout;
+    std::function<void(const QByteArray &)> onStderr;
+    std::function<void(const Result &)> onFinished;
+};
+
+// a running command, driven by the event loop of the thread that created it.
+class ExecHandle : public QObject {
+    Q_OBJECT
+public:
+    explicit ExecHandle(const ExecOptions &options, QObject *parent = 0);
+    ~ExecHandle();
+
+    void start(const QString &exec, const QString &param);
+    void cancel();
+    bool isFinished() const;
+    bool waitForFinished(int msecs = -1);
+    const Result& result() const;
+
+signals:
+    void finished();
+
+private slots:
+    void onReadyReadStandardOutput();
+    void onReadyReadStandardError();
+    void onError(QProcess::ProcessError error);
+    void onFinished(int exitCode, QProcess::ExitStatus exitStatus);
+    void onTimeout();
+
+private:
+    void finish(const Result &r);
+
+    ExecOptions options_;
+    QProcess *process_;
+    QTimer *timer_;
+    QElapsedTimer elapsed_;
+    QByteArray stdout_;
+    QByteArray stderr_;
+    QString abortReason_;
+    Result result_;
+    bool finished_;
+};
+
+// start exec without blocking, the caller owns the returned handle.
+ExecHandle *AsynExec(const QString &exec, const QString &param,
+                     const ExecOptions &options = ExecOptions(), QObject *parent = 0);
+
 }
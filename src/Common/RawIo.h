@@ -0,0 +1,75 @@
+#pragma once
+
+// helpers shared by the code that reads and writes on disk structures
+// itself, not part of the public XSys headers.
+
+#include <QtGlobal>
+#include <QString>
+
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#endif
+
+namespace XSys {
+
+namespace RawIo {
+
+inline quint16 le16(const uchar *p) {
+    return quint16(p[0]) | (quint16(p[1]) << 8);
+}
+
+inline quint32 le32(const uchar *p) {
+    return quint32(p[0]) | (quint32(p[1]) << 8) | (quint32(p[2]) << 16) | (quint32(p[3]) << 24);
+}
+
+inline void put16(char *p, quint16 v) {
+    p[0] = char(v);
+    p[1] = char(v >> 8);
+}
+
+inline void put32(char *p, quint32 v) {
+    p[0] = char(v);
+    p[1] = char(v >> 8);
+    p[2] = char(v >> 16);
+    p[3] = char(v >> 24);
+}
+
+#ifdef Q_OS_UNIX
+// the whole range or false with errmsg set, short transfers are retried.
+inline bool preadAll(int fd, char *data, qint64 size, qint64 offset, QString &errmsg) {
+    while (size > 0) {
+        ssize_t n = ::pread(fd, data, size, offset);
+        if (n < 0 && EINTR == errno) continue;
+        if (n <= 0) {
+            errmsg = n < 0 ? QString::fromLocal8Bit(strerror(errno)) : QString("Unexpected end of device");
+            return false;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+inline bool pwriteAll(int fd, const char *data, qint64 size, qint64 offset, QString &errmsg) {
+    while (size > 0) {
+        ssize_t n = ::pwrite(fd, data, size, offset);
+        if (n < 0 && EINTR == errno) continue;
+        if (n <= 0) {
+            errmsg = n < 0 ? QString::fromLocal8Bit(strerror(errno)) : QString("Write returned zero bytes");
+            return false;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+#endif
+
+}
+
+}
@@ -4,27 +4,77 @@
 
 namespace XSys {
 
-Result::Result() {
-    this->code_ = Success;
+Result::Text::Text(const QString &text) {
+    if (!text.isEmpty()) {
+        data_ = std::make_shared<Data>();
+        data_->text = text;
+        data_->fromRaw = false;
+    }
 }
 
-Result::Result(int code, const QString &errmsg, const QString &result, const QString &cmd) {
-    this->code_ = code;
-    this->errmsg_ = errmsg;
-    this->result_ = result;
-    this->cmd_ = cmd;
+Result::Text::Text(const QByteArray &raw) {
+    if (!raw.isEmpty()) {
+        data_ = std::make_shared<Data>();
+        data_->raw = raw;
+        data_->fromRaw = true;
+    }
 }
 
-Result::Result(const Result &r) {
-    this->code_ = r.code_;
-    this->errmsg_ = r.errmsg_;
-    this->result_ = r.result_;
-    this->cmd_ = r.cmd_;
+const QString& Result::Text::text() const {
+    static const QString empty;
+    if (!data_) {
+        return empty;
+    }
+    Data *d = data_.get();
+    std::call_once(d->textOnce, [d]() {
+        if (d->fromRaw) d->text = QString::fromUtf8(d->raw);
+    });
+    return d->text;
 }
 
+const QByteArray& Result::Text::raw() const {
+    static const QByteArray empty;
+    if (!data_) {
+        return empty;
+    }
+    Data *d = data_.get();
+    std::call_once(d->rawOnce, [d]() {
+        if (!d->fromRaw) d->raw = d->text.toUtf8();
+    });
+    return d->raw;
+}
+
+Result::Result()
+    : code_(Success), exitCode_(0), duration_(0) {
+}
+
+Result::Result(int code, const QString &errmsg, const QString &result, const QString &cmd)
+    : code_(code), exitCode_(0), duration_(0), errmsg_(errmsg), result_(result), cmd_(cmd) {
+}
+
+Result::Result(const Result &r) = default;
+
+Result::Result(Result &&r) = default;
+
 Result::~Result() {
 }
 
+Result& Result::operator=(const Result &r) = default;
+
+Result& Result::operator=(Result &&r) = default;
+
+Result Result::fromOutput(int code, const QByteArray &stderrData, const QByteArray &stdoutData,
+                          const QString &cmd, int exitCode, qint64 duration) {
+    Result r;
+    r.code_ = code;
+    r.exitCode_ = exitCode;
+    r.duration_ = duration;
+    r.errmsg_ = Text(stderrData);
+    r.result_ = Text(stdoutData);
+    r.cmd_ = cmd;
+    return r;
+}
+
 bool Result::isSuccess() const {
     return (Success == this->code_);
 }
@@ -33,16 +83,32 @@ int Result::code() const{
     return this->code_;
 }
 
+int Result::exitCode() const{
+    return this->exitCode_;
+}
+
+qint64 Result::duration() const{
+    return this->duration_;
+}
+
 const QString& Result::cmd() const{
     return this->cmd_;
 }
 
 const QString& Result::errmsg() const{
-    return this->errmsg_;
+    return this->errmsg_.text();
 }
 
 const QString& Result::result() const{
-    return this->result_;
+    return this->result_.text();
+}
+
+const QByteArray& Result::rawErrmsg() const{
+    return this->errmsg_.raw();
+}
+
+const QByteArray& Result::rawResult() const{
+    return this->result_.raw();
 }
 
 
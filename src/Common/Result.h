@@ -1,6 +1,10 @@
 #pragma once
 
 #include <QString>
+#include <QByteArray>
+
+#include <memory>
+#include <mutex>
 
 namespace XSys {
 
@@ -14,18 +18,59 @@ public:
     Result();
     Result(int code, const QString &msg, const QString &result="", const QString &cmd="");
     Result(const Result &r);
+    Result(Result &&r);
     ~Result();
 
+    Result& operator=(const Result &r);
+    Result& operator=(Result &&r);
+
+    // output of a command kept as the raw bytes, errmsg() and result()
+    // decode them on first use only.
+    static Result fromOutput(int code, const QByteArray &stderrData, const QByteArray &stdoutData,
+                             const QString &cmd, int exitCode = 0, qint64 duration = 0);
+
     bool isSuccess() const;
     int code() const;
+    // exit code of the command, -1 when it crashed or never ran.
+    int exitCode() const;
+    // wall time of the command in msecs.
+    qint64 duration() const;
     const QString& cmd() const;
     const QString& errmsg() const;
     const QString& result() const;
+    const QByteArray& rawErrmsg() const;
+    const QByteArray& rawResult() const;
 
 private:
+    // text held as bytes or as QString, the other form is made on demand.
+    // Like the implicit QString conversions the bytes are UTF-8. Copies
+    // share one Data, so a form is made once and reading a Result from
+    // several threads is safe.
+    class Text {
+    public:
+        Text() {}
+        explicit Text(const QString &text);
+        explicit Text(const QByteArray &raw);
+
+        const QString& text() const;
+        const QByteArray& raw() const;
+
+    private:
+        struct Data {
+            QString text;
+            QByteArray raw;
+            bool fromRaw;
+            std::once_flag textOnce;
+            std::once_flag rawOnce;
+        };
+        std::shared_ptr<Data> data_;
+    };
+
     int code_;
-    QString errmsg_;
-    QString result_;
+    int exitCode_;
+    qint64 duration_;
+    Text errmsg_;
+    Text result_;
     QString cmd_;
 };
 
@@ -0,0 +1,174 @@
+#include "TaskGraph.h"
+#include "Trace.h"
+
+#include <QHash>
+#include <QVector>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QElapsedTimer>
+
+namespace {
+
+using XSys::Result;
+
+// bookkeeping of one run(), guarded by mutex.
+struct GraphState {
+    GraphState() : running(0), failed(false) {}
+
+    QMutex mutex;
+    QWaitCondition changed;
+    QElapsedTimer timer;
+    QList<int> finished;
+    QVector<Result> results;
+    int running;
+    bool failed;
+};
+
+class StepRunner : public QRunnable {
+public:
+    StepRunner(GraphState *state, int index, const QString &name, const XSys::TaskGraph::Step &step)
+        : state_(state), index_(index), name_(name), step_(step) {}
+
+    void run() {
+        XSys::Trace::Span span("step", name_);
+        Result ret = step_();
+        span.setResult(ret);
+        QMutexLocker locker(&state_->mutex);
+        state_->results[index_] = ret;
+        state_->finished.append(index_);
+        state_->changed.wakeAll();
+    }
+
+private:
+    GraphState *state_;
+    int index_;
+    QString name_;
+    XSys::TaskGraph::Step step_;
+};
+
+}
+
+namespace XSys {
+
+TaskGraph::TaskGraph(int threads)
+    : threads_(threads) {
+}
+
+void TaskGraph::addStep(const QString &name, const Step &step, const QStringList &deps) {
+    Node node;
+    node.name = name;
+    node.step = step;
+    node.deps = deps;
+    nodes_.append(node);
+}
+
+const QList<TaskGraph::StepTiming>& TaskGraph::timings() const {
+    return timings_;
+}
+
+Result TaskGraph::run() {
+    timings_.clear();
+
+    // resolve names, count unmet dependencies and collect the dependents.
+    QHash<QString, int> index;
+    for (int i = 0; i < nodes_.size(); ++i) {
+        if (index.contains(nodes_.at(i).name)) {
+            return Result(Result::Faiiled, "Duplicate Step: " + nodes_.at(i).name, "", nodes_.at(i).name);
+        }
+        index.insert(nodes_.at(i).name, i);
+    }
+    QVector<int> pending(nodes_.size(), 0);
+    QVector<QList<int> > dependents(nodes_.size());
+    for (int i = 0; i < nodes_.size(); ++i) {
+        Q_FOREACH(const QString &dep, nodes_.at(i).deps) {
+            if (!index.contains(dep)) {
+                return Result(Result::Faiiled, "Unknown Dependency: " + nodes_.at(i).name + " -> " + dep,
+                              "", nodes_.at(i).name);
+            }
+            pending[i]++;
+            dependents[index.value(dep)].append(i);
+        }
+    }
+
+    // reject cycles up front, so run() can never wait forever.
+    QVector<int> indegree = pending;
+    QList<int> queue;
+    for (int i = 0; i < nodes_.size(); ++i) {
+        if (0 == indegree.at(i)) queue.append(i);
+    }
+    int ordered = 0;
+    while (!queue.isEmpty()) {
+        int i = queue.takeFirst();
+        ordered++;
+        Q_FOREACH(int d, dependents.at(i)) {
+            if (0 == --indegree[d]) queue.append(d);
+        }
+    }
+    if (ordered != nodes_.size()) {
+        return Result(Result::Faiiled, "Dependency Cycle In Task Graph");
+    }
+
+    GraphState state;
+    state.results.resize(nodes_.size());
+    QVector<int> timingIndex(nodes_.size(), -1);
+    QThreadPool pool;
+    pool.setMaxThreadCount(threads_ > 0 ? threads_ : qMax(2, QThread::idealThreadCount()));
+    state.timer.start();
+
+    QList<int> ready;
+    for (int i = 0; i < nodes_.size(); ++i) {
+        if (0 == pending.at(i)) ready.append(i);
+    }
+
+    Result failure;
+    QMutexLocker locker(&state.mutex);
+    for (;;) {
+        while (!state.failed && !ready.isEmpty()) {
+            int i = ready.takeFirst();
+            StepTiming timing;
+            timing.name = nodes_.at(i).name;
+            timing.startMs = state.timer.elapsed();
+            timingIndex[i] = timings_.size();
+            timings_.append(timing);
+            state.running++;
+            pool.start(new StepRunner(&state, i, nodes_.at(i).name, nodes_.at(i).step));
+        }
+        if (0 == state.running) {
+            break;
+        }
+        while (state.finished.isEmpty()) {
+            state.changed.wait(&state.mutex);
+        }
+        while (!state.finished.isEmpty()) {
+            int i = state.finished.takeFirst();
+            state.running--;
+            const Result &ret = state.results.at(i);
+            StepTiming &timing = timings_[timingIndex.at(i)];
+            timing.durationMs = state.timer.elapsed() - timing.startMs;
+            timing.success = ret.isSuccess();
+            if (!ret.isSuccess()) {
+                if (!state.failed) {
+                    failure = Result::fromOutput(ret.code(), nodes_.at(i).name.toUtf8() + ": " + ret.rawErrmsg(),
+                                                 ret.rawResult(), nodes_.at(i).name, ret.exitCode(), ret.duration());
+                }
+                state.failed = true;
+                continue;
+            }
+            Q_FOREACH(int d, dependents.at(i)) {
+                if (0 == --pending[d]) ready.append(d);
+            }
+        }
+    }
+    locker.unlock();
+    pool.waitForDone();
+
+    if (state.failed) {
+        return failure;
+    }
+    return Result(Result::Success, "");
+}
+
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <QString>
+#include <QStringList>
+#include <QList>
+#include <functional>
+
+#include "Result.h"
+
+namespace XSys {
+
+// runs named steps once their dependencies succeeded, independent steps
+// run concurrently. The first failed step stops scheduling new steps.
+class TaskGraph {
+public:
+    typedef std::function<Result()> Step;
+
+    struct StepTiming {
+        StepTiming() : startMs(0), durationMs(0), success(false) {}
+
+        QString name;
+        // relative to the start of run()
+        qint64 startMs;
+        qint64 durationMs;
+        bool success;
+    };
+
+    // threads 0 means QThread::idealThreadCount().
+    explicit TaskGraph(int threads = 0);
+
+    void addStep(const QString &name, const Step &step, const QStringList &deps = QStringList());
+
+    // block until every step ran or one failed. A failure is returned as
+    // the step Result with the step name prefixed and put in cmd().
+    Result run();
+
+    // steps that started, in start order.
+    const QList<StepTiming>& timings() const;
+
+private:
+    struct Node {
+        QString name;
+        Step step;
+        QStringList deps;
+    };
+
+    int threads_;
+    QList<Node> nodes_;
+    QList<StepTiming> timings_;
+};
+
+}
@@ -0,0 +1,229 @@
+#include "Trace.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThread>
+#include <QVector>
+#include <QFile>
+#include <QDebug>
+
+namespace {
+
+// older events are kept, the ones past the limit are counted and dropped.
+const int MaxEvents = 1 << 18;
+
+struct Event {
+    const char *category;
+    QString name;
+    QList<QPair<const char *, QString> > args;
+    qint64 start;
+    qint64 duration;
+    qint64 bytes;
+    quintptr tid;
+    bool success;
+};
+
+struct TraceBuffer {
+    TraceBuffer() : dropped(0) {
+        clock.start();
+    }
+
+    // nsecs since the buffer was created, shared by every thread.
+    qint64 now() const {
+        return clock.nsecsElapsed();
+    }
+
+    QElapsedTimer clock;
+    QMutex mutex;
+    QVector<Event> events;
+    qint64 dropped;
+};
+
+QAtomicInt enabledFlag(qgetenv("XSYS_TRACE") == "1" ? 1 : 0);
+
+TraceBuffer &buffer() {
+    static TraceBuffer traceBuffer;
+    return traceBuffer;
+}
+
+void appendJsonString(QByteArray &out, const QString &str) {
+    out.append('"');
+    QByteArray utf8 = str.toUtf8();
+    for (int i = 0; i < utf8.size(); ++i) {
+        char c = utf8.at(i);
+        switch (c) {
+        case '"': out.append("\\\""); break;
+        case '\\': out.append("\\\\"); break;
+        case '\n': out.append("\\n"); break;
+        case '\r': out.append("\\r"); break;
+        case '\t': out.append("\\t"); break;
+        default:
+            if (uchar(c) < 0x20) {
+                out.append(QString("\\u%1").arg(uchar(c), 4, 16, QChar('0')).toLatin1());
+            } else {
+                out.append(c);
+            }
+        }
+    }
+    out.append('"');
+}
+
+}
+
+namespace XSys {
+
+namespace Trace {
+
+void SetEnabled(bool enabled) {
+    if (enabled) {
+        // start the clock before the first span.
+        buffer();
+    }
+    enabledFlag.storeRelease(enabled ? 1 : 0);
+}
+
+bool IsEnabled() {
+    return 0 != enabledFlag.loadAcquire();
+}
+
+void Clear() {
+    TraceBuffer &traceBuffer = buffer();
+    QMutexLocker locker(&traceBuffer.mutex);
+    traceBuffer.events.clear();
+    traceBuffer.dropped = 0;
+}
+
+QByteArray ExportChromeTrace() {
+    TraceBuffer &traceBuffer = buffer();
+    QVector<Event> events;
+    qint64 dropped = 0;
+    {
+        QMutexLocker locker(&traceBuffer.mutex);
+        events = traceBuffer.events;
+        dropped = traceBuffer.dropped;
+    }
+
+    QByteArray pid = QByteArray::number(QCoreApplication::applicationPid());
+    QByteArray out;
+    out.reserve(events.size() * 160 + 64);
+    out.append("{\"traceEvents\":[");
+    for (int i = 0; i < events.size(); ++i) {
+        const Event &event = events.at(i);
+        if (i > 0) out.append(",\n");
+        out.append("{\"name\":");
+        appendJsonString(out, event.name);
+        out.append(",\"cat\":\"").append(event.category).append("\",\"ph\":\"X\"");
+        // trace-event timestamps are in usecs.
+        out.append(",\"ts\":").append(QByteArray::number(event.start / 1000.0, 'f', 3));
+        out.append(",\"dur\":").append(QByteArray::number(event.duration / 1000.0, 'f', 3));
+        out.append(",\"pid\":").append(pid);
+        out.append(",\"tid\":").append(QByteArray::number(quint64(event.tid)));
+        out.append(",\"args\":{\"success\":").append(event.success ? "true" : "false");
+        if (event.bytes >= 0) {
+            out.append(",\"bytes\":").append(QByteArray::number(event.bytes));
+        }
+        for (int j = 0; j < event.args.size(); ++j) {
+            out.append(",\"").append(event.args.at(j).first).append("\":");
+            appendJsonString(out, event.args.at(j).second);
+        }
+        out.append("}}");
+    }
+    out.append("],\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedEvents\":");
+    out.append(QByteArray::number(dropped)).append("}}\n");
+    return out;
+}
+
+bool ExportChromeTrace(const QString &filename) {
+    QFile file(filename);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Export Trace Failed:" << filename << file.errorString();
+        return false;
+    }
+    QByteArray data = ExportChromeTrace();
+    return data.size() == file.write(data);
+}
+
+Span::Span(const char *category, const char *name)
+    : active_(false) {
+    if (IsEnabled()) {
+        name_ = QString::fromLatin1(name);
+        begin(category);
+    }
+}
+
+Span::Span(const char *category, const QString &name)
+    : active_(false) {
+    if (IsEnabled()) {
+        name_ = name;
+        begin(category);
+    }
+}
+
+void Span::begin(const char *category) {
+    active_ = true;
+    success_ = true;
+    category_ = category;
+    bytes_ = -1;
+    start_ = buffer().now();
+}
+
+Span::~Span() {
+    if (!active_) {
+        return;
+    }
+    TraceBuffer &traceBuffer = buffer();
+    Event event;
+    event.category = category_;
+    event.name = name_;
+    event.args = args_;
+    event.start = start_;
+    event.duration = traceBuffer.now() - start_;
+    event.bytes = bytes_;
+    event.tid = quintptr(QThread::currentThreadId());
+    event.success = success_;
+
+    QMutexLocker locker(&traceBuffer.mutex);
+    if (traceBuffer.events.size() >= MaxEvents) {
+        traceBuffer.dropped++;
+        return;
+    }
+    traceBuffer.events.append(event);
+}
+
+void Span::setArg(const char *key, const QString &value) {
+    if (active_) {
+        args_.append(qMakePair(key, value));
+    }
+}
+
+void Span::setBytes(qint64 bytes) {
+    if (active_) {
+        bytes_ = bytes;
+    }
+}
+
+void Span::setSuccess(bool success) {
+    if (active_) {
+        success_ = success;
+    }
+}
+
+void Span::setResult(const Result &result) {
+    if (!active_) {
+        return;
+    }
+    success_ = result.isSuccess();
+    if (!result.isSuccess()) {
+        setArg("error", result.errmsg());
+    }
+    if (0 != result.exitCode()) {
+        setArg("exitCode", QString::number(result.exitCode()));
+    }
+}
+
+}
+
+}
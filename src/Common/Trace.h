@@ -0,0 +1,58 @@
+#pragma once
+
+#include <QString>
+#include <QByteArray>
+#include <QList>
+#include <QPair>
+
+#include "Result.h"
+
+namespace XSys {
+
+namespace Trace {
+
+// tracing is off unless enabled here or by XSYS_TRACE=1 in the environment,
+// a span then costs one atomic load.
+void SetEnabled(bool enabled);
+bool IsEnabled();
+
+// drop every recorded event.
+void Clear();
+
+// recorded spans as Chrome trace-event JSON, for chrome://tracing or Perfetto.
+QByteArray ExportChromeTrace();
+bool ExportChromeTrace(const QString &filename);
+
+// records one complete event from construction to destruction.
+class Span {
+public:
+    Span(const char *category, const char *name);
+    Span(const char *category, const QString &name);
+    ~Span();
+
+    bool isActive() const { return active_; }
+
+    // extra "args" of the event, ignored when inactive.
+    void setArg(const char *key, const QString &value);
+    void setBytes(qint64 bytes);
+    void setSuccess(bool success);
+    void setResult(const Result &result);
+
+private:
+    Span(const Span &);
+    Span& operator=(const Span &);
+
+    void begin(const char *category);
+
+    bool active_;
+    bool success_;
+    const char *category_;
+    QString name_;
+    QList<QPair<const char *, QString> > args_;
+    qint64 bytes_;
+    qint64 start_;
+};
+
+}
+
+}
@@ -0,0 +1,119 @@
+#include "BootSector.h"
+
+#include "../Common/Trace.h"
+
+#include <QDebug>
+#include <QFile>
+
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#endif
+
+namespace {
+
+using XSys::Result;
+
+Result transferSector(const QString &targetDev, char *sector, bool write) {
+#ifdef Q_OS_UNIX
+    int fd = ::open(targetDev.toLocal8Bit().constData(), (write ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0) {
+        return Result(Result::Faiiled, "Open " + targetDev + " Failed: " + QString::fromLocal8Bit(strerror(errno)), "", targetDev);
+    }
+    ssize_t n;
+    do {
+        n = write ? ::pwrite(fd, sector, XSys::DiskUtil::SectorSize, 0)
+                  : ::pread(fd, sector, XSys::DiskUtil::SectorSize, 0);
+    } while (n < 0 && EINTR == errno);
+    QString errmsg = n < 0 ? QString::fromLocal8Bit(strerror(errno)) : QString("short transfer");
+    if (n == XSys::DiskUtil::SectorSize && write && 0 != fsync(fd)) {
+        errmsg = QString::fromLocal8Bit(strerror(errno));
+        n = -1;
+    }
+    ::close(fd);
+    if (n != XSys::DiskUtil::SectorSize) {
+        return Result(Result::Faiiled, (write ? "Write " : "Read ") + targetDev + " Failed: " + errmsg, "", targetDev);
+    }
+    return Result(Result::Success, "", targetDev);
+#else
+    QFile device(targetDev);
+    if (!device.open(write ? QIODevice::ReadWrite : QIODevice::ReadOnly)) {
+        return Result(Result::Faiiled, "Open " + targetDev + " Failed: " + device.errorString(), "", targetDev);
+    }
+    qint64 n = write ? device.write(sector, XSys::DiskUtil::SectorSize)
+                     : device.read(sector, XSys::DiskUtil::SectorSize);
+    if (n != XSys::DiskUtil::SectorSize) {
+        return Result(Result::Faiiled, (write ? "Write " : "Read ") + targetDev + " Failed: " + device.errorString(), "", targetDev);
+    }
+    return Result(Result::Success, "", targetDev);
+#endif
+}
+
+Result ioSector(const QString &targetDev, char *sector, bool write) {
+    XSys::Trace::Span span("disk", write ? "WriteSector" : "ReadSector");
+    span.setArg("device", targetDev);
+    span.setBytes(XSys::DiskUtil::SectorSize);
+    Result ret = transferSector(targetDev, sector, write);
+    span.setResult(ret);
+    return ret;
+}
+
+}
+
+namespace XSys {
+
+namespace DiskUtil {
+
+Result ReadBootSector(const QString &targetDev, QByteArray &sector) {
+    sector.resize(SectorSize);
+    return ioSector(targetDev, sector.data(), false);
+}
+
+Result WriteBootSector(const QString &targetDev, const QByteArray &sector) {
+    if (SectorSize != sector.size()) {
+        return Result(Result::Faiiled, QString("Boot Sector Must Be %1 Bytes").arg(SectorSize), "", targetDev);
+    }
+    QByteArray data = sector;
+    return ioSector(targetDev, data.data(), true);
+}
+
+Result WriteMbrBootCode(const QString &disk, const QByteArray &code) {
+    QByteArray mbr;
+    Result ret = ReadBootSector(disk, mbr);
+    if (!ret.isSuccess()) {
+        return ret;
+    }
+    mbr.replace(0, qMin(code.size(), MbrBootCodeSize), code.left(MbrBootCodeSize));
+    mbr[510] = char(0x55);
+    mbr[511] = char(0xAA);
+    return WriteBootSector(disk, mbr);
+}
+
+Result ReadPbr(const QString &targetDev, QByteArray &pbr) {
+    return ReadBootSector(targetDev, pbr);
+}
+
+Result SetActivePartition(const QString &disk, int partition) {
+    if (partition < 1 || partition > 4) {
+        return Result(Result::Faiiled, QString("Invalid Primary Partition %1").arg(partition), "", disk);
+    }
+    QByteArray mbr;
+    Result ret = ReadBootSector(disk, mbr);
+    if (!ret.isSuccess()) {
+        return ret;
+    }
+    if (char(0x55) != mbr.at(510) || char(0xAA) != mbr.at(511)) {
+        return Result(Result::Faiiled, "No Partition Table On " + disk, "", disk);
+    }
+    for (int i = 0; i < 4; ++i) {
+        mbr[446 + i * 16] = char(i + 1 == partition ? 0x80 : 0x00);
+    }
+    return WriteBootSector(disk, mbr);
+}
+
+}
+
+}
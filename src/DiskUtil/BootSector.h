@@ -0,0 +1,27 @@
+#pragma once
+
+#include <QString>
+#include <QByteArray>
+
+#include "../Common/Result.h"
+
+namespace XSys {
+
+namespace DiskUtil {
+    const int SectorSize = 512;
+    // boot code area of the MBR, the disk signature and partition table follow it.
+    const int MbrBootCodeSize = 440;
+
+    // all of these work on a block device or on a plain image file.
+    Result ReadBootSector(const QString &targetDev, QByteArray &sector);
+    Result WriteBootSector(const QString &targetDev, const QByteArray &sector);
+
+    // replace the MBR boot code, keeping the signature and partition table bytes.
+    Result WriteMbrBootCode(const QString &disk, const QByteArray &code);
+    // the first sector of a partition, as dumped for ldlinux.bin.
+    Result ReadPbr(const QString &targetDev, QByteArray &pbr);
+    // mark primary partition 1..4 bootable and clear the flag on the others.
+    Result SetActivePartition(const QString &disk, int partition);
+}
+
+}
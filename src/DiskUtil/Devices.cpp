@@ -0,0 +1,464 @@
+#include "Devices.h"
+#include "MountTable.h"
+#include "Partitions.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMap>
+#include <QMutex>
+#include <QThread>
+
+#ifdef Q_OS_LINUX
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+namespace {
+
+using XSys::DiskUtil::BlockDevice;
+using XSys::DiskUtil::PartitionDevice;
+using XSys::DiskUtil::DeviceMonitor;
+
+#ifdef Q_OS_LINUX
+QString readAttr(const QString &path) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return "";
+    }
+    return QString::fromLocal8Bit(file.readAll()).trimmed();
+}
+
+// sysfs sizes count 512 byte sectors whatever the logical block size is.
+qint64 readSize(const QString &sysPath) {
+    return readAttr(sysPath + "/size").toLongLong() * 512;
+}
+
+void readDevNum(const QString &sysPath, quint32 &devMajor, quint32 &devMinor) {
+    QStringList devnum = readAttr(sysPath + "/dev").split(':');
+    if (2 == devnum.size()) {
+        devMajor = devnum.at(0).toUInt();
+        devMinor = devnum.at(1).toUInt();
+    }
+}
+
+bool isCandidate(const QString &name) {
+    return !name.isEmpty() && !name.startsWith("loop") && !name.startsWith("ram")
+            && !name.startsWith("zram");
+}
+
+// one disk from /sys/block, invalid when it is gone or has no media.
+BlockDevice scanDisk(const QString &name) {
+    BlockDevice disk;
+    QString sysPath = "/sys/block/" + name;
+    if (!isCandidate(name) || !QFileInfo(sysPath).exists()) {
+        return disk;
+    }
+    disk.size = readSize(sysPath);
+    if (disk.size <= 0) {
+        return disk;
+    }
+    disk.device = "/dev/" + name;
+    disk.removable = "1" == readAttr(sysPath + "/removable");
+    disk.readOnly = "1" == readAttr(sysPath + "/ro");
+    disk.vendor = readAttr(sysPath + "/device/vendor");
+    disk.model = readAttr(sysPath + "/device/model");
+
+    QStringList partitions = XSys::DiskUtil::ListPartitions(disk.device);
+    if (partitions.isEmpty()) {
+        // a stick formatted without a partition table.
+        partitions.append(disk.device);
+    }
+    Q_FOREACH(const QString &device, partitions) {
+        PartitionDevice partition;
+        QString partPath = device == disk.device ? sysPath : sysPath + "/" + device.section('/', -1);
+        partition.device = device;
+        partition.size = readSize(partPath);
+        readDevNum(partPath, partition.devMajor, partition.devMinor);
+        partition.info = XSys::DiskUtil::ProbePartition(device);
+        disk.partitions.append(partition);
+    }
+    return disk;
+}
+
+// every disk under /sys/block, scanned without holding the cache lock.
+QMap<QString, BlockDevice> scanDisks() {
+    QMap<QString, BlockDevice> disks;
+    Q_FOREACH(const QString &name, QDir("/sys/block").entryList(QDir::Dirs | QDir::NoDotAndDotDot | QDir::System)) {
+        BlockDevice disk = scanDisk(name);
+        if (disk.isValid()) {
+            disks.insert(name, disk);
+        }
+    }
+    return disks;
+}
+
+bool samePartition(const PartitionDevice &a, const PartitionDevice &b) {
+    return a.device == b.device && a.size == b.size && a.devMajor == b.devMajor && a.devMinor == b.devMinor
+            && a.info.format == b.info.format && a.info.label == b.info.label && a.info.uuid == b.info.uuid;
+}
+
+// what deviceChanged reports, the mount point is not part of the cache.
+bool sameDisk(const BlockDevice &a, const BlockDevice &b) {
+    if (a.size != b.size || a.removable != b.removable || a.readOnly != b.readOnly
+            || a.vendor != b.vendor || a.model != b.model || a.partitions.size() != b.partitions.size()) {
+        return false;
+    }
+    for (int i = 0; i < a.partitions.size(); ++i) {
+        if (!samePartition(a.partitions.at(i), b.partitions.at(i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the disk an uevent is about, "" when it is not a block device.
+QString ueventDisk(const QMap<QByteArray, QByteArray> &env) {
+    if (env.value("SUBSYSTEM") != "block") {
+        return "";
+    }
+    QString devpath = QString::fromLocal8Bit(env.value("DEVPATH"));
+    if ("partition" == env.value("DEVTYPE")) {
+        // /devices/.../block/sdb/sdb1 -> sdb
+        return devpath.section('/', -2, -2);
+    }
+    return devpath.section('/', -1);
+}
+#endif
+
+class DeviceCache;
+
+#ifdef Q_OS_LINUX
+// reads kernel uevents from netlink until the wake pipe is written.
+class UeventListener : public QThread {
+public:
+    explicit UeventListener(DeviceCache *cache)
+        : cache_(cache), sock_(-1) {
+        wake_[0] = wake_[1] = -1;
+    }
+
+    ~UeventListener() {
+        stop();
+        if (sock_ >= 0) ::close(sock_);
+        if (wake_[0] >= 0) ::close(wake_[0]);
+        if (wake_[1] >= 0) ::close(wake_[1]);
+    }
+
+    bool open() {
+        sock_ = ::socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+        if (sock_ < 0) {
+            qWarning() << "Open uevent socket failed:" << strerror(errno);
+            return false;
+        }
+        // a burst of partition events must not overflow the queue.
+        int rcvbuf = 1024 * 1024;
+        setsockopt(sock_, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        struct sockaddr_nl addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = 1;
+        if (0 != ::bind(sock_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr))) {
+            qWarning() << "Bind uevent socket failed:" << strerror(errno);
+            return false;
+        }
+        if (0 != pipe(wake_)) {
+            return false;
+        }
+        fcntl(wake_[0], F_SETFD, FD_CLOEXEC);
+        fcntl(wake_[1], F_SETFD, FD_CLOEXEC);
+        return true;
+    }
+
+    void stop() {
+        if (isRunning() && wake_[1] >= 0) {
+            char c = WakeStop;
+            while (::write(wake_[1], &c, 1) < 0 && EINTR == errno) {}
+            wait();
+        }
+    }
+
+    // have the listener thread scan everything and report the difference.
+    void requestRescan() {
+        if (isRunning() && wake_[1] >= 0) {
+            char c = WakeRescan;
+            while (::write(wake_[1], &c, 1) < 0 && EINTR == errno) {}
+        }
+    }
+
+protected:
+    void run();
+
+private:
+    enum { WakeStop = 0, WakeRescan = 1 };
+
+    DeviceCache *cache_;
+    int sock_;
+    int wake_[2];
+};
+#endif
+
+class DeviceCache {
+public:
+    static DeviceCache &instance() {
+        static DeviceCache cache;
+        return cache;
+    }
+
+    QList<BlockDevice> devices() {
+#ifdef Q_OS_LINUX
+        // starts the listener on first use.
+        DeviceMonitor::instance();
+        quint64 generation;
+        {
+            QMutexLocker locker(&mutex_);
+            if (loaded_ && listener_->isRunning()) {
+                return disks_.values();
+            }
+            generation = generation_;
+        }
+        // probing every partition takes long, events and other callers
+        // must not wait for it.
+        QMap<QString, BlockDevice> disks = scanDisks();
+        QMutexLocker locker(&mutex_);
+        disks_.swap(disks);
+        loaded_ = true;
+        if (generation != generation_) {
+            // an event during the scan may be missing from it, the
+            // listener scans again and emits what changed since.
+            listener_->requestRescan();
+        }
+#endif
+        return disks_.values();
+    }
+
+#ifdef Q_OS_LINUX
+    // start the uevent listener once, it loads the cache itself before
+    // the first event, so signals flow without a Devices() call.
+    void listen() {
+        QMutexLocker locker(&mutex_);
+        if (listener_) {
+            return;
+        }
+        listener_ = new UeventListener(this);
+        if (listener_->open()) {
+            listener_->start();
+        }
+    }
+#endif
+
+#ifdef Q_OS_LINUX
+    // rescan only the disk an event is about.
+    void update(const QString &action, const QString &name) {
+        BlockDevice disk;
+        if (action != "remove") {
+            disk = scanDisk(name);
+        }
+        bool known;
+        {
+            QMutexLocker locker(&mutex_);
+            ++generation_;
+            known = disks_.contains(name);
+            if (disk.isValid()) {
+                disks_.insert(name, disk);
+            } else {
+                disks_.remove(name);
+            }
+        }
+        QString device = "/dev/" + name;
+        if (disk.isValid()) {
+            if (known) {
+                emit DeviceMonitor::instance()->deviceChanged(device);
+            } else {
+                emit DeviceMonitor::instance()->deviceAdded(device);
+            }
+        } else if (known) {
+            emit DeviceMonitor::instance()->deviceRemoved(device);
+        }
+    }
+
+    // scan everything and report what changed since the cache was
+    // loaded, nothing on the first load. Runs on the listener thread when
+    // it starts, after dropped events and after a Devices() scan raced
+    // with an event.
+    void rescan() {
+        {
+            QMutexLocker locker(&mutex_);
+            ++generation_;
+        }
+        QMap<QString, BlockDevice> disks = scanDisks();
+        QStringList added, removed, changed;
+        {
+            QMutexLocker locker(&mutex_);
+            // the first load has nothing to compare with.
+            if (loaded_) {
+                for (QMap<QString, BlockDevice>::const_iterator it = disks.constBegin(); it != disks.constEnd(); ++it) {
+                    if (!disks_.contains(it.key())) {
+                        added.append("/dev/" + it.key());
+                    } else if (!sameDisk(disks_.value(it.key()), it.value())) {
+                        changed.append("/dev/" + it.key());
+                    }
+                }
+                for (QMap<QString, BlockDevice>::const_iterator it = disks_.constBegin(); it != disks_.constEnd(); ++it) {
+                    if (!disks.contains(it.key())) {
+                        removed.append("/dev/" + it.key());
+                    }
+                }
+            }
+            disks_.swap(disks);
+            loaded_ = true;
+        }
+        Q_FOREACH(const QString &device, removed) {
+            emit DeviceMonitor::instance()->deviceRemoved(device);
+        }
+        Q_FOREACH(const QString &device, added) {
+            emit DeviceMonitor::instance()->deviceAdded(device);
+        }
+        Q_FOREACH(const QString &device, changed) {
+            emit DeviceMonitor::instance()->deviceChanged(device);
+        }
+    }
+#endif
+
+private:
+    DeviceCache() : loaded_(false), generation_(0) {
+#ifdef Q_OS_LINUX
+        listener_ = NULL;
+#endif
+    }
+
+    ~DeviceCache() {
+#ifdef Q_OS_LINUX
+        delete listener_;
+#endif
+    }
+
+    QMutex mutex_;
+    bool loaded_;
+    // bumped by every event, tells a scan whether it raced with one.
+    quint64 generation_;
+    QMap<QString, BlockDevice> disks_;
+#ifdef Q_OS_LINUX
+    UeventListener *listener_;
+#endif
+};
+
+#ifdef Q_OS_LINUX
+void UeventListener::run() {
+    // events queue in the socket meanwhile, none of them is lost.
+    cache_->rescan();
+    char buf[16 * 1024];
+    for (;;) {
+        struct pollfd pfds[2];
+        pfds[0].fd = sock_;
+        pfds[0].events = POLLIN;
+        pfds[0].revents = 0;
+        pfds[1].fd = wake_[0];
+        pfds[1].events = POLLIN;
+        pfds[1].revents = 0;
+        if (poll(pfds, 2, -1) < 0) {
+            if (EINTR == errno) continue;
+            break;
+        }
+        if (pfds[1].revents) {
+            char wake[64];
+            ssize_t n = ::read(wake_[0], wake, sizeof(wake));
+            if (n <= 0 || memchr(wake, WakeStop, n)) {
+                break;
+            }
+            // requests queued meanwhile are served by one scan.
+            cache_->rescan();
+            continue;
+        }
+
+        struct sockaddr_nl from;
+        struct iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf) - 1;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &from;
+        msg.msg_namelen = sizeof(from);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        ssize_t n = recvmsg(sock_, &msg, MSG_DONTWAIT);
+        if (n < 0) {
+            if (ENOBUFS == errno) {
+                cache_->rescan();
+            }
+            continue;
+        }
+        // only the kernel may tell us about devices.
+        if (0 != from.nl_pid) {
+            continue;
+        }
+        buf[n] = 0;
+
+        // "action@devpath\0KEY=VALUE\0KEY=VALUE\0..."
+        QMap<QByteArray, QByteArray> env;
+        for (ssize_t i = strlen(buf) + 1; i < n; i += strlen(buf + i) + 1) {
+            QByteArray field(buf + i);
+            int eq = field.indexOf('=');
+            if (eq > 0) {
+                env.insert(field.left(eq), field.mid(eq + 1));
+            }
+        }
+        QString disk = ueventDisk(env);
+        if (disk.isEmpty()) {
+            continue;
+        }
+        QString action = QString::fromLatin1(env.value("ACTION"));
+        // a removed partition leaves its disk, scan the disk again.
+        if ("remove" == action && "partition" == env.value("DEVTYPE")) {
+            action = "change";
+        }
+        cache_->update(action, disk);
+    }
+}
+#endif
+
+}
+
+namespace XSys {
+
+namespace DiskUtil {
+
+DeviceMonitor::DeviceMonitor()
+    : QObject(NULL) {
+}
+
+DeviceMonitor *DeviceMonitor::instance() {
+    // owned by the first caller's thread, not by the listener.
+    static DeviceMonitor *monitor = new DeviceMonitor;
+#ifdef Q_OS_LINUX
+    // a client that only connects to the signals needs the listener too.
+    static bool listening = (DeviceCache::instance().listen(), true);
+    Q_UNUSED(listening);
+#endif
+    return monitor;
+}
+
+QList<BlockDevice> Devices(bool removableOnly) {
+    QList<BlockDevice> devices;
+    Q_FOREACH(BlockDevice disk, DeviceCache::instance().devices()) {
+        if (removableOnly && !disk.removable) {
+            continue;
+        }
+        for (int i = 0; i < disk.partitions.size(); ++i) {
+            PartitionDevice &partition = disk.partitions[i];
+            partition.mountPoint = FindMount(partition.devMajor, partition.devMinor).mountPoint;
+        }
+        devices.append(disk);
+    }
+    return devices;
+}
+
+}
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <QObject>
+#include <QString>
+#include <QList>
+
+#include "FsProbe.h"
+
+namespace XSys {
+
+namespace DiskUtil {
+    struct PartitionDevice {
+        PartitionDevice() : size(0), devMajor(0), devMinor(0) {}
+
+        QString device;
+        qint64 size;
+        // filesystem from the superblock, probed when the disk was last scanned.
+        PartitionInfo info;
+        // resolved from the mount table on every Devices() call.
+        QString mountPoint;
+        quint32 devMajor;
+        quint32 devMinor;
+    };
+
+    struct BlockDevice {
+        BlockDevice() : size(0), removable(false), readOnly(false) {}
+        bool isValid() const { return !device.isEmpty(); }
+
+        QString device;
+        QString vendor;
+        QString model;
+        qint64 size;
+        bool removable;
+        bool readOnly;
+        QList<PartitionDevice> partitions;
+    };
+
+    // disks under /sys/block with media, loop and ram disks excluded.
+    // Served from a cache that a kernel uevent listener keeps current, a
+    // call only rescans sysfs when the listener could not be started.
+    QList<BlockDevice> Devices(bool removableOnly = false);
+
+    // hotplug notifications of the Devices() cache, emitted from the
+    // listener thread after the cache was updated. instance() starts the
+    // listener, connecting is enough without ever calling Devices().
+    class DeviceMonitor : public QObject {
+        Q_OBJECT
+    public:
+        static DeviceMonitor *instance();
+
+    signals:
+        void deviceAdded(const QString &disk);
+        void deviceRemoved(const QString &disk);
+        // partitions, size or filesystems of disk changed.
+        void deviceChanged(const QString &disk);
+
+    private:
+        DeviceMonitor();
+    };
+}
+
+}
@@ -1,4 +1,11 @@
 #include "DiskUtil.h"
+#include "MountTable.h"
+#include "FsProbe.h"
+#include "Partitions.h"
+#include "BootSector.h"
+
+#include "../Common/TaskGraph.h"
+#include "../Common/Trace.h"
 
 #include "../FileSystem/FileSystem.h"
 #include "../Cmd/Cmd.h"
@@ -6,6 +13,10 @@
 #include <QtCore>
 #include <QString>
 
+#ifdef Q_OS_UNIX
+#include <sys/statvfs.h>
+#endif
+
 namespace XAPI {
 
 #ifdef Q_OS_WIN32
@@ -53,13 +64,15 @@ int GetPartitionDiskNum(QString targetDev) {
     return -1;
 }
 
-qint64 GetPartitionFreeSpace(const QString &targetDev) {
+bool GetPartitionSpace(const QString &targetDev, qint64 &freeBytes, qint64 &totalBytes) {
     QString devname = QString("%1:\\").arg(targetDev.at(0));
     ULARGE_INTEGER FreeAv,TotalBytes,FreeBytes;
     if  (!GetDiskFreeSpaceEx(LPWSTR(devname.utf16()),&FreeAv,&TotalBytes,&FreeBytes)) {
-        return 0;
+        return false;
     }
-    return FreeBytes.QuadPart;
+    freeBytes = FreeBytes.QuadPart;
+    totalBytes = TotalBytes.QuadPart;
+    return true;
 }
 
 
@@ -104,34 +117,30 @@ void UnlockDisk(HANDLE handle) {
 
 XSys::Result InstallSyslinux(const QString& targetDev) {
     // install syslinux
-    QString sysliuxPath = XSys::FS::InsertTmpFile(QString(":blobs/syslinux/syslinux.exe"));
-    return XSys::SynExec(sysliuxPath, QString(" -i -m -a %1").arg(targetDev));
+    QString sysliuxPath = XSys::FS::InsertBlob(":blobs/syslinux/syslinux.exe", true);
+    return XSys::Spawn(QStringList() << sysliuxPath << "-i" << "-m" << "-a" << targetDev);
 }
 
 XSys::Result InstallBootloader(const QString& targetDev) {
-    qDebug() << "FixUsbDisk Begin!";
     int deviceNum = GetPartitionDiskNum(targetDev);
     QString xfbinstDiskName = QString("(hd%1)").arg(deviceNum);
 
     // HANDLE handle = LockDisk(targetDev);
     // fbinst format
-    QString xfbinstPath = XSys::FS::InsertTmpFile(QString(":blobs/xfbinst/xfbinst.exe"));
-    XSys::Result ret= XSys::SynExec(xfbinstPath, QString(" %1 format --fat32 --align --force")
-                  .arg(xfbinstDiskName));
+    QString xfbinstPath = XSys::FS::InsertBlob(":blobs/xfbinst/xfbinst.exe", true);
+    XSys::Result ret= XSys::Spawn(QStringList() << xfbinstPath << xfbinstDiskName
+                                  << "format" << "--fat32" << "--align" << "--force");
     if (!ret.isSuccess()) return ret;
 
     // install fg.cfg
-    QString tmpfgcfgPath = XSys::FS::InsertTmpFile(QString(":blobs/xfbinst/fb.cfg"));
-    XSys::SynExec(xfbinstPath, QString(" %1 add-menu fb.cfg \"%2\" ")
-                  .arg(xfbinstDiskName)
-                  .arg(tmpfgcfgPath));
+    QString tmpfgcfgPath = XSys::FS::InsertBlob(":blobs/xfbinst/fb.cfg");
+    XSys::Spawn(QStringList() << xfbinstPath << xfbinstDiskName << "add-menu" << "fb.cfg" << tmpfgcfgPath);
 
     // install syslinux
-    QString sysliuxPath = XSys::FS::InsertTmpFile(QString(":blobs/syslinux/syslinux.exe"));
-    XSys::SynExec(sysliuxPath, QString(" -i %1").arg(targetDev));
+    QString sysliuxPath = XSys::FS::InsertBlob(":blobs/syslinux/syslinux.exe", true);
+    XSys::Spawn(QStringList() << sysliuxPath << "-i" << targetDev);
 
     // get pbr file ldlinux.bin
-    qDebug() << "dump pbr begin";
     QString tmpPbrPath = XSys::FS::TmpFilePath("ldlinux.bin");
     QFile pbr(tmpPbrPath);
     pbr.open(QIODevice::WriteOnly);
@@ -143,14 +152,11 @@ XSys::Result InstallBootloader(const QString& targetDev) {
     pbr.write(targetPhy.read(512));
     targetPhy.close();
     pbr.close();
-    qDebug() << "dump pbr end";
 
     // add pbr file ldlinux.bin
-    XSys::SynExec(xfbinstPath, QString(" %1 add ldlinux.bin \"%2\" -s")
-                  .arg(xfbinstDiskName)
-                  .arg(tmpPbrPath));
+    XSys::Spawn(QStringList() << xfbinstPath << xfbinstDiskName << "add" << "ldlinux.bin" << tmpPbrPath << "-s");
 
-    XSys::SynExec("label", QString("%1:DEEPINOS").arg(targetDev[0]));
+    XSys::Spawn(QStringList() << "label" << QString("%1:DEEPINOS").arg(targetDev[0]));
 
     // UnlockDisk(handle);
     return XSys::Result(XSys::Result::Success, "", targetDev);
@@ -164,7 +170,7 @@ XSys::Result UmountDisk(const QString& targetDev) {
 bool CheckFormatFat32(const QString& targetDev) {
     XSys::Result result = XSys::SynExec( "cmd",  QString("/C \"chcp 437 & fsutil fsinfo volumeinfo %1\" ").arg(targetDev));
 
-    if(result.result().contains("File System Name : FAT32", Qt::CaseInsensitive)) {
+    if(result.rawResult().toUpper().contains("FILE SYSTEM NAME : FAT32")) {
         return true;
     }
 
@@ -179,22 +185,41 @@ const QString MountPoint(const QString& targetDev) {
 
 #ifdef Q_OS_UNIX
 const QString MountPoint(const QString& targetDev) {
-    /*
-    Filesystem    512-blocks     Used Available Capacity iused     ifree %iused
-    Mounted on
-    /dev/disk2s1     3920616  2683872   1236744    69%       0         0  100%
-    /Volumes/DEEPINOS 1
-    */
-    XSys::Result ret = XSys::SynExec("df", "");
-    if(!ret.isSuccess())
-        return "";
-    QStringList mounts = ret.result().split("\n").filter(targetDev);
-    if(0 == mounts.size()) {
-        return "";
+    return XSys::DiskUtil::FindMount(targetDev).mountPoint;
+}
+
+bool GetPartitionSpace(const QString &targetDev, qint64 &freeBytes, qint64 &totalBytes) {
+    QString mountPoint = MountPoint(targetDev);
+    if (mountPoint.isEmpty()) {
+        return false;
+    }
+    struct statvfs st;
+    if (0 != statvfs(mountPoint.toLocal8Bit().constData(), &st)) {
+        return false;
+    }
+    freeBytes = qint64(st.f_bavail) * st.f_frsize;
+    totalBytes = qint64(st.f_blocks) * st.f_frsize;
+    return true;
+}
+#endif
+
+#ifdef Q_OS_UNIX
+XSys::Result WriteMbr(const QString &rawtargetDev) {
+    QFile mbr(":blobs/syslinux/mbr.bin");
+    if (!mbr.open(QIODevice::ReadOnly)) {
+        return XSys::Result(XSys::Result::Faiiled, "Open mbr.bin Failed: " + mbr.errorString());
     }
-    QString mountinfo = mounts.last();
-    mountinfo.remove(targetDev);
-    return mountinfo.mid(mountinfo.indexOf('/'));
+    return XSys::DiskUtil::WriteMbrBootCode(rawtargetDev, mbr.readAll());
+}
+
+XSys::Result DumpPbr(const QString &targetDev, const QString &pbrPath) {
+    QByteArray pbr;
+    XSys::Result ret = XSys::DiskUtil::ReadPbr(targetDev, pbr);
+    if (!ret.isSuccess()) return ret;
+    if (!XSys::FS::InsertFileData(pbrPath, pbr)) {
+        return XSys::Result(XSys::Result::Faiiled, "Write PBR Failed: " + pbrPath);
+    }
+    return ret;
 }
 #endif
 
@@ -208,152 +233,171 @@ QString GetPartitionDisk(QString targetDev) {
 }
 
 XSys::Result UmountDisk(const QString& targetDev) {
-    return XSys::SynExec("bash", QString("-c \"umount -v -f %1?*\"").arg(GetPartitionDisk(targetDev)));
-}
-
-bool CheckFormatFat32(const QString& targetDev) {
-    XSys::Result ret = XSys::SynExec("blkid -s TYPE ", targetDev);
-    if(ret.isSuccess() && ret.result().contains("vfat", Qt::CaseInsensitive)) {
-        return true;
+    QMap<QString, XSys::Result> results = XSys::DiskUtil::UmountPartitions(XSys::DiskUtil::ParentDisk(targetDev));
+    Q_FOREACH(const XSys::Result &result, results) {
+        if (!result.isSuccess()) {
+            return result;
+        }
     }
-    return false;
+    return XSys::Result(XSys::Result::Success, "");
 }
 
-qint64 GetPartitionFreeSpace(const QString &targetDev) {
-    XSys::Result ret = XSys::SynExec("df --output=avail ", targetDev);
-    if (!ret.isSuccess()) {
-        return 0;
-    }
-    return ret.result().split("\r").last().remove("\n").toLongLong();
+bool CheckFormatFat32(const QString& targetDev) {
+    return XSys::DiskUtil::PF_FAT32 == XSys::DiskUtil::ProbePartition(targetDev).format;
 }
 
 XSys::Result InstallSyslinux(const QString& targetDev) {
     // install syslinux
     // UmountDisk(targetDev);
-    QString sysliuxPath = XSys::FS::InsertTmpFile(":blobs/syslinux/syslinux");
-    XSys::Result ret = XSys::SynExec("chmod +x ", sysliuxPath);
-    if (!ret.isSuccess()) return ret;
+    QString sysliuxPath = XSys::FS::InsertBlob(":blobs/syslinux/syslinux", true);
+    if (sysliuxPath.isEmpty()) return XSys::Result(XSys::Result::Faiiled, "Insert Blob Failed: syslinux");
+    XSys::Result ret;
 
     //ret = UmountDisk(targetDev);
     //if (!ret.isSuccess()) return ret;
 
-    ret = XSys::SynExec(sysliuxPath, QString(" -i %1").arg(targetDev));
+    ret = XSys::Spawn(QStringList() << sysliuxPath << "-i" << targetDev);
     if (!ret.isSuccess()) return ret;
 
     QString rawtargetDev = GetPartitionDisk(targetDev);
-    // dd pbr file ldlinux.bin
-    QString tmpPbrPath = XSys::FS::InsertTmpFile(":blobs/syslinux/mbr.bin");
-    ret = XSys::SynExec("dd", QString(" if=%1 of=%2 ").arg(tmpPbrPath).arg(rawtargetDev));
+    // write mbr boot code
+    ret = WriteMbr(rawtargetDev);
     if (!ret.isSuccess()) return ret;
 
     // make active
-    ret = XSys::SynExec("sfdisk", QString("%1 -A%2").arg(rawtargetDev, QString(targetDev).remove(rawtargetDev).remove("p")));
+    ret = XSys::DiskUtil::SetActivePartition(rawtargetDev, QString(targetDev).remove(rawtargetDev).remove("p").toInt());
     if (!ret.isSuccess()) return ret;
 
     return ret;
 }
 
 XSys::Result InstallBootloader(const QString& diskDev) {
-    XSys::Result ret = UmountDisk(diskDev);
-
     // pre format
     QString newTargetDev = diskDev + "1";
-    QString xfbinstDiskName = QString("\"(hd%1)\"").arg(diskDev[diskDev.length() - 1].toLatin1() - 'a');
+    QString xfbinstDiskName = QString("(hd%1)").arg(diskDev[diskDev.length() - 1].toLatin1() - 'a');
+    QString mountPoint = QString("/tmp/%1").arg(XSys::FS::TmpFilePath(""));
+    QString tmpPbrPath = XSys::FS::TmpFilePath("ldlinux.bin");
+    QString xfbinstPath, tmpfgcfgPath, sysliuxPath;
+
+    // blob extraction and the mount point do not touch the disk, so they
+    // run alongside the device steps, which stay strictly ordered.
+    XSys::TaskGraph graph;
+
+    graph.addStep("insert-xfbinst", [&]() -> XSys::Result {
+        xfbinstPath = XSys::FS::InsertBlob(":blobs/xfbinst/xfbinst", true);
+        if(xfbinstPath.isEmpty()) return XSys::Result(XSys::Result::Faiiled, "Insert Blob Failed: xfbinst");
+        return XSys::Result(XSys::Result::Success, "", xfbinstPath);
+    });
+
+    graph.addStep("insert-fbcfg", [&]() -> XSys::Result {
+        tmpfgcfgPath = XSys::FS::InsertBlob(":blobs/xfbinst/fb.cfg");
+        if(tmpfgcfgPath.isEmpty()) return XSys::Result(XSys::Result::Faiiled, "Insert Blob Failed: fb.cfg");
+        return XSys::Result(XSys::Result::Success, "", tmpfgcfgPath);
+    });
+
+    graph.addStep("insert-syslinux", [&]() -> XSys::Result {
+        sysliuxPath = XSys::FS::InsertBlob(":blobs/syslinux/syslinux", true);
+        if(sysliuxPath.isEmpty()) return XSys::Result(XSys::Result::Faiiled, "Insert Blob Failed: syslinux");
+        return XSys::Result(XSys::Result::Success, "", sysliuxPath);
+    });
+
+    graph.addStep("mount-point", [&]() -> XSys::Result {
+        if(!QDir().mkpath(mountPoint)) {
+            return XSys::Result(XSys::Result::Faiiled, "Create Mount Point Failed: " + mountPoint);
+        }
+        QFile::setPermissions(mountPoint, QFile::ReadUser | QFile::WriteUser | QFile::ExeUser
+                              | QFile::ReadGroup | QFile::WriteGroup | QFile::ExeGroup
+                              | QFile::ReadOther | QFile::WriteOther | QFile::ExeOther);
+        return XSys::Result(XSys::Result::Success, "", mountPoint);
+    });
 
     // fbinst format
-    UmountDisk(diskDev);
-    QString xfbinstPath = XSys::FS::InsertTmpFile(":blobs/xfbinst/xfbinst");
-    qDebug()<<"WTF"<<ret.isSuccess()<<ret.errmsg();
-    XSys::SynExec("chmod +x ", xfbinstPath);
-    qDebug()<<ret.isSuccess()<<ret.errmsg();
-    if(!ret.isSuccess()) return ret;
-
-    ret = XSys::SynExec(xfbinstPath, QString(" %1 format --fat32 --align --force").arg(xfbinstDiskName));
-    if(!ret.isSuccess()) return ret;
+    graph.addStep("format", [&]() -> XSys::Result {
+        UmountDisk(diskDev);
+        return XSys::Spawn(QStringList() << xfbinstPath << xfbinstDiskName << "format" << "--fat32" << "--align" << "--force");
+    }, QStringList() << "insert-xfbinst");
 
     // install fg.cfg
-    QString tmpfgcfgPath = XSys::FS::InsertTmpFile(QString(":blobs/xfbinst/fb.cfg"));
-    UmountDisk(diskDev);
-    ret = XSys::SynExec(xfbinstPath, QString(" %1 add-menu fb.cfg %2 ").arg(xfbinstDiskName).arg(tmpfgcfgPath));
-    if(!ret.isSuccess()) return ret;
+    graph.addStep("add-menu", [&]() -> XSys::Result {
+        UmountDisk(diskDev);
+        return XSys::Spawn(QStringList() << xfbinstPath << xfbinstDiskName << "add-menu" << "fb.cfg" << tmpfgcfgPath);
+    }, QStringList() << "format" << "insert-fbcfg");
 
     // after format, diskdev change to /dev/sd?1
-    UmountDisk(diskDev);
-    ret = XSys::SynExec("partprobe", QString(" %1").arg(diskDev));
-    if(!ret.isSuccess()) return ret;
+    graph.addStep("rescan", [&]() -> XSys::Result {
+        UmountDisk(diskDev);
+        XSys::Result ret = XSys::DiskUtil::RescanPartitions(diskDev);
+        if(!ret.isSuccess()) return ret;
+        return XSys::DiskUtil::WaitForPartition(newTargetDev, 10000);
+    }, QStringList() << "add-menu");
 
     // install syslinux
-    ret = UmountDisk(diskDev);
-    QString targetDev = diskDev + "1";
-    QString sysliuxPath = XSys::FS::InsertTmpFile(":blobs/syslinux/syslinux");
-    ret = XSys::SynExec("chmod +x ", sysliuxPath);
-    if(!ret.isSuccess()) return ret;
-
-    ret = XSys::SynExec(sysliuxPath, QString(" -i %1").arg(targetDev));
-    if(!ret.isSuccess()) return ret;
+    graph.addStep("syslinux", [&]() -> XSys::Result {
+        UmountDisk(diskDev);
+        return XSys::Spawn(QStringList() << sysliuxPath << "-i" << newTargetDev);
+    }, QStringList() << "rescan" << "insert-syslinux");
 
     // dd pbr file ldlinux.bin
-    QString tmpPbrPath = XSys::FS::TmpFilePath("ldlinux.bin");
-    ret = XSys::SynExec("dd", QString(" if=%1 of=%2 count=1").arg(targetDev).arg(tmpPbrPath));
-    if(!ret.isSuccess()) return ret;
+    graph.addStep("dump-pbr", [&]() -> XSys::Result {
+        return DumpPbr(newTargetDev, tmpPbrPath);
+    }, QStringList() << "syslinux");
 
     // add pbr file ldlinux.bin
-    ret = UmountDisk(diskDev);
-    ret = XSys::SynExec(xfbinstPath, QString(" %1 add ldlinux.bin %2 -s").arg(xfbinstDiskName).arg(tmpPbrPath));
-    if(!ret.isSuccess()) return ret;
+    graph.addStep("add-pbr", [&]() -> XSys::Result {
+        UmountDisk(diskDev);
+        return XSys::Spawn(QStringList() << xfbinstPath << xfbinstDiskName << "add" << "ldlinux.bin" << tmpPbrPath << "-s");
+    }, QStringList() << "dump-pbr");
 
     // rename label
-    ret = XSys::SynExec("fatlabel", QString(" %1 DEEPINOS").arg(newTargetDev));
-    if(!ret.isSuccess()) return ret;
-
-    // mount
-    QString mountPoint = QString("/tmp/%1").arg(XSys::FS::TmpFilePath(""));
-    ret = XSys::SynExec("mkdir", QString(" -p %1").arg(mountPoint));
-    if(!ret.isSuccess()) return ret;
+    graph.addStep("label", [&]() -> XSys::Result {
+        return XSys::Spawn(QStringList() << "fatlabel" << newTargetDev << "DEEPINOS");
+    }, QStringList() << "add-pbr");
+
+    // mount, the disk must be mount
+    graph.addStep("mount", [&]() -> XSys::Result {
+        QString mountOptions = "flush,rw,nosuid,nodev,shortname=mixed,"
+                               "dmask=0077,utf8=1,showexec";
+        int retryTimes = 10;
+        unsigned long backoff = 500;
+        for(;;) {
+            UmountDisk(diskDev);
+            XSys::DiskUtil::RescanPartitions(diskDev);
+            XSys::DiskUtil::WaitForPartition(newTargetDev, 5000);
+            XSys::Spawn(QStringList() << "mount" << "-o" << mountOptions << newTargetDev << mountPoint);
+            retryTimes--;
+            if(MountPoint(newTargetDev) != "" || !retryTimes) break;
+            // whoever holds the partition gets time to let go, up to the old 5s.
+            QThread::msleep(backoff);
+            backoff = qMin(backoff * 2, 5000UL);
+        }
+        // how ever, if mount failed, check before install.
+        return XSys::Result(XSys::Result::Success, "", newTargetDev);
+    }, QStringList() << "label" << "mount-point");
 
-    ret = XSys::SynExec("chmod a+wrx ", mountPoint);
+    XSys::Result ret = graph.run();
     if(!ret.isSuccess()) return ret;
-
-    QString mountCmd = "mount -o "
-                       "flush,rw,nosuid,nodev,shortname=mixed,"
-                       "dmask=0077,utf8=1,showexec";
-    // the disk must be mount
-    int retryTimes = 10;
-
-    do {
-        qDebug() << "Try mount the disk " << (11 - retryTimes) << " first time";
-        UmountDisk(diskDev);
-        XSys::SynExec("partprobe", QString(" %1").arg(diskDev));
-        XSys::SynExec(mountCmd, QString(" %1 %2").arg(newTargetDev).arg(mountPoint));
-        QThread::sleep(5);
-        retryTimes--;
-    } while((MountPoint(targetDev) == "") && retryTimes);
-    // how ever, if mount failed, check before install.
     return XSys::Result(XSys::Result::Success, "", newTargetDev);
 }
 
 #endif
 
 #ifdef Q_OS_MAC
-qint64 GetPartitionFreeSpace(const QString &targetDev) {
-    XSys::Result ret = XSys::SynExec("df", "-b");
-    if (!ret.isSuccess()) {
-        qDebug()<<"Call df Failed";
-        return 0;
-    }
-    return ret.result().split("\n").filter(targetDev).first().split(" ").filter(QRegExp("[^\\s]")).at(3).toLongLong()*512;
-}
-
 QString GetPartitionDisk(QString targetDev) {
     return QString(targetDev).remove(QRegExp("s\\d$"));
 }
 
 XSys::Result UmountDisk(const QString& targetDev) {
-    return XSys::SynExec("diskutil", QString("unmountDisk force %1").arg(GetPartitionDisk(targetDev)));
+    return XSys::Spawn(QStringList() << "diskutil" << "unmountDisk" << "force" << GetPartitionDisk(targetDev));
 }
 
 bool CheckFormatFat32(const QString& targetDev) {
-    XSys::Result ret = XSys::SynExec("diskutil info ", targetDev);
+    XSys::DiskUtil::PartitionInfo info = XSys::DiskUtil::ProbePartition(targetDev);
+    if(info.valid) {
+        return XSys::DiskUtil::PF_FAT32 == info.format;
+    }
+
+    // raw device needs root, ask diskutil instead
+    XSys::Result ret = XSys::Spawn(QStringList() << "diskutil" << "info" << targetDev);
     QString partitionType = ret.result().split("\n").filter("Partition Type:").first();
 
     if(partitionType.contains(QRegExp("_FAT_32"))) {
@@ -375,51 +419,49 @@ XSys::Result InstallSyslinux(const QString& targetDev) {
     // install syslinux
     UmountDisk(targetDev);
     QString sysliuxPath = Resource("syslinux-mac");
-    XSys::SynExec(sysliuxPath, QString(" -i %1").arg(targetDev));
+    XSys::Spawn(QStringList() << sysliuxPath << "-i" << targetDev);
 
-    // dd pbr file ldlinux.bin
+    // write mbr boot code
     UmountDisk(targetDev);
-    QString tmpPbrPath = XSys::FS::InsertTmpFile(":blobs/syslinux/mbr.bin");
-    XSys::SynExec("dd", QString(" if=%1 of=%2 ").arg(tmpPbrPath).arg(
-                      GetPartitionDisk(targetDev)));
+    WriteMbr(GetPartitionDisk(targetDev));
 
-    return XSys::SynExec("diskutil", QString("mount %1").arg(targetDev));
+    return XSys::Spawn(QStringList() << "diskutil" << "mount" << targetDev);
 }
 
 XSys::Result InstallBootloader(const QString& diskDev) {
     QString targetDev = diskDev + "s1";
-    QString xfbinstDiskName = QString("\"(hd%1)\"").arg(diskDev[diskDev.length() - 1]);
+    QString xfbinstDiskName = QString("(hd%1)").arg(diskDev[diskDev.length() - 1]);
     // format with xfbinst
     QString xfbinstPath = Resource("xfbinst");
 
     UmountDisk(targetDev);
-    XSys::SynExec(xfbinstPath, QString(" %1 format --fat32 --align --force").arg(xfbinstDiskName));
+    XSys::Spawn(QStringList() << xfbinstPath << xfbinstDiskName << "format" << "--fat32" << "--align" << "--force");
 
     // install fg.cfg
-    QString tmpfgcfgPath = XSys::FS::InsertTmpFile(QString(":blobs/xfbinst/fb.cfg"));
+    QString tmpfgcfgPath = XSys::FS::InsertBlob(":blobs/xfbinst/fb.cfg");
     UmountDisk(targetDev);
-    XSys::SynExec(xfbinstPath, QString(" %1 add-menu fb.cfg %2 ").arg(xfbinstDiskName).arg(tmpfgcfgPath));
+    XSys::Spawn(QStringList() << xfbinstPath << xfbinstDiskName << "add-menu" << "fb.cfg" << tmpfgcfgPath);
 
     // install syslinux
     UmountDisk(targetDev);
 
     QString sysliuxPath = Resource("syslinux-mac");
     UmountDisk(targetDev);
-    XSys::SynExec(sysliuxPath, QString(" -i %1").arg(targetDev));
+    XSys::Spawn(QStringList() << sysliuxPath << "-i" << targetDev);
 
     // dd pbr file ldlinux.bin
     QString tmpPbrPath = XSys::FS::TmpFilePath("ldlinux.bin");
     UmountDisk(targetDev);
-    XSys::SynExec("dd", QString(" if=%1 of=%2 count=1").arg(targetDev).arg(tmpPbrPath));
+    DumpPbr(targetDev, tmpPbrPath);
 
     // add pbr file ldlinux.bin
     UmountDisk(targetDev);
-    XSys::SynExec(xfbinstPath, QString(" %1 add ldlinux.bin %2 -s").arg(xfbinstDiskName).arg(tmpPbrPath));
+    XSys::Spawn(QStringList() << xfbinstPath << xfbinstDiskName << "add" << "ldlinux.bin" << tmpPbrPath << "-s");
 
-    XSys::SynExec("diskutil", QString("mountDisk %1").arg(diskDev));
+    XSys::Spawn(QStringList() << "diskutil" << "mountDisk" << diskDev);
 
     // rename to DEEPINOS
-    XSys::SynExec("diskutil", QString("rename %1 DEEPINOS").arg(targetDev));
+    XSys::Spawn(QStringList() << "diskutil" << "rename" << targetDev << "DEEPINOS");
 
     return XSys::Result(XSys::Result::Success, "", targetDev);
 }
@@ -433,6 +475,12 @@ namespace XSys {
 namespace DiskUtil {
 
 PartionFormat GetPartitionFormat(const QString& targetDev) {
+#ifdef Q_OS_UNIX
+    PartitionInfo info = ProbePartition(targetDev);
+    if(info.valid) {
+        return info.format;
+    }
+#endif
     if(XAPI::CheckFormatFat32(targetDev)) {
         return PF_FAT32;
     }
@@ -441,7 +489,23 @@ PartionFormat GetPartitionFormat(const QString& targetDev) {
 
 
 qint64 GetPartitionFreeSpace(const QString &targetDev) {
-    return XAPI::GetPartitionFreeSpace(targetDev);
+    qint64 freeBytes = 0;
+    qint64 totalBytes = 0;
+    if (!XAPI::GetPartitionSpace(targetDev, freeBytes, totalBytes)) {
+        return 0;
+    }
+    return freeBytes;
+}
+
+QList<PartitionSpace> GetPartitionSpace(const QStringList &targetDevs) {
+    QList<PartitionSpace> spaces;
+    Q_FOREACH(const QString &targetDev, targetDevs) {
+        PartitionSpace space;
+        space.device = targetDev;
+        space.valid = XAPI::GetPartitionSpace(targetDev, space.freeBytes, space.totalBytes);
+        spaces.append(space);
+    }
+    return spaces;
 }
 
 QString GetPartitionDisk(const QString& targetDev) {
@@ -453,7 +517,11 @@ bool EjectDisk(const QString& targetDev) {
 }
 
 bool UmountDisk(const QString& disk) {
-    return XAPI::UmountDisk(disk).isSuccess();
+    Trace::Span span("disk", "UmountDisk");
+    span.setArg("disk", disk);
+    Result ret = XAPI::UmountDisk(disk);
+    span.setResult(ret);
+    return ret.isSuccess();
 }
 
 QString MountPoint(const QString& targetDev) {
@@ -464,37 +532,37 @@ QString MountPoint(const QString& targetDev) {
 namespace Bootloader {
 
 Result InstallBootloader(const QString& diskDev) {
-    return XAPI::InstallBootloader(diskDev);
+    Trace::Span span("disk", "InstallBootloader");
+    span.setArg("disk", diskDev);
+    Result ret = XAPI::InstallBootloader(diskDev);
+    span.setResult(ret);
+    return ret;
 }
 
 namespace Syslinux {
 
 Result InstallSyslinux(const QString& diskDev) {
-     return XAPI::InstallSyslinux(diskDev);
+    Trace::Span span("disk", "InstallSyslinux");
+    span.setArg("device", diskDev);
+    Result ret = XAPI::InstallSyslinux(diskDev);
+    span.setResult(ret);
+    return ret;
 }
 
 Result ConfigSyslinx(const QString& targetPath) {
-    // rename isolinux to syslinux
+    // rename isolinux to syslinux, an old syslinux dir is replaced by the move
     QString syslinxDir = QString("%1/syslinux/").arg(targetPath);
-    if (!XSys::FS::RmDir(syslinxDir)) {
-        return Result(Result::Faiiled, "Remove Dir Failed: " + syslinxDir);
-    }
-
-
     QString isolinxDir = QString("%1/isolinux/").arg(targetPath);
-    if (!XSys::FS::MoveDir(isolinxDir, syslinxDir)) {
-        return Result(Result::Faiiled, "Move Dir Failed: " + isolinxDir + " to " + syslinxDir);
+    Result ret = XSys::FS::MoveTree(isolinxDir, syslinxDir);
+    if (!ret.isSuccess()) {
+        return ret;
     }
-    qDebug() << "Move " << isolinxDir << " ot " << syslinxDir;
-
     QString syslinxCfgPath = QString("%1/syslinux/syslinux.cfg").arg(targetPath);
     if (!XSys::FS::RmFile(syslinxCfgPath)) {
         return Result(Result::Faiiled, "Remove File Failed: " + syslinxCfgPath);
     }
 
     QString isolinxCfgPath = QString("%1/syslinux/isolinux.cfg").arg(targetPath);
-    qDebug() << "Rename " << isolinxCfgPath << " ot " << syslinxCfgPath;
-
     if (!XSys::FS::CpFile(isolinxCfgPath, syslinxCfgPath)) {
         return Result(Result::Faiiled, "Copy File Failed: " + isolinxCfgPath + " to " + syslinxCfgPath);
     }
@@ -2,6 +2,7 @@
 
 #include <QObject>
 #include <QString>
+#include <QStringList>
 
 #include "../Common/Result.h"
 
@@ -12,6 +13,22 @@ namespace DiskUtil {
         PF_FAT32,
         PF_NTFS,
         PF_RAW,
+        PF_FAT12,
+        PF_FAT16,
+        PF_EXFAT,
+        PF_EXT2,
+        PF_EXT3,
+        PF_EXT4,
+        PF_ISO9660,
+    };
+
+    struct PartitionSpace {
+        PartitionSpace() : freeBytes(0), totalBytes(0), valid(false) {}
+
+        QString device;
+        qint64 freeBytes;
+        qint64 totalBytes;
+        bool valid;
     };
 
     bool UmountDisk(const QString &targetDev);
@@ -21,7 +38,9 @@ namespace DiskUtil {
     PartionFormat GetPartitionFormat(const QString &targetDev);
     QString GetPartitionDisk(const QString &targetDev);
 
+    // bytes available to unprivileged users, 0 when not mounted.
     qint64 GetPartitionFreeSpace(const QString &targetDev);
+    QList<PartitionSpace> GetPartitionSpace(const QStringList &targetDevs);
 }
 
 namespace Bootloader {
@@ -0,0 +1,377 @@
+#include "FatFormat.h"
+#include "DiskUtil.h"
+#include "Partitions.h"
+#include "BootSector.h"
+
+#include "../Common/Trace.h"
+#include "../Common/RawIo.h"
+
+#include <QDebug>
+#include <QDateTime>
+#include <QCoreApplication>
+#include <QFile>
+#include <QFileInfo>
+#include <QList>
+#include <QPair>
+
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#include <linux/fs.h>
+#endif
+
+namespace {
+
+using XSys::Result;
+using XSys::DiskUtil::FormatFat32Options;
+using XSys::RawIo::put16;
+using XSys::RawIo::put32;
+#ifdef Q_OS_UNIX
+using XSys::RawIo::pwriteAll;
+#endif
+
+// bytes per write while zeroing the metadata region.
+const qint64 ChunkSize = 4 * 1024 * 1024;
+const quint32 MinFat32Clusters = 65525;
+const quint32 MaxFat32Clusters = 0x0FFFFFF5 - 2;
+
+// everything in sectors of bytesPerSector, relative to the volume start.
+struct FatLayout {
+    quint32 bytesPerSector;
+    quint32 sectorsPerCluster;
+    quint32 reservedSectors;
+    quint32 fatSectors;
+    quint32 totalSectors;
+    quint32 hiddenSectors;
+    quint32 clusters;
+
+    quint32 dataStart() const { return reservedSectors + 2 * fatSectors; }
+    qint64 clusterBytes() const { return qint64(sectorsPerCluster) * bytesPerSector; }
+};
+
+// the cluster sizes Windows picks for FAT32.
+quint32 defaultClusterSize(qint64 volumeSize) {
+    const qint64 GiB = 1024 * 1024 * 1024;
+    if (volumeSize <= 8 * GiB) return 4096;
+    if (volumeSize <= 16 * GiB) return 8192;
+    if (volumeSize <= 32 * GiB) return 16384;
+    return 32768;
+}
+
+// size the FATs for the largest possible cluster count, then grow the
+// reserved area until the data area sits on an erase block boundary.
+bool computeLayout(FatLayout &layout, quint32 clusterSize, bool autoCluster, qint64 alignment,
+                   qint64 volumeOffset, QString &errmsg) {
+    const quint32 bps = layout.bytesPerSector;
+    const qint64 alignSectors = qMax(qint64(1), alignment / bps);
+    const qint64 offsetSectors = volumeOffset / bps;
+    quint32 spc = qMax(quint32(1), clusterSize / bps);
+    for (;;) {
+        const quint32 minReserved = 32;
+        qint64 maxClusters = (qint64(layout.totalSectors) - minReserved) / spc;
+        quint32 fat = quint32(((maxClusters + 2) * 4 + bps - 1) / bps);
+        qint64 end = offsetSectors + minReserved + 2 * qint64(fat);
+        qint64 pad = (alignSectors - end % alignSectors) % alignSectors;
+        if (minReserved + pad > 0xFFFF) {
+            errmsg = "Alignment Too Large For FAT32";
+            return false;
+        }
+        layout.sectorsPerCluster = spc;
+        layout.fatSectors = fat;
+        layout.reservedSectors = quint32(minReserved + pad);
+        qint64 dataSectors = qint64(layout.totalSectors) - layout.dataStart();
+        qint64 clusters = dataSectors > 0 ? dataSectors / spc : 0;
+        if (clusters < MinFat32Clusters) {
+            if (autoCluster && spc > 1) {
+                spc /= 2;
+                continue;
+            }
+            errmsg = "Volume Too Small For FAT32";
+            return false;
+        }
+        if (clusters > MaxFat32Clusters) {
+            if (autoCluster && spc < 128 && spc * 2 * bps <= 65536) {
+                spc *= 2;
+                continue;
+            }
+            errmsg = "Volume Too Large For FAT32";
+            return false;
+        }
+        layout.clusters = quint32(clusters);
+        return true;
+    }
+}
+
+QByteArray labelField(const QString &label) {
+    QByteArray field = label.toUpper().toLatin1().left(11);
+    if (field.isEmpty()) {
+        field = "NO NAME";
+    }
+    return field.leftJustified(11, ' ');
+}
+
+QByteArray bootSector(const FatLayout &layout, quint32 volumeId, const QByteArray &label) {
+    QByteArray sector(layout.bytesPerSector, '\0');
+    char *p = sector.data();
+    // jmp to the stub at 0x5A, nop
+    p[0] = char(0xEB); p[1] = 0x58; p[2] = char(0x90);
+    memcpy(p + 3, "MSWIN4.1", 8);
+    put16(p + 11, quint16(layout.bytesPerSector));
+    p[13] = char(layout.sectorsPerCluster);
+    put16(p + 14, quint16(layout.reservedSectors));
+    p[16] = 2;
+    p[21] = char(0xF8);
+    put16(p + 24, 63);
+    put16(p + 26, 255);
+    put32(p + 28, layout.hiddenSectors);
+    put32(p + 32, layout.totalSectors);
+    put32(p + 36, layout.fatSectors);
+    put32(p + 44, 2);
+    put16(p + 48, 1);
+    put16(p + 50, 6);
+    p[64] = char(0x80);
+    p[66] = 0x29;
+    put32(p + 67, volumeId);
+    memcpy(p + 71, label.constData(), 11);
+    memcpy(p + 82, "FAT32   ", 8);
+    // not bootable: cli, hlt, jmp $-1
+    p[90] = char(0xFA); p[91] = char(0xF4); p[92] = char(0xEB); p[93] = char(0xFD);
+    p[510] = 0x55;
+    p[511] = char(0xAA);
+    return sector;
+}
+
+QByteArray fsInfoSector(const FatLayout &layout) {
+    QByteArray sector(layout.bytesPerSector, '\0');
+    char *p = sector.data();
+    put32(p, 0x41615252);
+    put32(p + 484, 0x61417272);
+    // the root directory takes cluster 2.
+    put32(p + 488, layout.clusters - 1);
+    put32(p + 492, 3);
+    put32(p + 508, 0xAA550000);
+    return sector;
+}
+
+QByteArray mbrSector(const FatLayout &layout, quint32 volumeId) {
+    QByteArray sector(512, '\0');
+    char *p = sector.data();
+    put32(p + 440, volumeId);
+    char *entry = p + 446;
+    entry[0] = char(0x80);
+    // CHS unused, LBA only
+    entry[1] = char(0xFE); entry[2] = char(0xFF); entry[3] = char(0xFF);
+    entry[4] = 0x0C;
+    entry[5] = char(0xFE); entry[6] = char(0xFF); entry[7] = char(0xFF);
+    put32(entry + 8, layout.hiddenSectors);
+    put32(entry + 12, layout.totalSectors);
+    p[510] = 0x55;
+    p[511] = char(0xAA);
+    return sector;
+}
+
+#ifdef Q_OS_UNIX
+QString lastError() {
+    return QString::fromLocal8Bit(strerror(errno));
+}
+
+// write [0, size) as zeros with the patches laid over it, one chunk per write.
+bool writeRegion(int fd, qint64 size, const QList<QPair<qint64, QByteArray> > &patches, QString &errmsg) {
+    QByteArray chunk;
+    for (qint64 offset = 0; offset < size; offset += chunk.size()) {
+        chunk.fill('\0', int(qMin(ChunkSize, size - offset)));
+        for (int i = 0; i < patches.size(); ++i) {
+            qint64 at = patches.at(i).first;
+            const QByteArray &data = patches.at(i).second;
+            qint64 from = qMax(at, offset);
+            qint64 to = qMin(at + data.size(), offset + chunk.size());
+            if (from < to) {
+                memcpy(chunk.data() + (from - offset), data.constData() + (from - at), to - from);
+            }
+        }
+        if (!pwriteAll(fd, chunk.constData(), chunk.size(), offset, errmsg)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// where a partition starts on its disk, 0 for disks and files.
+qint64 partitionOffset(const QString &targetDev) {
+    QString name = QFileInfo(targetDev).canonicalFilePath().section('/', -1);
+    QFile start("/sys/class/block/" + name + "/start");
+    if (name.isEmpty() || !start.open(QIODevice::ReadOnly)) {
+        return 0;
+    }
+    return start.readAll().trimmed().toLongLong() * 512;
+}
+
+QString firstPartition(const QString &disk) {
+    return disk + (disk.at(disk.size() - 1).isDigit() ? "p1" : "1");
+}
+
+Result formatFat32(const QString &targetDev, const FormatFat32Options &options) {
+    QByteArray path = targetDev.toLocal8Bit();
+    struct stat st;
+    bool exists = 0 == ::stat(path.constData(), &st);
+    bool isBlock = exists && S_ISBLK(st.st_mode);
+    // check the options before anything is unmounted.
+    if (options.alignment <= 0 || options.alignment % XSys::DiskUtil::SectorSize) {
+        return Result(Result::Faiiled, "Alignment Must Be A Multiple Of 512", "", targetDev);
+    }
+    if (isBlock && options.partitionTable && XSys::DiskUtil::ParentDisk(targetDev) != targetDev) {
+        return Result(Result::Faiiled, "Partition Table On A Partition: " + targetDev, "", targetDev);
+    }
+    if (isBlock && !XSys::DiskUtil::UmountDisk(targetDev)) {
+        return Result(Result::Faiiled, "Umount Failed: " + targetDev, "", targetDev);
+    }
+
+    int fd = ::open(path.constData(), O_RDWR | O_CLOEXEC | (isBlock ? 0 : O_CREAT), 0644);
+    if (fd < 0) {
+        return Result(Result::Faiiled, "Open " + targetDev + " Failed: " + lastError(), "", targetDev);
+    }
+    if (!isBlock && options.size > 0 && 0 != ftruncate(fd, options.size)) {
+        QString errmsg = lastError();
+        ::close(fd);
+        return Result(Result::Faiiled, "Resize " + targetDev + " Failed: " + errmsg, "", targetDev);
+    }
+
+    qint64 deviceSize = ::lseek(fd, 0, SEEK_END);
+    int bytesPerSector = XSys::DiskUtil::SectorSize;
+#ifdef Q_OS_LINUX
+    if (isBlock) {
+        quint64 size64 = 0;
+        if (0 == ioctl(fd, BLKGETSIZE64, &size64)) {
+            deviceSize = qint64(size64);
+        }
+        int logical = 0;
+        if (0 == ioctl(fd, BLKSSZGET, &logical) && logical >= 512 && logical <= 4096) {
+            bytesPerSector = logical;
+        }
+    }
+#endif
+
+    qint64 volumeOffset = options.partitionTable ? options.alignment : (isBlock ? partitionOffset(targetDev) : 0);
+    qint64 volumeSize = deviceSize - (options.partitionTable ? volumeOffset : 0);
+    if (options.partitionTable) {
+        // end the partition on an erase block too.
+        volumeSize -= (volumeOffset + volumeSize) % options.alignment;
+    }
+    volumeSize = qMin(volumeSize, qint64(0xFFFFFFFFu) * bytesPerSector);
+    if (volumeSize <= 0) {
+        ::close(fd);
+        return Result(Result::Faiiled, "Target Too Small: " + targetDev, "", targetDev);
+    }
+
+    FatLayout layout;
+    layout.bytesPerSector = bytesPerSector;
+    layout.totalSectors = quint32(volumeSize / bytesPerSector);
+    layout.hiddenSectors = quint32(volumeOffset / bytesPerSector);
+    QString errmsg;
+    quint32 clusterSize = options.clusterSize ? options.clusterSize : defaultClusterSize(volumeSize);
+    if (clusterSize < quint32(bytesPerSector) || clusterSize > 65536 || (clusterSize & (clusterSize - 1))) {
+        ::close(fd);
+        return Result(Result::Faiiled, QString("Invalid Cluster Size: %1").arg(clusterSize), "", targetDev);
+    }
+    if (!computeLayout(layout, clusterSize, 0 == options.clusterSize, options.alignment, volumeOffset, errmsg)) {
+        ::close(fd);
+        return Result(Result::Faiiled, errmsg, "", targetDev);
+    }
+
+    quint32 volumeId = quint32(QDateTime::currentMSecsSinceEpoch()) ^ (quint32(QCoreApplication::applicationPid()) << 16);
+    QByteArray label = labelField(options.label);
+    QByteArray boot = bootSector(layout, volumeId, label);
+    QByteArray fsInfo = fsInfoSector(layout);
+    QByteArray fatHead(12, '\0');
+    put32(fatHead.data(), 0x0FFFFFF8);
+    put32(fatHead.data() + 4, 0x0FFFFFFF);
+    // end of chain of the root directory in cluster 2
+    put32(fatHead.data() + 8, 0x0FFFFFFF);
+
+    // the boot region, both FATs and the root cluster are contiguous, so
+    // they go out front to back in ChunkSize writes.
+    const qint64 bps = bytesPerSector;
+    const qint64 base = options.partitionTable ? volumeOffset : 0;
+    QList<QPair<qint64, QByteArray> > patches;
+    if (options.partitionTable) {
+        patches.append(qMakePair(qint64(0), mbrSector(layout, volumeId)));
+    }
+    patches.append(qMakePair(base, boot));
+    patches.append(qMakePair(base + bps, fsInfo));
+    patches.append(qMakePair(base + 6 * bps, boot));
+    patches.append(qMakePair(base + 7 * bps, fsInfo));
+    patches.append(qMakePair(base + layout.reservedSectors * bps, fatHead));
+    patches.append(qMakePair(base + (qint64(layout.reservedSectors) + layout.fatSectors) * bps, fatHead));
+    if (!options.label.isEmpty()) {
+        QByteArray entry(32, '\0');
+        memcpy(entry.data(), label.constData(), 11);
+        // volume label attribute
+        entry[11] = 0x08;
+        patches.append(qMakePair(base + qint64(layout.dataStart()) * bps, entry));
+    }
+    qint64 regionEnd = base + qint64(layout.dataStart()) * bps + layout.clusterBytes();
+
+    bool ok = writeRegion(fd, regionEnd, patches, errmsg);
+    if (ok && options.partitionTable && deviceSize - regionEnd > 0) {
+        // a stale backup GPT at the end would shadow the new MBR.
+        qint64 tail = qMin(qint64(1024 * 1024), deviceSize - regionEnd);
+        QByteArray zeros(int(tail), '\0');
+        ok = pwriteAll(fd, zeros.constData(), tail, deviceSize - tail, errmsg);
+    }
+    if (ok && 0 != fsync(fd)) {
+        errmsg = lastError();
+        ok = false;
+    }
+    ::close(fd);
+    if (!ok) {
+        qWarning() << "Format FAT32 Failed," << targetDev << errmsg;
+        return Result(Result::Faiiled, "Write " + targetDev + " Failed: " + errmsg, "", targetDev);
+    }
+
+    QString formatted = targetDev;
+    // only a new MBR changes what the kernel knows about the disk.
+    if (isBlock && options.partitionTable) {
+        Result ret = XSys::DiskUtil::RescanPartitions(targetDev);
+        if (!ret.isSuccess()) return ret;
+        formatted = firstPartition(targetDev);
+        ret = XSys::DiskUtil::WaitForPartition(formatted, 10000);
+        if (!ret.isSuccess()) return ret;
+    }
+    return Result(Result::Success, "", formatted, targetDev);
+}
+#endif
+
+}
+
+namespace XSys {
+
+namespace DiskUtil {
+
+FormatFat32Options::FormatFat32Options()
+    : clusterSize(0), alignment(4 * 1024 * 1024), partitionTable(false), size(0) {
+}
+
+Result FormatFat32(const QString &targetDev, const FormatFat32Options &options) {
+    Trace::Span span("disk", "FormatFat32");
+    span.setArg("target", targetDev);
+#ifdef Q_OS_UNIX
+    Result ret = formatFat32(targetDev, options);
+#else
+    Q_UNUSED(options);
+    Result ret(Result::Faiiled, "FormatFat32 Not Supported", "", targetDev);
+#endif
+    span.setResult(ret);
+    return ret;
+}
+
+}
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <QString>
+
+#include "../Common/Result.h"
+
+namespace XSys {
+
+namespace DiskUtil {
+    struct FormatFat32Options {
+        FormatFat32Options();
+
+        // volume label, at most 11 characters, upper cased.
+        QString label;
+        // bytes per cluster, 0 picks 4K to 32K by volume size.
+        quint32 clusterSize;
+        // erase block size in bytes, counted from the start of the disk.
+        // Only the data area is put on such a boundary. A cluster size that
+        // divides it makes every erase block start with a cluster, so no
+        // cluster straddles two, clusters themselves are not each aligned.
+        qint64 alignment;
+        // write an MBR with a single active FAT32 partition at alignment
+        // and format that partition, for whole disks and disk images. A
+        // partition as target is refused.
+        bool partitionTable;
+        // size of a regular file target, 0 keeps the current size.
+        qint64 size;
+    };
+
+    // format targetDev as FAT32 without external tools. The boot region,
+    // both FATs and the root directory go out in a few large writes. Block
+    // devices are unmounted first and the partition table is re-read after
+    // a new MBR was written.
+    // Result::result() is the formatted device, the new partition with
+    // partitionTable set.
+    Result FormatFat32(const QString &targetDev, const FormatFat32Options &options = FormatFat32Options());
+}
+
+}
@@ -0,0 +1,900 @@
+#include "FatVolume.h"
+#include "MountTable.h"
+
+#include "../Common/Trace.h"
+#include "../Common/RawIo.h"
+
+#include <QDebug>
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#endif
+
+namespace {
+
+using XSys::Result;
+using XSys::RawIo::le16;
+using XSys::RawIo::le32;
+using XSys::RawIo::put16;
+using XSys::RawIo::put32;
+
+// bytes per read and write of file data and FAT write back.
+const qint64 ChunkSize = 4 * 1024 * 1024;
+const int EntrySize = 32;
+const int LongNameChars = 13;
+const quint32 MinFat32Clusters = 65525;
+const quint32 EndOfChain = 0x0FFFFFFF;
+
+const quint8 AttrVolumeId = 0x08;
+const quint8 AttrDirectory = 0x10;
+const quint8 AttrArchive = 0x20;
+const quint8 AttrLongName = 0x0F;
+
+// NT case flags of a short entry, base and extension stored lower case.
+const quint8 CaseLowerBase = 0x08;
+const quint8 CaseLowerExt = 0x10;
+
+// offsets of the 13 UCS-2 characters in a long name entry.
+const int LongNameOffsets[LongNameChars] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+struct DirEntry {
+    // long name, or the 8.3 name when there is none.
+    QString name;
+    QByteArray shortName;
+    quint8 attr;
+    quint32 cluster;
+    quint32 size;
+    // index of the short entry and the count of slots including long name entries.
+    int slot;
+    int slotCount;
+};
+
+struct Dir {
+    QVector<quint32> chain;
+    QByteArray data;
+    QList<DirEntry> entries;
+};
+
+bool isShortChar(QChar c) {
+    ushort u = c.unicode();
+    if ((u >= 'A' && u <= 'Z') || (u >= '0' && u <= '9')) {
+        return true;
+    }
+    return u < 0x80 && strchr("$%'-_@~`!(){}^#&", char(u)) && 0 != u;
+}
+
+bool isValidName(const QString &name) {
+    if (name.isEmpty() || name.size() > 255 || "." == name || ".." == name) {
+        return false;
+    }
+    Q_FOREACH(QChar c, name) {
+        if (c.unicode() < 0x20 || strchr("\"*/:<>?\\|", char(c.unicode() < 0x80 ? c.unicode() : 'a'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// name fits 8.3 with a single case per part, so no long name is needed.
+bool exactShortName(const QString &name, QByteArray &shortName, quint8 &caseFlags) {
+    if (name.count('.') > 1 || name.startsWith('.') || name.endsWith('.')) {
+        return false;
+    }
+    int dot = name.indexOf('.');
+    QString base = dot < 0 ? name : name.left(dot);
+    QString ext = dot < 0 ? QString() : name.mid(dot + 1);
+    if (base.isEmpty() || base.size() > 8 || ext.size() > 3) {
+        return false;
+    }
+    caseFlags = 0;
+    QString parts[2] = {base, ext};
+    for (int i = 0; i < 2; ++i) {
+        bool lower = false;
+        bool upper = false;
+        Q_FOREACH(QChar c, parts[i]) {
+            if (!isShortChar(c.toUpper())) return false;
+            lower = lower || c.isLower();
+            upper = upper || c.isUpper();
+        }
+        if (lower && upper) return false;
+        if (lower) caseFlags |= (0 == i ? CaseLowerBase : CaseLowerExt);
+    }
+    shortName = base.toUpper().toLatin1().leftJustified(8, ' ') + ext.toUpper().toLatin1().leftJustified(3, ' ');
+    return true;
+}
+
+QByteArray shortPart(const QString &part, int size) {
+    QByteArray out;
+    Q_FOREACH(QChar c, part.toUpper()) {
+        if (c == ' ' || c == '.') continue;
+        out.append(isShortChar(c) ? char(c.unicode()) : '_');
+        if (out.size() == size) break;
+    }
+    return out;
+}
+
+// BASIS~N.EXT, the first N not taken in the directory.
+QByteArray generateShortName(const QString &name, const QSet<QByteArray> &taken) {
+    QString trimmed = name;
+    while (trimmed.startsWith('.')) trimmed.remove(0, 1);
+    int dot = trimmed.lastIndexOf('.');
+    QByteArray base = shortPart(dot < 0 ? trimmed : trimmed.left(dot), 8);
+    QByteArray ext = shortPart(dot < 0 ? QString() : trimmed.mid(dot + 1), 3).leftJustified(3, ' ');
+    if (base.isEmpty()) {
+        base = "_";
+    }
+    for (int n = 1; n < 1000000; ++n) {
+        QByteArray tail = "~" + QByteArray::number(n);
+        QByteArray candidate = (base.left(8 - tail.size()) + tail).leftJustified(8, ' ') + ext;
+        if (!taken.contains(candidate)) {
+            return candidate;
+        }
+    }
+    return QByteArray();
+}
+
+QString decodeShortName(const uchar *p) {
+    QByteArray raw(reinterpret_cast<const char *>(p), 11);
+    if (0x05 == uchar(raw[0])) {
+        raw[0] = char(0xE5);
+    }
+    QString base = QString::fromLatin1(raw.left(8)).trimmed();
+    QString ext = QString::fromLatin1(raw.mid(8)).trimmed();
+    if (p[12] & CaseLowerBase) base = base.toLower();
+    if (p[12] & CaseLowerExt) ext = ext.toLower();
+    return ext.isEmpty() ? base : base + "." + ext;
+}
+
+quint8 longNameChecksum(const char *shortName) {
+    quint8 sum = 0;
+    for (int i = 0; i < 11; ++i) {
+        sum = quint8(((sum & 1) << 7) + (sum >> 1) + quint8(shortName[i]));
+    }
+    return sum;
+}
+
+void fatNow(quint16 &time, quint16 &date) {
+    QDateTime now = QDateTime::currentDateTime();
+    time = quint16((now.time().hour() << 11) | (now.time().minute() << 5) | (now.time().second() / 2));
+    date = quint16(((qMax(1980, now.date().year()) - 1980) << 9) | (now.date().month() << 5) | now.date().day());
+}
+
+void fillShortEntry(char *p, const QByteArray &shortName, quint8 caseFlags, quint8 attr,
+                    quint32 cluster, quint32 size) {
+    memset(p, 0, EntrySize);
+    memcpy(p, shortName.constData(), 11);
+    p[11] = char(attr);
+    p[12] = char(caseFlags);
+    quint16 time, date;
+    fatNow(time, date);
+    put16(p + 14, time);
+    put16(p + 16, date);
+    put16(p + 18, date);
+    put16(p + 20, quint16(cluster >> 16));
+    put16(p + 22, time);
+    put16(p + 24, date);
+    put16(p + 26, quint16(cluster));
+    put32(p + 28, size);
+}
+
+QStringList splitPath(const QString &path) {
+    return QDir::fromNativeSeparators(path).split('/', QString::SkipEmptyParts);
+}
+
+}
+
+namespace XSys {
+
+namespace DiskUtil {
+
+class FatVolumePrivate {
+public:
+    FatVolumePrivate()
+        : fd(-1), bytesPerSector(0), sectorsPerCluster(0), reservedSectors(0), numFats(0),
+          fatSectors(0), rootCluster(0), fsInfoSector(0), clusterCount(0), clusterBytes(0),
+          dataOffset(0), dirtyLow(0xFFFFFFFF), dirtyHigh(0), nextFree(2), freeCount(0) {}
+
+    ~FatVolumePrivate() {
+        qDeleteAll(dirs);
+    }
+
+    quint32 entry(quint32 c) const {
+        return le32(reinterpret_cast<const uchar *>(fat.constData()) + c * 4) & 0x0FFFFFFF;
+    }
+
+    void setEntry(quint32 c, quint32 v) {
+        char *p = fat.data() + c * 4;
+        // the top four bits are reserved and kept as they are.
+        put32(p, (le32(reinterpret_cast<const uchar *>(p)) & 0xF0000000) | (v & 0x0FFFFFFF));
+        dirtyLow = qMin(dirtyLow, c);
+        dirtyHigh = qMax(dirtyHigh, c);
+    }
+
+    bool isDataCluster(quint32 c) const {
+        return c >= 2 && c < clusterCount + 2;
+    }
+
+    qint64 clusterOffset(quint32 c) const {
+        return dataOffset + qint64(c - 2) * clusterBytes;
+    }
+
+#ifdef Q_OS_UNIX
+    bool readAt(qint64 offset, char *data, qint64 size, QString &errmsg) {
+        return XSys::RawIo::preadAll(fd, data, size, offset, errmsg);
+    }
+
+    bool writeAt(qint64 offset, const char *data, qint64 size, QString &errmsg) {
+        return XSys::RawIo::pwriteAll(fd, data, size, offset, errmsg);
+    }
+#else
+    bool readAt(qint64, char *, qint64, QString &errmsg) {
+        errmsg = "Not Supported";
+        return false;
+    }
+
+    bool writeAt(qint64, const char *, qint64, QString &errmsg) {
+        errmsg = "Not Supported";
+        return false;
+    }
+#endif
+
+    Result failed(const QString &errmsg) const {
+        return Result(Result::Faiiled, errmsg, "", device);
+    }
+
+    QVector<quint32> chain(quint32 first) const {
+        QVector<quint32> clusters;
+        for (quint32 c = first; isDataCluster(c) && quint32(clusters.size()) < clusterCount; c = entry(c)) {
+            clusters.append(c);
+        }
+        return clusters;
+    }
+
+    // a contiguous run when there is one, any free clusters otherwise.
+    bool allocate(quint32 count, QVector<quint32> &clusters) {
+        clusters.clear();
+        if (0 == count) {
+            return true;
+        }
+        if (count > freeCount) {
+            return false;
+        }
+        quint32 runStart = 0;
+        quint32 runLength = 0;
+        for (quint32 i = 0; i < clusterCount && runLength < count; ++i) {
+            quint32 c = 2 + (nextFree - 2 + i) % clusterCount;
+            if (2 == c) {
+                // a run does not wrap around the end of the volume.
+                runLength = 0;
+            }
+            if (0 == entry(c)) {
+                if (0 == runLength) runStart = c;
+                runLength++;
+            } else {
+                runLength = 0;
+            }
+        }
+        if (runLength == count) {
+            for (quint32 i = 0; i < count; ++i) clusters.append(runStart + i);
+        } else {
+            for (quint32 i = 0; i < clusterCount && quint32(clusters.size()) < count; ++i) {
+                quint32 c = 2 + (nextFree - 2 + i) % clusterCount;
+                if (0 == entry(c)) clusters.append(c);
+            }
+        }
+        for (int i = 0; i < clusters.size(); ++i) {
+            setEntry(clusters.at(i), i + 1 < clusters.size() ? clusters.at(i + 1) : EndOfChain);
+        }
+        freeCount -= count;
+        nextFree = clusters.last() + 1 < clusterCount + 2 ? clusters.last() + 1 : 2;
+        return true;
+    }
+
+    void freeChain(quint32 first) {
+        Q_FOREACH(quint32 c, chain(first)) {
+            setEntry(c, 0);
+            freeCount++;
+        }
+    }
+
+    // write the given clusters of data, merging neighbours into one write.
+    bool writeClusters(const QVector<quint32> &clusters, const char *data, QString &errmsg) {
+        int i = 0;
+        while (i < clusters.size()) {
+            int run = 1;
+            while (i + run < clusters.size() && clusters.at(i + run) == clusters.at(i) + quint32(run)) run++;
+            if (!writeAt(clusterOffset(clusters.at(i)), data + qint64(i) * clusterBytes, qint64(run) * clusterBytes, errmsg)) {
+                return false;
+            }
+            i += run;
+        }
+        return true;
+    }
+
+    Result loadDir(quint32 cluster, Dir *&dir) {
+        dir = dirs.value(cluster);
+        if (dir) {
+            return Result(Result::Success, "");
+        }
+        QScopedPointer<Dir> loaded(new Dir);
+        loaded->chain = chain(cluster);
+        if (loaded->chain.isEmpty()) {
+            return failed(QString("Broken Directory Cluster %1").arg(cluster));
+        }
+        loaded->data.resize(int(loaded->chain.size() * clusterBytes));
+        QString errmsg;
+        for (int i = 0; i < loaded->chain.size(); ++i) {
+            if (!readAt(clusterOffset(loaded->chain.at(i)), loaded->data.data() + i * clusterBytes, clusterBytes, errmsg)) {
+                return failed("Read Directory Failed: " + errmsg);
+            }
+        }
+        parseDir(*loaded);
+        dir = loaded.take();
+        dirs.insert(cluster, dir);
+        return Result(Result::Success, "");
+    }
+
+    void parseDir(Dir &dir) {
+        dir.entries.clear();
+        const uchar *data = reinterpret_cast<const uchar *>(dir.data.constData());
+        int slotCount = dir.data.size() / EntrySize;
+        QVector<ushort> longName;
+        int longStart = -1;
+        int longCount = 0;
+        int longSeen = 0;
+        quint8 longSum = 0;
+        for (int i = 0; i < slotCount; ++i) {
+            const uchar *p = data + i * EntrySize;
+            if (0x00 == p[0]) {
+                break;
+            }
+            if (0xE5 == p[0]) {
+                longStart = -1;
+                continue;
+            }
+            if (AttrLongName == (p[11] & 0x3F)) {
+                int seq = p[0] & 0x1F;
+                if (p[0] & 0x40) {
+                    longStart = i;
+                    longCount = seq;
+                    longSeen = 0;
+                    longSum = p[13];
+                    longName.fill(0xFFFF, seq * LongNameChars);
+                }
+                if (longStart < 0 || seq < 1 || seq > longCount || p[13] != longSum) {
+                    longStart = -1;
+                    continue;
+                }
+                for (int k = 0; k < LongNameChars; ++k) {
+                    longName[(seq - 1) * LongNameChars + k] = le16(p + LongNameOffsets[k]);
+                }
+                longSeen++;
+                continue;
+            }
+            bool hasLong = longStart >= 0 && longSeen == longCount && i - longStart == longCount
+                    && longNameChecksum(reinterpret_cast<const char *>(p)) == longSum;
+            int start = longStart;
+            longStart = -1;
+            if ((p[11] & AttrVolumeId) && !(p[11] & AttrDirectory)) {
+                continue;
+            }
+            if ('.' == p[0] && (' ' == p[1] || ('.' == p[1] && ' ' == p[2]))) {
+                continue;
+            }
+            DirEntry entry;
+            entry.shortName = QByteArray(reinterpret_cast<const char *>(p), 11);
+            entry.attr = p[11];
+            entry.cluster = (quint32(le16(p + 20)) << 16) | le16(p + 26);
+            entry.size = le32(p + 28);
+            entry.slot = i;
+            entry.slotCount = hasLong ? i - start + 1 : 1;
+            if (hasLong) {
+                int length = longName.indexOf(0);
+                if (length < 0) length = longName.indexOf(0xFFFF);
+                if (length < 0) length = longName.size();
+                entry.name = QString::fromUtf16(longName.constData(), length);
+            } else {
+                entry.name = decodeShortName(p);
+            }
+            dir.entries.append(entry);
+        }
+    }
+
+    // write back the clusters holding slots [first, first + count).
+    Result storeSlots(Dir &dir, int first, int count) {
+        int from = int(qint64(first) * EntrySize / clusterBytes);
+        int to = int((qint64(first + count) * EntrySize - 1) / clusterBytes);
+        QString errmsg;
+        if (!writeClusters(dir.chain.mid(from, to - from + 1), dir.data.constData() + from * clusterBytes, errmsg)) {
+            return failed("Write Directory Failed: " + errmsg);
+        }
+        return Result(Result::Success, "");
+    }
+
+    const DirEntry *find(const Dir &dir, const QString &name) const {
+        for (int i = 0; i < dir.entries.size(); ++i) {
+            if (0 == QString::compare(dir.entries.at(i).name, name, Qt::CaseInsensitive)) {
+                return &dir.entries.at(i);
+            }
+        }
+        return NULL;
+    }
+
+    Result removeEntry(Dir &dir, const DirEntry &entry) {
+        int first = entry.slot - entry.slotCount + 1;
+        for (int i = first; i <= entry.slot; ++i) {
+            dir.data[i * EntrySize] = char(0xE5);
+        }
+        Result ret = storeSlots(dir, first, entry.slotCount);
+        parseDir(dir);
+        return ret;
+    }
+
+    // point an existing file entry at new data with one slot write, the long
+    // name entries in front of it stay as they are.
+    Result replaceEntry(Dir &dir, const DirEntry &entry, quint32 cluster, quint32 size) {
+        char *p = dir.data.data() + entry.slot * EntrySize;
+        fillShortEntry(p, entry.shortName, quint8(p[12]), entry.attr | AttrArchive, cluster, size);
+        Result ret = storeSlots(dir, entry.slot, 1);
+        parseDir(dir);
+        return ret;
+    }
+
+    Result addEntry(Dir &dir, const QString &name, quint8 attr, quint32 cluster, quint32 size) {
+        QByteArray shortName;
+        quint8 caseFlags = 0;
+        bool needLong = !exactShortName(name, shortName, caseFlags);
+        QSet<QByteArray> taken;
+        Q_FOREACH(const DirEntry &entry, dir.entries) {
+            taken.insert(entry.shortName);
+        }
+        if (needLong) {
+            caseFlags = 0;
+            shortName = generateShortName(name, taken);
+            if (shortName.isEmpty()) {
+                return failed("No Short Name Left For " + name);
+            }
+        } else if (taken.contains(shortName)) {
+            return failed("Entry Exists: " + name);
+        }
+        int longCount = needLong ? (name.size() + LongNameChars - 1) / LongNameChars : 0;
+        int count = longCount + 1;
+
+        // first run of count free slots, everything after the end marker is free.
+        int slotCount = dir.data.size() / EntrySize;
+        int run = 0;
+        int start = slotCount;
+        bool end = false;
+        for (int i = 0; i < slotCount; ++i) {
+            uchar mark = uchar(dir.data.at(i * EntrySize));
+            end = end || 0x00 == mark;
+            if (end || 0xE5 == mark) {
+                if (0 == run) start = i;
+                if (++run == count) break;
+            } else {
+                run = 0;
+                start = slotCount;
+            }
+        }
+        if (run < count) {
+            // grow the directory by zeroed clusters.
+            int missing = count - run;
+            quint32 grow = quint32((qint64(missing) * EntrySize + clusterBytes - 1) / clusterBytes);
+            QVector<quint32> clusters;
+            if (!allocate(grow, clusters)) {
+                return failed("No Space Left On " + device);
+            }
+            setEntry(dir.chain.last(), clusters.first());
+            QByteArray zeros(int(grow * clusterBytes), '\0');
+            QString errmsg;
+            if (!writeClusters(clusters, zeros.constData(), errmsg)) {
+                return failed("Write Directory Failed: " + errmsg);
+            }
+            dir.chain += clusters;
+            dir.data += zeros;
+        }
+
+        char *p = dir.data.data() + start * EntrySize;
+        quint8 sum = longNameChecksum(shortName.constData());
+        for (int k = 0; k < longCount; ++k) {
+            // long name entries are stored last part first.
+            int seq = longCount - k;
+            char *e = p + k * EntrySize;
+            memset(e, 0, EntrySize);
+            e[0] = char(seq | (0 == k ? 0x40 : 0));
+            e[11] = char(AttrLongName);
+            e[13] = char(sum);
+            for (int c = 0; c < LongNameChars; ++c) {
+                int at = (seq - 1) * LongNameChars + c;
+                ushort u = at < name.size() ? name.at(at).unicode() : (at == name.size() ? 0x0000 : 0xFFFF);
+                put16(e + LongNameOffsets[c], u);
+            }
+        }
+        fillShortEntry(p + longCount * EntrySize, shortName, caseFlags, attr, cluster, size);
+        Result ret = storeSlots(dir, start, count);
+        parseDir(dir);
+        return ret;
+    }
+
+    Result makeDir(quint32 parent, Dir &parentDir, const QString &name, quint32 &cluster) {
+        QVector<quint32> clusters;
+        if (!allocate(1, clusters)) {
+            return failed("No Space Left On " + device);
+        }
+        cluster = clusters.first();
+        QScopedPointer<Dir> dir(new Dir);
+        dir->chain = clusters;
+        dir->data.fill('\0', int(clusterBytes));
+        fillShortEntry(dir->data.data(), ".          ", 0, AttrDirectory, cluster, 0);
+        // ".." of a top level directory points at cluster 0, not the root cluster.
+        fillShortEntry(dir->data.data() + EntrySize, "..         ", 0, AttrDirectory,
+                       parent == rootCluster ? 0 : parent, 0);
+        QString errmsg;
+        if (!writeClusters(dir->chain, dir->data.constData(), errmsg)) {
+            freeChain(cluster);
+            return failed("Write Directory Failed: " + errmsg);
+        }
+        Result ret = addEntry(parentDir, name, AttrDirectory, cluster, 0);
+        if (!ret.isSuccess()) {
+            freeChain(cluster);
+            return ret;
+        }
+        dirs.insert(cluster, dir.take());
+        return ret;
+    }
+
+    Result resolveDir(const QStringList &parts, bool create, quint32 &cluster) {
+        cluster = rootCluster;
+        QString path;
+        Q_FOREACH(const QString &part, parts) {
+            path += "/" + part.toLower();
+            if (dirPaths.contains(path)) {
+                cluster = dirPaths.value(path);
+                continue;
+            }
+            Dir *dir = NULL;
+            Result ret = loadDir(cluster, dir);
+            if (!ret.isSuccess()) return ret;
+            const DirEntry *entry = find(*dir, part);
+            if (entry) {
+                if (!(entry->attr & AttrDirectory)) {
+                    return failed("Not A Directory: " + path);
+                }
+                cluster = entry->cluster ? entry->cluster : rootCluster;
+            } else if (!create) {
+                return failed("No Such Directory: " + path);
+            } else if (!isValidName(part)) {
+                return failed("Invalid Name: " + part);
+            } else {
+                quint32 parent = cluster;
+                ret = makeDir(parent, *dir, part, cluster);
+                if (!ret.isSuccess()) return ret;
+            }
+            dirPaths.insert(path, cluster);
+        }
+        return Result(Result::Success, "");
+    }
+
+    int fd;
+    QString device;
+    quint32 bytesPerSector;
+    quint32 sectorsPerCluster;
+    quint32 reservedSectors;
+    quint32 numFats;
+    quint32 fatSectors;
+    quint32 rootCluster;
+    quint32 fsInfoSector;
+    quint32 clusterCount;
+    qint64 clusterBytes;
+    qint64 dataOffset;
+    // FAT entries as on disk, little endian.
+    QByteArray fat;
+    // changed entry range, empty while dirtyLow > dirtyHigh.
+    quint32 dirtyLow;
+    quint32 dirtyHigh;
+    quint32 nextFree;
+    quint32 freeCount;
+    QHash<quint32, Dir *> dirs;
+    QHash<QString, quint32> dirPaths;
+};
+
+FatVolume::FatVolume()
+    : d(new FatVolumePrivate) {
+}
+
+FatVolume::~FatVolume() {
+    if (isOpen()) {
+        Result ret = close();
+        if (!ret.isSuccess()) {
+            qWarning() << "Close FAT Volume Failed," << ret.errmsg();
+        }
+    }
+    delete d;
+}
+
+bool FatVolume::isOpen() const {
+    return d->fd >= 0;
+}
+
+qint64 FatVolume::freeBytes() const {
+    return qint64(d->freeCount) * d->clusterBytes;
+}
+
+Result FatVolume::open(const QString &targetDev) {
+#ifdef Q_OS_UNIX
+    if (isOpen()) {
+        return Result(Result::Faiiled, "Volume Already Open: " + d->device, "", targetDev);
+    }
+    // the kernel driver would not see our writes and overwrite them.
+    if (FindMount(targetDev).isValid()) {
+        return Result(Result::Faiiled, "Volume Is Mounted: " + targetDev, "", targetDev);
+    }
+    Trace::Span span("disk", "FatVolume::open");
+    span.setArg("device", targetDev);
+    FatVolumePrivate *v = new FatVolumePrivate;
+    v->device = targetDev;
+    v->fd = ::open(targetDev.toLocal8Bit().constData(), O_RDWR | O_CLOEXEC);
+    if (v->fd < 0) {
+        Result ret = v->failed("Open " + targetDev + " Failed: " + QString::fromLocal8Bit(strerror(errno)));
+        delete v;
+        span.setResult(ret);
+        return ret;
+    }
+
+    QByteArray boot(512, '\0');
+    QString errmsg;
+    Result ret(Result::Success, "", targetDev);
+    if (!v->readAt(0, boot.data(), boot.size(), errmsg)) {
+        ret = v->failed("Read Boot Sector Failed: " + errmsg);
+    } else {
+        const uchar *p = reinterpret_cast<const uchar *>(boot.constData());
+        v->bytesPerSector = le16(p + 11);
+        v->sectorsPerCluster = p[13];
+        v->reservedSectors = le16(p + 14);
+        v->numFats = p[16];
+        quint32 totalSectors = le16(p + 19) ? le16(p + 19) : le32(p + 32);
+        v->fatSectors = le32(p + 36);
+        v->rootCluster = le32(p + 44);
+        v->fsInfoSector = le16(p + 48);
+        bool sane = 0x55 == p[510] && 0xAA == p[511]
+                && (512 == v->bytesPerSector || 1024 == v->bytesPerSector
+                    || 2048 == v->bytesPerSector || 4096 == v->bytesPerSector)
+                && v->sectorsPerCluster && !(v->sectorsPerCluster & (v->sectorsPerCluster - 1))
+                && v->reservedSectors && v->numFats && 0 == le16(p + 17) && 0 == le16(p + 22) && v->fatSectors;
+        quint64 dataStart = v->reservedSectors + quint64(v->numFats) * v->fatSectors;
+        if (sane && totalSectors > dataStart) {
+            v->clusterCount = quint32((totalSectors - dataStart) / v->sectorsPerCluster);
+            // the FAT may be shorter than the cluster count on a bad format.
+            v->clusterCount = quint32(qMin(quint64(v->clusterCount), quint64(v->fatSectors) * v->bytesPerSector / 4 - 2));
+        }
+        if (!sane || v->clusterCount < MinFat32Clusters || !v->isDataCluster(v->rootCluster)) {
+            ret = v->failed("Not A FAT32 Volume: " + targetDev);
+        } else {
+            v->clusterBytes = qint64(v->sectorsPerCluster) * v->bytesPerSector;
+            v->dataOffset = qint64(dataStart) * v->bytesPerSector;
+            v->fat.resize(int((v->clusterCount + 2) * 4));
+            if (!v->readAt(qint64(v->reservedSectors) * v->bytesPerSector, v->fat.data(), v->fat.size(), errmsg)) {
+                ret = v->failed("Read FAT Failed: " + errmsg);
+            }
+        }
+    }
+    if (!ret.isSuccess()) {
+        ::close(v->fd);
+        delete v;
+        span.setResult(ret);
+        return ret;
+    }
+
+    v->nextFree = 0;
+    for (quint32 c = 2; c < v->clusterCount + 2; ++c) {
+        if (0 == v->entry(c)) {
+            v->freeCount++;
+            if (0 == v->nextFree) v->nextFree = c;
+        }
+    }
+    if (0 == v->nextFree) {
+        v->nextFree = 2;
+    }
+    delete d;
+    d = v;
+    span.setResult(ret);
+    return ret;
+#else
+    return Result(Result::Faiiled, "FatVolume Not Supported", "", targetDev);
+#endif
+}
+
+Result FatVolume::mkpath(const QString &path) {
+    if (!isOpen()) {
+        return Result(Result::Faiiled, "Volume Not Open", "", path);
+    }
+    quint32 cluster = 0;
+    return d->resolveDir(splitPath(path), true, cluster);
+}
+
+Result FatVolume::writeFile(const QString &path, QIODevice &src, qint64 size, const FS::CopyProgress &progress) {
+#ifdef Q_OS_UNIX
+    if (!isOpen()) {
+        return Result(Result::Faiiled, "Volume Not Open", "", path);
+    }
+    if (size < 0 || size > qint64(0xFFFFFFFFu)) {
+        return d->failed("File Too Large For FAT32: " + path);
+    }
+    QStringList parts = splitPath(path);
+    QString name = parts.isEmpty() ? QString() : parts.takeLast();
+    if (!isValidName(name)) {
+        return d->failed("Invalid Name: " + path);
+    }
+    Trace::Span span("disk", "FatVolume::writeFile");
+    span.setArg("path", path);
+    span.setBytes(size);
+
+    quint32 dirCluster = 0;
+    Result ret = d->resolveDir(parts, true, dirCluster);
+    Dir *dir = NULL;
+    if (ret.isSuccess()) ret = d->loadDir(dirCluster, dir);
+    if (!ret.isSuccess()) {
+        span.setResult(ret);
+        return ret;
+    }
+    const DirEntry *old = d->find(*dir, name);
+    if (old && (old->attr & AttrDirectory)) {
+        ret = d->failed("Is A Directory: " + path);
+        span.setResult(ret);
+        return ret;
+    }
+
+    QVector<quint32> clusters;
+    quint32 count = quint32((size + d->clusterBytes - 1) / d->clusterBytes);
+    if (!d->allocate(count, clusters)) {
+        ret = d->failed("No Space Left On " + d->device);
+        span.setResult(ret);
+        return ret;
+    }
+
+    // stream extent by extent, a contiguous file is a few large writes.
+    QByteArray buffer;
+    buffer.resize(int(qMax(d->clusterBytes, ChunkSize / d->clusterBytes * d->clusterBytes)));
+    qint64 left = size;
+    QString errmsg;
+    int i = 0;
+    while (left > 0 && errmsg.isEmpty()) {
+        int run = 1;
+        qint64 runBytes = d->clusterBytes;
+        while (i + run < clusters.size() && clusters.at(i + run) == clusters.at(i) + quint32(run)
+               && runBytes + d->clusterBytes <= buffer.size()) {
+            run++;
+            runBytes += d->clusterBytes;
+        }
+        qint64 want = qMin(left, runBytes);
+        qint64 got = 0;
+        while (got < want) {
+            qint64 n = src.read(buffer.data() + got, want - got);
+            if (n <= 0) {
+                errmsg = n < 0 ? src.errorString() : QString("Source ended early");
+                break;
+            }
+            got += n;
+        }
+        if (!errmsg.isEmpty()) break;
+        if (!d->writeAt(d->clusterOffset(clusters.at(i)), buffer.constData(), want, errmsg)) break;
+        left -= want;
+        i += run;
+        if (progress) progress(want);
+    }
+    if (!errmsg.isEmpty()) {
+        if (count) d->freeChain(clusters.first());
+        ret = d->failed("Write " + path + " Failed: " + errmsg);
+        span.setResult(ret);
+        return ret;
+    }
+
+    // the old data is only released once the entry points at the new one, a
+    // failed write leaves the old file in place.
+    quint32 first = count ? clusters.first() : 0;
+    quint32 oldCluster = old ? old->cluster : 0;
+    ret = old ? d->replaceEntry(*dir, *old, first, quint32(size))
+              : d->addEntry(*dir, name, AttrArchive, first, quint32(size));
+    if (!ret.isSuccess()) {
+        if (count) d->freeChain(first);
+    } else if (old) {
+        d->freeChain(oldCluster);
+    }
+    span.setResult(ret);
+    return ret;
+#else
+    Q_UNUSED(src); Q_UNUSED(size); Q_UNUSED(progress);
+    return Result(Result::Faiiled, "FatVolume Not Supported", "", path);
+#endif
+}
+
+Result FatVolume::copyFile(const QString &srcName, const QString &path, const FS::CopyProgress &progress) {
+    QFile src(srcName);
+    if (!src.open(QIODevice::ReadOnly)) {
+        return Result(Result::Faiiled, "Can not open " + srcName + ": " + src.errorString(), "", srcName);
+    }
+    return writeFile(path, src, src.size(), progress);
+}
+
+Result FatVolume::copyTree(const QString &srcDir, const QString &path, const FS::CopyProgress &progress) {
+    QDir src(srcDir);
+    if (!src.exists()) {
+        return Result(Result::Faiiled, "Source Dir Not Exist: " + srcDir);
+    }
+    Result ret = mkpath(path);
+    if (!ret.isSuccess()) {
+        return ret;
+    }
+    QDirIterator it(srcDir, QDir::NoDotAndDotDot | QDir::System | QDir::Hidden | QDir::AllDirs | QDir::Files,
+                    QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        it.next();
+        QFileInfo info = it.fileInfo();
+        QString target = path + "/" + src.relativeFilePath(info.absoluteFilePath());
+        ret = info.isDir() ? mkpath(target) : copyFile(info.absoluteFilePath(), target, progress);
+        if (!ret.isSuccess()) {
+            return ret;
+        }
+    }
+    return Result(Result::Success, "");
+}
+
+Result FatVolume::close() {
+#ifdef Q_OS_UNIX
+    if (!isOpen()) {
+        return Result(Result::Success, "");
+    }
+    QString errmsg;
+    bool ok = true;
+    if (d->dirtyLow <= d->dirtyHigh) {
+        // write back whole sectors around the changed entries, in every FAT copy.
+        qint64 bps = d->bytesPerSector;
+        qint64 from = qint64(d->dirtyLow) * 4 / bps * bps;
+        qint64 to = qMin(qint64(d->fat.size()), (qint64(d->dirtyHigh) * 4 + 4 + bps - 1) / bps * bps);
+        for (quint32 i = 0; ok && i < d->numFats; ++i) {
+            qint64 base = (qint64(d->reservedSectors) + qint64(i) * d->fatSectors) * bps;
+            ok = d->writeAt(base + from, d->fat.constData() + from, to - from, errmsg);
+        }
+    }
+    if (ok && d->fsInfoSector > 0 && d->fsInfoSector < d->reservedSectors) {
+        QByteArray info(int(d->bytesPerSector), '\0');
+        qint64 offset = qint64(d->fsInfoSector) * d->bytesPerSector;
+        if (d->readAt(offset, info.data(), info.size(), errmsg)
+                && 0x41615252 == le32(reinterpret_cast<const uchar *>(info.constData()))) {
+            put32(info.data() + 488, d->freeCount);
+            put32(info.data() + 492, d->nextFree);
+            ok = d->writeAt(offset, info.constData(), info.size(), errmsg);
+        }
+    }
+    if (ok && 0 != fsync(d->fd)) {
+        errmsg = QString::fromLocal8Bit(strerror(errno));
+        ok = false;
+    }
+    ::close(d->fd);
+    QString device = d->device;
+    delete d;
+    d = new FatVolumePrivate;
+    if (!ok) {
+        return Result(Result::Faiiled, "Close " + device + " Failed: " + errmsg, "", device);
+    }
+    return Result(Result::Success, "", device);
+#else
+    return Result(Result::Success, "");
+#endif
+}
+
+}
+
+}
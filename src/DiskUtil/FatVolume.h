@@ -0,0 +1,52 @@
+#pragma once
+
+#include <QString>
+
+#include "../Common/Result.h"
+#include "../FileSystem/FileSystem.h"
+
+class QIODevice;
+
+namespace XSys {
+
+namespace DiskUtil {
+    class FatVolumePrivate;
+
+    // writes directories and files straight into an unmounted FAT32
+    // partition or image, like mtools. Paths are relative to the volume
+    // root with '/' separators, names are matched case insensitively and
+    // stored with long names when 8.3 is not enough. Every file gets its
+    // clusters allocated up front, contiguous when the free space allows.
+    // Nothing is guaranteed to be on the media before close() returns.
+    class FatVolume {
+    public:
+        FatVolume();
+        ~FatVolume();
+
+        Result open(const QString &targetDev);
+        bool isOpen() const;
+        qint64 freeBytes() const;
+
+        // create path and any missing parent, existing directories are fine.
+        Result mkpath(const QString &path);
+        // size bytes of src to path, an existing file is replaced.
+        Result writeFile(const QString &path, QIODevice &src, qint64 size,
+                         const FS::CopyProgress &progress = FS::CopyProgress());
+        Result copyFile(const QString &srcName, const QString &path,
+                        const FS::CopyProgress &progress = FS::CopyProgress());
+        // copy the content of srcDir below path.
+        Result copyTree(const QString &srcDir, const QString &path,
+                        const FS::CopyProgress &progress = FS::CopyProgress());
+
+        // write back both FATs and FSInfo, then sync the device.
+        Result close();
+
+    private:
+        FatVolume(const FatVolume &);
+        FatVolume& operator=(const FatVolume &);
+
+        FatVolumePrivate *d;
+    };
+}
+
+}
@@ -0,0 +1,202 @@
+#include "FsProbe.h"
+
+#include "../Common/RawIo.h"
+
+#include <QDebug>
+#include <QFile>
+
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#endif
+
+namespace {
+
+using XSys::DiskUtil::PartitionInfo;
+using XSys::RawIo::le16;
+using XSys::RawIo::le32;
+
+inline bool isPowerOf2(quint32 v) {
+    return v && !(v & (v - 1));
+}
+
+QString fieldString(const uchar *p, int size) {
+    return QString::fromLatin1(reinterpret_cast<const char *>(p), size).remove(QChar('\0')).trimmed();
+}
+
+QString serialUuid(quint32 serial) {
+    return QString("%1-%2").arg(serial >> 16, 4, 16, QChar('0'))
+                           .arg(serial & 0xFFFF, 4, 16, QChar('0')).toUpper();
+}
+
+bool probeExFat(const uchar *p, PartitionInfo &info) {
+    if (0 != memcmp(p + 3, "EXFAT   ", 8)) {
+        return false;
+    }
+    info.format = XSys::DiskUtil::PF_EXFAT;
+    info.uuid = serialUuid(le32(p + 100));
+    return true;
+}
+
+bool probeNtfs(const uchar *p, PartitionInfo &info) {
+    if (0 != memcmp(p + 3, "NTFS    ", 8)) {
+        return false;
+    }
+    info.format = XSys::DiskUtil::PF_NTFS;
+    // 64 bit volume serial, printed most significant byte first.
+    QString uuid;
+    for (int i = 7; i >= 0; --i) {
+        uuid += QString("%1").arg(p[0x48 + i], 2, 16, QChar('0'));
+    }
+    info.uuid = uuid.toUpper();
+    return true;
+}
+
+bool probeIso9660(const uchar *p, PartitionInfo &info) {
+    // primary volume descriptor lives in the 2048 byte sector 16.
+    const uchar *pvd = p + 16 * 2048;
+    if (1 != pvd[0] || 0 != memcmp(pvd + 1, "CD001", 5)) {
+        return false;
+    }
+    info.format = XSys::DiskUtil::PF_ISO9660;
+    info.label = fieldString(pvd + 40, 32);
+    // volume creation time, YYYYMMDDHHMMSScc
+    QString created = QString::fromLatin1(reinterpret_cast<const char *>(pvd + 813), 16);
+    info.uuid = QString("%1-%2-%3-%4-%5-%6-%7").arg(created.mid(0, 4), created.mid(4, 2), created.mid(6, 2),
+                                                    created.mid(8, 2), created.mid(10, 2), created.mid(12, 2),
+                                                    created.mid(14, 2));
+    return true;
+}
+
+bool probeExt(const uchar *p, PartitionInfo &info) {
+    const uchar *sb = p + 1024;
+    if (0xEF53 != le16(sb + 56)) {
+        return false;
+    }
+    quint32 compat = le32(sb + 92);
+    quint32 incompat = le32(sb + 96);
+    quint32 roCompat = le32(sb + 100);
+    // extents, 64bit, flex_bg / huge_file, gdt_csum, dir_nlink, extra_isize
+    if ((incompat & (0x0040 | 0x0080 | 0x0200)) || (roCompat & (0x0008 | 0x0010 | 0x0020 | 0x0040))) {
+        info.format = XSys::DiskUtil::PF_EXT4;
+    } else if (compat & 0x0004) {
+        info.format = XSys::DiskUtil::PF_EXT3;
+    } else {
+        info.format = XSys::DiskUtil::PF_EXT2;
+    }
+    QString uuid = QByteArray(reinterpret_cast<const char *>(sb + 104), 16).toHex();
+    info.uuid = QString("%1-%2-%3-%4-%5").arg(uuid.mid(0, 8), uuid.mid(8, 4), uuid.mid(12, 4),
+                                              uuid.mid(16, 4), uuid.mid(20, 12));
+    info.label = fieldString(sb + 120, 16);
+    return true;
+}
+
+bool probeFat(const uchar *p, PartitionInfo &info) {
+    if (0x55 != p[510] || 0xAA != p[511]) {
+        return false;
+    }
+    // an MBR also ends in 55 AA, a boot sector starts with a jump and
+    // carries a valid media descriptor.
+    if (0xEB != p[0] && 0xE9 != p[0]) {
+        return false;
+    }
+    if (0xF0 != p[21] && p[21] < 0xF8) {
+        return false;
+    }
+    quint32 bytesPerSector = le16(p + 11);
+    quint32 sectorsPerCluster = p[13];
+    quint32 reservedSectors = le16(p + 14);
+    quint32 fats = p[16];
+    if (bytesPerSector < 512 || bytesPerSector > 4096 || !isPowerOf2(bytesPerSector)
+        || !isPowerOf2(sectorsPerCluster) || 0 == reservedSectors || fats < 1 || fats > 2) {
+        return false;
+    }
+
+    quint32 rootEntries = le16(p + 17);
+    quint32 totalSectors = le16(p + 19) ? le16(p + 19) : le32(p + 32);
+    quint32 fatSize = le16(p + 22) ? le16(p + 22) : le32(p + 36);
+    quint32 rootDirSectors = (rootEntries * 32 + bytesPerSector - 1) / bytesPerSector;
+    quint32 metaSectors = reservedSectors + fats * fatSize + rootDirSectors;
+    if (0 == fatSize || totalSectors <= metaSectors) {
+        return false;
+    }
+    quint32 clusters = (totalSectors - metaSectors) / sectorsPerCluster;
+
+    // FAT32 keeps its extended boot record after the 28 byte FAT32 BPB.
+    const uchar *ebr = p + 36;
+    if (0 == le16(p + 22)) {
+        info.format = XSys::DiskUtil::PF_FAT32;
+        ebr = p + 64;
+    } else if (clusters < 4085) {
+        info.format = XSys::DiskUtil::PF_FAT12;
+    } else {
+        info.format = XSys::DiskUtil::PF_FAT16;
+    }
+    if (0x29 == ebr[2]) {
+        info.uuid = serialUuid(le32(ebr + 3));
+        info.label = fieldString(ebr + 7, 11);
+        if ("NO NAME" == info.label) {
+            info.label.clear();
+        }
+    }
+    return true;
+}
+
+}
+
+namespace XSys {
+
+namespace DiskUtil {
+
+PartitionInfo ProbeData(const QByteArray &head) {
+    PartitionInfo info;
+    QByteArray data = head;
+    if (data.size() < ProbeSize) {
+        data.append(QByteArray(ProbeSize - data.size(), '\0'));
+    }
+    const uchar *p = reinterpret_cast<const uchar *>(data.constData());
+    info.valid = true;
+    if (probeExFat(p, info) || probeNtfs(p, info) || probeIso9660(p, info)
+        || probeExt(p, info) || probeFat(p, info)) {
+        return info;
+    }
+    info.format = PF_RAW;
+    return info;
+}
+
+PartitionInfo ProbePartition(const QString &targetDev) {
+#ifdef Q_OS_UNIX
+    // one buffered read of the head covers every probe below.
+    int fd = ::open(targetDev.toLocal8Bit().constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        qWarning() << "Probe Partition Failed, Can not open" << targetDev << strerror(errno);
+        return PartitionInfo();
+    }
+    QByteArray head(ProbeSize, Qt::Uninitialized);
+    ssize_t n;
+    do {
+        n = ::pread(fd, head.data(), ProbeSize, 0);
+    } while (n < 0 && EINTR == errno);
+    ::close(fd);
+    if (n < 0) {
+        qWarning() << "Probe Partition Failed, Can not read" << targetDev << strerror(errno);
+        return PartitionInfo();
+    }
+    head.resize(int(n));
+    return ProbeData(head);
+#else
+    QFile device(targetDev);
+    if (!device.open(QIODevice::ReadOnly)) {
+        qWarning() << "Probe Partition Failed, Can not open" << targetDev << device.errorString();
+        return PartitionInfo();
+    }
+    return ProbeData(device.read(ProbeSize));
+#endif
+}
+
+}
+
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <QString>
+#include <QByteArray>
+
+#include "DiskUtil.h"
+
+namespace XSys {
+
+namespace DiskUtil {
+    struct PartitionInfo {
+        PartitionInfo() : format(PF_RAW), valid(false) {}
+
+        PartionFormat format;
+        QString label;
+        QString uuid;
+        // false when the device or image could not be read.
+        bool valid;
+    };
+
+    // bytes ProbePartition reads from the start of a device.
+    const int ProbeSize = 64 * 1024;
+
+    // recognize the filesystem from its on-disk superblock, works on
+    // block devices and on plain image files alike.
+    PartitionInfo ProbePartition(const QString &targetDev);
+    PartitionInfo ProbeData(const QByteArray &head);
+}
+
+}
@@ -0,0 +1,1294 @@
+#include "ImageWriter.h"
+#include "DiskUtil.h"
+
+#include "../Common/Trace.h"
+#include "../Common/RawIo.h"
+
+#include <QDebug>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QVector>
+#include <QElapsedTimer>
+#include <QCryptographicHash>
+#include <QFile>
+#include <QList>
+
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+using XSys::Result;
+#ifdef Q_OS_UNIX
+using XSys::RawIo::pwriteAll;
+#endif
+
+const qint64 Alignment = 4096;
+// zero blocks cleared by one ioctl, keeps the progress close to the device.
+const qint64 MaxZeroRange = 256 * 1024 * 1024;
+
+#ifdef Q_OS_UNIX
+QString lastError() {
+    return QString::fromLocal8Bit(strerror(errno));
+}
+
+// the reader side of a ring of blocks.
+class BlockSink {
+public:
+    virtual ~BlockSink() {}
+
+    // wait for an empty block, NULL once nobody takes blocks any more.
+    virtual char *acquire() = 0;
+    // publish the acquired block, a short block marks the end.
+    virtual void push(qint64 size, bool zero) = 0;
+    virtual void abort() = 0;
+};
+
+// fixed ring of aligned blocks shared by one reader and one writer.
+class BlockRing : public BlockSink {
+public:
+    BlockRing(int count, qint64 blockSize)
+        : head_(0), tail_(0), filled_(0), aborted_(false) {
+        for (int i = 0; i < count; ++i) {
+            void *buffer = NULL;
+            if (0 != posix_memalign(&buffer, Alignment, blockSize)) {
+                break;
+            }
+            buffers_.append(static_cast<char *>(buffer));
+        }
+        sizes_.fill(0, buffers_.size());
+        zero_.fill(false, buffers_.size());
+        if (buffers_.size() != count) {
+            aborted_ = true;
+        }
+    }
+
+    bool isValid() const {
+        return !buffers_.isEmpty() && !aborted_;
+    }
+
+    ~BlockRing() {
+        Q_FOREACH(char *buffer, buffers_) {
+            free(buffer);
+        }
+    }
+
+    // reader side: wait for an empty block, NULL once aborted.
+    virtual char *acquire() {
+        QMutexLocker locker(&mutex_);
+        while (!aborted_ && filled_ == buffers_.size()) {
+            notFull_.wait(&mutex_);
+        }
+        return aborted_ ? NULL : buffers_.at(tail_);
+    }
+
+    // reader side: publish the acquired block, a short block marks the end.
+    virtual void push(qint64 size, bool zero) {
+        QMutexLocker locker(&mutex_);
+        sizes_[tail_] = size;
+        zero_[tail_] = zero;
+        tail_ = (tail_ + 1) % buffers_.size();
+        filled_++;
+        notEmpty_.wakeAll();
+    }
+
+    // writer side: wait for the next filled block, false once aborted.
+    bool pop(char *&data, qint64 &size, bool *zero = NULL) {
+        QMutexLocker locker(&mutex_);
+        while (!aborted_ && 0 == filled_) {
+            notEmpty_.wait(&mutex_);
+        }
+        if (aborted_) {
+            return false;
+        }
+        data = buffers_.at(head_);
+        size = sizes_.at(head_);
+        if (zero) {
+            *zero = zero_.at(head_);
+        }
+        return true;
+    }
+
+    // writer side: hand the popped block back to the reader.
+    void release() {
+        QMutexLocker locker(&mutex_);
+        head_ = (head_ + 1) % buffers_.size();
+        filled_--;
+        notFull_.wakeAll();
+    }
+
+    virtual void abort() {
+        QMutexLocker locker(&mutex_);
+        aborted_ = true;
+        notFull_.wakeAll();
+        notEmpty_.wakeAll();
+    }
+
+private:
+    QMutex mutex_;
+    QWaitCondition notEmpty_;
+    QWaitCondition notFull_;
+    QVector<char *> buffers_;
+    QVector<qint64> sizes_;
+    QVector<bool> zero_;
+    int head_;
+    int tail_;
+    int filled_;
+    bool aborted_;
+};
+
+// called on the reader thread with every block before it is handed on.
+typedef std::function<void(const char *data, qint64 size)> BlockHook;
+
+inline qint64 alignUp(qint64 size) {
+    return (size + Alignment - 1) / Alignment * Alignment;
+}
+
+// true when size bytes at data are all zero. 64 bytes are ORed together
+// per step, with SSE2 where available, and the first non-zero step ends it.
+bool isZeroBlock(const char *data, qint64 size) {
+    qint64 i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= size; i += 64) {
+        const __m128i *p = reinterpret_cast<const __m128i *>(data + i);
+        __m128i acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+                                   _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+        if (0xFFFF != _mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero))) {
+            return false;
+        }
+    }
+#else
+    for (; i + 64 <= size; i += 64) {
+        quint64 w[8];
+        memcpy(w, data + i, sizeof(w));
+        if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) {
+            return false;
+        }
+    }
+#endif
+    for (; i < size; ++i) {
+        if (data[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+class ImageReader : public QThread {
+public:
+    // stop after limit bytes, -1 reads to the end of fd.
+    ImageReader(int fd, BlockSink *ring, qint64 blockSize, qint64 limit = -1,
+                const BlockHook &onBlock = BlockHook())
+        : fd_(fd), ring_(ring), blockSize_(blockSize), limit_(limit), onBlock_(onBlock),
+          start_(0), zeroes_(false), fileSize_(0), holeEnd_(0), dataEnd_(0) {}
+
+    // read from offset instead of the start of fd, limit still counts from 0.
+    void setStart(qint64 offset) {
+        start_ = offset;
+    }
+
+    // flag all-zero blocks, and do not read the holes of a sparse source of
+    // fileSize bytes at all.
+    void detectZeroes(qint64 fileSize) {
+        zeroes_ = true;
+        fileSize_ = fileSize;
+    }
+
+    const QString &errmsg() const { return errmsg_; }
+
+protected:
+    void run() {
+        qint64 offset = start_;
+        for (;;) {
+            char *buffer = ring_->acquire();
+            if (!buffer) {
+                return;
+            }
+            // keep the request aligned for O_DIRECT, trim to limit afterwards.
+            qint64 request = blockSize_;
+            if (limit_ >= 0) {
+                request = qMin(request, alignUp(limit_ - offset));
+            }
+            qint64 size = 0;
+            bool zero = false;
+            if (zeroes_ && isHole(offset, request)) {
+                size = qMin(request, fileSize_ - offset);
+                memset(buffer, 0, size);
+                zero = true;
+            }
+            while (!zero && size < request) {
+                ssize_t n = ::pread(fd_, buffer + size, request - size, offset + size);
+                if (n < 0 && EINTR == errno) continue;
+                if (n < 0) {
+                    errmsg_ = "Read Image Failed: " + lastError();
+                    ring_->abort();
+                    return;
+                }
+                if (0 == n) break;
+                size += n;
+            }
+            if (limit_ >= 0) {
+                size = qMin(size, limit_ - offset);
+            }
+            if (zeroes_ && !zero) {
+                zero = isZeroBlock(buffer, size);
+            }
+            if (onBlock_) {
+                onBlock_(buffer, size);
+            }
+            ring_->push(size, zero);
+            offset += size;
+            if (size < blockSize_) {
+                return;
+            }
+        }
+    }
+
+private:
+    // [offset, offset + length) lies in a hole of the source, asks the
+    // filesystem again only when offset leaves the last known region.
+    bool isHole(qint64 offset, qint64 length) {
+#ifdef SEEK_DATA
+        if (offset >= holeEnd_ && offset >= dataEnd_ && offset < fileSize_) {
+            off_t data = ::lseek(fd_, offset, SEEK_DATA);
+            if (data < 0 && ENXIO == errno) {
+                holeEnd_ = fileSize_;
+            } else if (data < 0) {
+                // no SEEK_DATA here, every block is data.
+                dataEnd_ = fileSize_;
+            } else if (data > offset) {
+                holeEnd_ = data;
+            } else {
+                off_t hole = ::lseek(fd_, offset, SEEK_HOLE);
+                dataEnd_ = hole > offset ? hole : fileSize_;
+            }
+        }
+        return offset < holeEnd_ && qMin(offset + length, fileSize_) <= holeEnd_;
+#else
+        Q_UNUSED(offset);
+        Q_UNUSED(length);
+        return false;
+#endif
+    }
+
+    int fd_;
+    BlockSink *ring_;
+    qint64 blockSize_;
+    qint64 limit_;
+    BlockHook onBlock_;
+    qint64 start_;
+    bool zeroes_;
+    qint64 fileSize_;
+    qint64 holeEnd_;
+    qint64 dataEnd_;
+    QString errmsg_;
+};
+
+// digests taken from the source while it streams to the target.
+struct ImageDigest {
+    ImageDigest() : whole(QCryptographicHash::Sha1) {}
+
+    void add(const char *data, qint64 size) {
+        if (size <= 0) {
+            return;
+        }
+        whole.addData(data, size);
+        blocks.append(QCryptographicHash::hash(QByteArray::fromRawData(data, size), QCryptographicHash::Sha1));
+    }
+
+    QCryptographicHash whole;
+    QList<QByteArray> blocks;
+};
+
+int syncFd(int fd) {
+#ifdef Q_OS_LINUX
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+// how a block device clears a range of blocks.
+enum ClearMethod {
+    // discarded blocks read back as zeroes, only reported before Linux 4.12.
+    ClearByDiscard,
+    // the device zeroes ranges itself, BLKZEROOUT sends WRITE ZEROES.
+    ClearByWriteZeroes,
+    // BLKZEROOUT would have the kernel write zero pages, which costs as
+    // much as writing the zero blocks of the image.
+    ClearByWriting
+};
+
+ClearMethod clearMethod(dev_t dev) {
+#ifdef Q_OS_LINUX
+    // a partition has no queue of its own, it is the one of its disk.
+    QString sysPath = QString("/sys/dev/block/%1:%2/").arg(major(dev)).arg(minor(dev));
+    if (QFile::exists(sysPath + "partition")) {
+        sysPath += "../";
+    }
+    QFile discardZeroes(sysPath + "queue/discard_zeroes_data");
+    if (discardZeroes.open(QIODevice::ReadOnly) && discardZeroes.readAll().trimmed() == "1") {
+        return ClearByDiscard;
+    }
+    // write_zeroes_max_bytes exists since 4.10, WRITE SAME was used before.
+    QFile writeZeroes(sysPath + "queue/write_zeroes_max_bytes");
+    if (!writeZeroes.exists()) {
+        writeZeroes.setFileName(sysPath + "queue/write_same_max_bytes");
+    }
+    if (writeZeroes.open(QIODevice::ReadOnly) && writeZeroes.readAll().trimmed().toLongLong() > 0) {
+        return ClearByWriteZeroes;
+    }
+#else
+    Q_UNUSED(dev);
+#endif
+    return ClearByWriting;
+}
+
+// zero length bytes at offset of a block device, through the kernel when it
+// can do it, otherwise by writing zeroes.
+bool clearRange(int fd, qint64 offset, qint64 length, bool discard, QString &errmsg) {
+#ifdef BLKZEROOUT
+    quint64 range[2] = {quint64(offset), quint64(length)};
+    if (discard && 0 == ioctl(fd, BLKDISCARD, range)) {
+        return true;
+    }
+    if (0 == ioctl(fd, BLKZEROOUT, range)) {
+        return true;
+    }
+#else
+    Q_UNUSED(discard);
+#endif
+    void *zeroes = NULL;
+    qint64 chunk = qMin(length, qint64(1024 * 1024));
+    if (0 != posix_memalign(&zeroes, Alignment, chunk)) {
+        errmsg = "Allocate Zero Buffer Failed";
+        return false;
+    }
+    memset(zeroes, 0, chunk);
+    bool ok = true;
+    for (qint64 done = 0; ok && done < length; done += chunk) {
+        ok = pwriteAll(fd, static_cast<const char *>(zeroes), qMin(chunk, length - done), offset + done, errmsg);
+    }
+    free(zeroes);
+    return ok;
+}
+
+// read the target back, the reader thread pulls blocks from the media while
+// this thread hashes them and compares each block with the source digest.
+Result verifyTarget(const QString &targetDev, qint64 total, qint64 blockSize, int buffers,
+                    const QList<QByteArray> &blocks) {
+    QByteArray path = targetDev.toLocal8Bit();
+    int fd = -1;
+#ifdef O_DIRECT
+    fd = ::open(path.constData(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+#endif
+    if (fd < 0) {
+        fd = ::open(path.constData(), O_RDONLY | O_CLOEXEC);
+#ifdef POSIX_FADV_DONTNEED
+        // the data was synced already, drop it so it is really read back.
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+#endif
+#ifdef Q_OS_MAC
+        if (fd >= 0) {
+            fcntl(fd, F_NOCACHE, 1);
+        }
+#endif
+    }
+    if (fd < 0) {
+        return Result(Result::Faiiled, "Open " + targetDev + " Failed: " + lastError(), "", targetDev);
+    }
+
+    BlockRing ring(buffers, blockSize);
+    if (!ring.isValid()) {
+        ::close(fd);
+        return Result(Result::Faiiled, "Allocate Verify Buffers Failed", "", targetDev);
+    }
+    ImageReader reader(fd, &ring, blockSize, total);
+    reader.start();
+
+    QString errmsg;
+    qint64 offset = 0;
+    int index = 0;
+    char *data = NULL;
+    qint64 size = 0;
+    bool done = false;
+    while (ring.pop(data, size)) {
+        if (size > 0) {
+            QByteArray digest = QCryptographicHash::hash(QByteArray::fromRawData(data, size), QCryptographicHash::Sha1);
+            if (index >= blocks.size() || digest != blocks.at(index)) {
+                errmsg = QString("Verify Failed, Mismatch In Block At Offset %1").arg(offset);
+                break;
+            }
+        }
+        offset += size;
+        index++;
+        ring.release();
+        if (size < blockSize) {
+            done = true;
+            break;
+        }
+    }
+    ring.abort();
+    reader.wait();
+    ::close(fd);
+
+    if (done && offset != total) {
+        errmsg = QString("Verify Failed, Read Back %1 Of %2 Bytes").arg(offset).arg(total);
+        done = false;
+    }
+    if (!done) {
+        if (errmsg.isEmpty()) {
+            errmsg = reader.errmsg();
+        }
+        return Result(Result::Faiiled, errmsg, "", targetDev);
+    }
+    return Result(Result::Success, "", "", targetDev);
+}
+
+int openSource(const QString &src, qint64 &total) {
+    int fd = ::open(src.toLocal8Bit().constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    total = ::lseek(fd, 0, SEEK_END);
+    ::lseek(fd, 0, SEEK_SET);
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return fd;
+}
+
+int openTarget(const QString &targetDev, bool isBlock, bool &direct) {
+    QByteArray path = targetDev.toLocal8Bit();
+    int flags = O_WRONLY | O_CLOEXEC | (isBlock ? 0 : O_CREAT);
+    int fd = -1;
+#ifdef O_DIRECT
+    if (direct) {
+        fd = ::open(path.constData(), flags | O_DIRECT, 0644);
+        if (fd >= 0) {
+            return fd;
+        }
+        if (EINVAL != errno) {
+            return -1;
+        }
+        qDebug() << "O_DIRECT not supported on" << targetDev << ", use buffered io";
+    }
+    direct = false;
+#endif
+    fd = ::open(path.constData(), flags, 0644);
+#ifdef Q_OS_MAC
+    if (fd >= 0 && direct) {
+        fcntl(fd, F_NOCACHE, 1);
+    }
+    direct = false;
+#endif
+    return fd;
+}
+
+// one target of an image write: takes the blocks in order and handles
+// zero blocks, the unaligned tail and the final sync.
+class TargetWriter {
+public:
+    typedef std::function<void(qint64 written, qint64 total, double bytesPerSecond)> Progress;
+
+    TargetWriter(const QString &targetDev, const XSys::DiskUtil::WriteImageOptions &options, qint64 total,
+                 const Progress &progress)
+        : targetDev_(targetDev), options_(options), progress_(progress), total_(total), fd_(-1),
+          isBlock_(false), direct_(options.direct), leaveZeroes_(false), clearZeroes_(false),
+          discard_(false), written_(0), zeroBytes_(0), zeroStart_(-1) {}
+
+    ~TargetWriter() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    const QString &targetDev() const { return targetDev_; }
+    const QString &errmsg() const { return errmsg_; }
+    qint64 written() const { return written_; }
+    qint64 zeroBytes() const { return zeroBytes_; }
+    bool skipsZeroes() const {
+        return XSys::DiskUtil::WriteImageOptions::WriteZeroBlocks != options_.zeroBlocks;
+    }
+    // how zero blocks reach the target, for the trace.
+    QString zeroBlocks() const {
+        if (!leaveZeroes_) return "write";
+        if (!clearZeroes_) return "skip";
+        return discard_ ? "discard" : "zeroout";
+    }
+
+    // a block device is unmounted first, false with errmsg() set.
+    bool open() {
+        struct stat st;
+        isBlock_ = 0 == ::stat(targetDev_.toLocal8Bit().constData(), &st) && S_ISBLK(st.st_mode);
+        if (isBlock_ && !XSys::DiskUtil::UmountDisk(targetDev_)) {
+            errmsg_ = "Umount Failed: " + targetDev_;
+            return false;
+        }
+        fd_ = openTarget(targetDev_, isBlock_, direct_);
+        if (fd_ < 0) {
+            errmsg_ = "Open " + targetDev_ + " Failed: " + lastError();
+            return false;
+        }
+#ifdef BLKGETSIZE64
+        quint64 devSize = 0;
+        if (isBlock_ && 0 == ioctl(fd_, BLKGETSIZE64, &devSize) && quint64(total_) > devSize) {
+            errmsg_ = QString("Image Larger Than Device: %1 > %2").arg(total_).arg(devSize);
+            return false;
+        }
+#endif
+        leaveZeroes_ = skipsZeroes();
+        if (isBlock_ && XSys::DiskUtil::WriteImageOptions::DiscardZeroBlocks == options_.zeroBlocks) {
+            ClearMethod method = clearMethod(st.st_rdev);
+            // nothing to gain from clearing, the zero blocks are written.
+            leaveZeroes_ = ClearByWriting != method;
+            clearZeroes_ = leaveZeroes_;
+            discard_ = ClearByDiscard == method;
+        }
+        // a regular file has to read back zeroes where blocks are left out.
+        if (skipsZeroes() && !isBlock_ && 0 != ftruncate(fd_, 0)) {
+            errmsg_ = "Truncate " + targetDev_ + " Failed: " + lastError();
+            return false;
+        }
+        timer_.start();
+        return true;
+    }
+
+    // the next block of the image, false with errmsg() set.
+    bool write(const char *data, qint64 size, bool zero) {
+        // BLKZEROOUT works on whole sectors, an odd tail is written.
+        bool leaveOut = zero && size > 0 && leaveZeroes_ && (!clearZeroes_ || 0 == size % 512);
+        if (zeroStart_ >= 0 && (!leaveOut || written_ - zeroStart_ >= MaxZeroRange) && !clearZeroes()) {
+            return false;
+        }
+#ifdef O_DIRECT
+        if (direct_ && 0 != size % Alignment) {
+            // the unaligned tail can not go through O_DIRECT.
+            fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+            direct_ = false;
+        }
+#endif
+        if (leaveOut) {
+            zeroBytes_ += size;
+            if (clearZeroes_ && zeroStart_ < 0) {
+                zeroStart_ = written_;
+            }
+        } else if (size > 0 && !pwriteAll(fd_, data, size, written_, errmsg_)) {
+            errmsg_ = "Write " + targetDev_ + " Failed: " + errmsg_;
+            return false;
+        }
+        written_ += size;
+        if (progress_) {
+            qint64 elapsed = qMax(qint64(1), timer_.elapsed());
+            progress_(written_, total_, written_ * 1000.0 / elapsed);
+        }
+        return true;
+    }
+
+    // clear the zero blocks still pending, trim a regular file and sync.
+    bool finish() {
+        if (zeroStart_ >= 0 && !clearZeroes()) {
+            return false;
+        }
+        if (!isBlock_ && 0 != ftruncate(fd_, written_)) {
+            errmsg_ = "Truncate " + targetDev_ + " Failed: " + lastError();
+            return false;
+        }
+        if (0 != syncFd(fd_)) {
+            errmsg_ = "Sync " + targetDev_ + " Failed: " + lastError();
+            return false;
+        }
+        ::close(fd_);
+        fd_ = -1;
+        return true;
+    }
+
+private:
+    bool clearZeroes() {
+        if (!clearRange(fd_, zeroStart_, written_ - zeroStart_, discard_, errmsg_)) {
+            errmsg_ = "Clear " + targetDev_ + " Failed: " + errmsg_;
+            return false;
+        }
+        zeroStart_ = -1;
+        return true;
+    }
+
+    QString targetDev_;
+    const XSys::DiskUtil::WriteImageOptions &options_;
+    Progress progress_;
+    qint64 total_;
+    int fd_;
+    bool isBlock_;
+    bool direct_;
+    // zero blocks are left out, and cleared when clearZeroes_ is set.
+    bool leaveZeroes_;
+    bool clearZeroes_;
+    bool discard_;
+    qint64 written_;
+    qint64 zeroBytes_;
+    // zero blocks not cleared yet, -1 when there are none.
+    qint64 zeroStart_;
+    QElapsedTimer timer_;
+    QString errmsg_;
+};
+
+// ring of aligned blocks shared by one reader and several writers, each
+// with its own position. A slot is reused once every writer is past it.
+// A catch-up ring starts with no writer, they join() at their own block
+// and are never detached, it only runs while someone is attached.
+class FanoutRing : public BlockSink {
+public:
+    enum PopStatus {
+        Popped,
+        // fell a whole ring behind, go on reading the source alone.
+        Detached,
+        Aborted
+    };
+
+    FanoutRing(int count, qint64 blockSize, int writers, bool catchUp = false)
+        : produced_(0), first_(0), waiting_(0), catchUp_(catchUp), idle_(catchUp), aborted_(false) {
+        for (int i = 0; i < count; ++i) {
+            void *buffer = NULL;
+            if (0 != posix_memalign(&buffer, Alignment, blockSize)) {
+                break;
+            }
+            buffers_.append(static_cast<char *>(buffer));
+        }
+        sizes_.fill(0, buffers_.size());
+        zero_.fill(false, buffers_.size());
+        cursors_.fill(0, writers);
+        states_.fill(catchUp ? WriterLeft : WriterAttached, writers);
+        holding_.fill(false, writers);
+        wantsRest_.fill(false, writers);
+        if (buffers_.size() != count) {
+            aborted_ = true;
+        }
+    }
+
+    ~FanoutRing() {
+        Q_FOREACH(char *buffer, buffers_) {
+            free(buffer);
+        }
+    }
+
+    bool isValid() const {
+        return !buffers_.isEmpty() && !aborted_;
+    }
+
+    // reader side: a full ring waits for the slowest writer, unless another
+    // writer has run dry, then the slowest ones are detached.
+    virtual char *acquire() {
+        QMutexLocker locker(&mutex_);
+        for (;;) {
+            if (aborted_) {
+                return NULL;
+            }
+            qint64 oldest = produced_;
+            bool needed = false;
+            for (int i = 0; i < cursors_.size(); ++i) {
+                // a detached writer may still be writing the block it popped.
+                if (WriterAttached == states_.at(i) || holding_.at(i)) {
+                    oldest = qMin(oldest, cursors_.at(i));
+                }
+                needed = needed || WriterAttached == states_.at(i) || wantsRest_.at(i);
+            }
+            if (!needed) {
+                // the reader stops, the next join() starts it again.
+                idle_ = catchUp_;
+                return NULL;
+            }
+            if (produced_ - oldest < buffers_.size()) {
+                return buffers_.at(produced_ % buffers_.size());
+            }
+            if (waiting_ > 0 && !catchUp_) {
+                for (int i = 0; i < cursors_.size(); ++i) {
+                    if (WriterAttached == states_.at(i) && cursors_.at(i) == oldest) {
+                        states_[i] = WriterDetached;
+                    }
+                }
+                notEmpty_.wakeAll();
+            }
+            notFull_.wait(&mutex_);
+        }
+    }
+
+    virtual void push(qint64 size, bool zero) {
+        QMutexLocker locker(&mutex_);
+        int slot = produced_ % buffers_.size();
+        sizes_[slot] = size;
+        zero_[slot] = zero;
+        produced_++;
+        notEmpty_.wakeAll();
+    }
+
+    // writer side: the next block of writer, index is the block number.
+    PopStatus pop(int writer, char *&data, qint64 &size, bool &zero, qint64 &index) {
+        QMutexLocker locker(&mutex_);
+        while (!aborted_ && WriterAttached == states_.at(writer) && cursors_.at(writer) >= produced_) {
+            waiting_++;
+            notFull_.wakeAll();
+            notEmpty_.wait(&mutex_);
+            waiting_--;
+        }
+        index = cursors_.at(writer);
+        if (aborted_) {
+            return Aborted;
+        }
+        if (WriterAttached != states_.at(writer)) {
+            return Detached;
+        }
+        int slot = index % buffers_.size();
+        data = buffers_.at(slot);
+        size = sizes_.at(slot);
+        zero = zero_.at(slot);
+        holding_[writer] = true;
+        return Popped;
+    }
+
+    void release(int writer) {
+        QMutexLocker locker(&mutex_);
+        cursors_[writer]++;
+        holding_[writer] = false;
+        notFull_.wakeAll();
+    }
+
+    // attach writer at block of a catch-up ring, false when that block is
+    // gone already or more than a ring ahead, the writer would only wait
+    // for slower ones then. restart is set when the reader stopped, it has
+    // to be started again at block.
+    bool join(int writer, qint64 block, bool &restart) {
+        QMutexLocker locker(&mutex_);
+        restart = false;
+        if (aborted_) {
+            return false;
+        }
+        if (idle_) {
+            produced_ = first_ = block;
+            idle_ = false;
+            restart = true;
+        } else if (block < first_ || block <= produced_ - buffers_.size()
+                   || block >= produced_ + buffers_.size()) {
+            return false;
+        }
+        cursors_[writer] = block;
+        states_[writer] = WriterAttached;
+        holding_[writer] = false;
+        wantsRest_[writer] = false;
+        notFull_.wakeAll();
+        return true;
+    }
+
+    // writer done, failed or detached, it holds nothing back any more.
+    // With wantsRest the reader still goes on to the end, for the digest.
+    void leave(int writer, bool wantsRest) {
+        QMutexLocker locker(&mutex_);
+        states_[writer] = WriterLeft;
+        holding_[writer] = false;
+        wantsRest_[writer] = wantsRest;
+        notFull_.wakeAll();
+    }
+
+    virtual void abort() {
+        QMutexLocker locker(&mutex_);
+        aborted_ = true;
+        notFull_.wakeAll();
+        notEmpty_.wakeAll();
+    }
+
+private:
+    enum WriterState { WriterAttached, WriterDetached, WriterLeft };
+
+    QMutex mutex_;
+    QWaitCondition notEmpty_;
+    QWaitCondition notFull_;
+    QVector<char *> buffers_;
+    QVector<qint64> sizes_;
+    QVector<bool> zero_;
+    qint64 produced_;
+    // block the reader was last started at.
+    qint64 first_;
+    QVector<qint64> cursors_;
+    QVector<int> states_;
+    QVector<bool> holding_;
+    QVector<bool> wantsRest_;
+    int waiting_;
+    bool catchUp_;
+    // no reader is running, catch-up rings only.
+    bool idle_;
+    bool aborted_;
+};
+
+// the source for the writers detached from a fan-out ring: one more reader
+// and ring that every detached writer joins at its own position, so slow
+// targets share one more pass over the source instead of one pass each.
+class CatchUp {
+public:
+    CatchUp(int srcfd, qint64 total, qint64 blockSize, int buffers, int writers, bool zeroes)
+        : srcfd_(srcfd), total_(total), blockSize_(blockSize), buffers_(buffers), writers_(writers),
+          zeroes_(zeroes) {}
+
+    ~CatchUp() {
+        abort();
+    }
+
+    // the ring to go on with from block, NULL when block is out of its reach.
+    FanoutRing *join(int writer, qint64 block) {
+        QMutexLocker locker(&mutex_);
+        if (!ring_) {
+            // only allocated once a writer falls behind.
+            ring_.reset(new FanoutRing(buffers_, blockSize_, writers_, true));
+        }
+        bool restart = false;
+        if (!ring_->isValid() || !ring_->join(writer, block, restart)) {
+            return NULL;
+        }
+        if (restart) {
+            if (reader_) {
+                reader_->wait();
+            }
+            reader_.reset(new ImageReader(srcfd_, ring_.data(), blockSize_));
+            reader_->setStart(block * blockSize_);
+            if (zeroes_) {
+                reader_->detectZeroes(total_);
+            }
+            reader_->start();
+        }
+        return ring_.data();
+    }
+
+    QString errmsg() {
+        QMutexLocker locker(&mutex_);
+        return reader_ ? reader_->errmsg() : QString();
+    }
+
+    void abort() {
+        QMutexLocker locker(&mutex_);
+        if (ring_) {
+            ring_->abort();
+        }
+        if (reader_) {
+            reader_->wait();
+        }
+    }
+
+private:
+    QMutex mutex_;
+    int srcfd_;
+    qint64 total_;
+    qint64 blockSize_;
+    int buffers_;
+    int writers_;
+    bool zeroes_;
+    QScopedPointer<FanoutRing> ring_;
+    QScopedPointer<ImageReader> reader_;
+};
+
+// drains the fan-out ring into one target, from the catch-up ring once it
+// is detached, then syncs and verifies the target.
+class FanoutWriter : public QThread {
+public:
+    FanoutWriter(FanoutRing *ring, CatchUp *catchUp, int index, TargetWriter *target, ImageReader *source,
+                 int srcfd, qint64 total, qint64 blockSize, int buffers, const ImageDigest *digest)
+        : ring_(ring), catchUp_(catchUp), index_(index), target_(target), source_(source), srcfd_(srcfd),
+          total_(total), blockSize_(blockSize), buffers_(buffers), digest_(digest), detachedAt_(-1),
+          alone_(false) {}
+
+    const Result &result() const { return result_; }
+
+protected:
+    void run() {
+        XSys::Trace::Span span("disk", "WriteTarget");
+        span.setArg("target", target_->targetDev());
+        QString errmsg;
+        bool done = drain(errmsg);
+        if (done && !target_->finish()) {
+            done = false;
+        }
+        span.setBytes(target_->written());
+        if (span.isActive()) {
+            span.setArg("zeroBytes", QString::number(target_->zeroBytes()));
+            span.setArg("zeroBlocks", target_->zeroBlocks());
+            if (detachedAt_ >= 0) {
+                span.setArg("detachedAt", QString::number(detachedAt_));
+                span.setArg("catchUp", alone_ ? "alone" : "shared");
+            }
+        }
+        if (!done) {
+            if (!target_->errmsg().isEmpty()) {
+                errmsg = target_->errmsg();
+            } else if (errmsg.isEmpty()) {
+                source_->wait();
+                errmsg = source_->errmsg();
+            }
+            result_ = Result(Result::Faiiled, errmsg, "", target_->targetDev());
+            span.setResult(result_);
+            return;
+        }
+        if (digest_) {
+            // the digest is complete once the shared reader is through, a
+            // failed read leaves it short.
+            source_->wait();
+            if (!source_->errmsg().isEmpty()) {
+                result_ = Result(Result::Faiiled, source_->errmsg(), "", target_->targetDev());
+                span.setResult(result_);
+                return;
+            }
+            result_ = verifyTarget(target_->targetDev(), target_->written(), blockSize_, buffers_, digest_->blocks);
+        } else {
+            result_ = Result(Result::Success, "", QString::number(target_->written()), target_->targetDev());
+        }
+        span.setResult(result_);
+    }
+
+private:
+    // leaves the ring on every way out.
+    bool drain(QString &errmsg) {
+        char *data = NULL;
+        qint64 size = 0;
+        bool zero = false;
+        qint64 block = 0;
+        for (;;) {
+            FanoutRing::PopStatus status = ring_->pop(index_, data, size, zero, block);
+            if (FanoutRing::Detached == status) {
+                // the shared reader still has to finish the digest for the verify.
+                ring_->leave(index_, NULL != digest_);
+                detachedAt_ = block * blockSize_;
+                return drainCatchUp(block, errmsg);
+            }
+            bool ok = FanoutRing::Popped == status && target_->write(data, size, zero);
+            if (FanoutRing::Popped == status) {
+                ring_->release(index_);
+            }
+            if (!ok || size < blockSize_) {
+                ring_->leave(index_, false);
+                return ok;
+            }
+        }
+    }
+
+    // the rest of the source from the catch-up ring.
+    bool drainCatchUp(qint64 block, QString &errmsg) {
+        FanoutRing *ring = catchUp_->join(index_, block);
+        if (!ring) {
+            return drainAlone(block * blockSize_, errmsg);
+        }
+        char *data = NULL;
+        qint64 size = 0;
+        bool zero = false;
+        for (;;) {
+            FanoutRing::PopStatus status = ring->pop(index_, data, size, zero, block);
+            bool ok = FanoutRing::Popped == status && target_->write(data, size, zero);
+            if (FanoutRing::Popped == status) {
+                ring->release(index_);
+            }
+            if (!ok || size < blockSize_) {
+                ring->leave(index_, false);
+                if (FanoutRing::Aborted == status) {
+                    errmsg = catchUp_->errmsg();
+                }
+                return ok;
+            }
+        }
+    }
+
+    // the rest of the source through a reader of its own, only when block
+    // is out of reach of the catch-up ring.
+    bool drainAlone(qint64 offset, QString &errmsg) {
+        alone_ = true;
+        BlockRing ring(buffers_, blockSize_);
+        if (!ring.isValid()) {
+            errmsg = "Allocate Image Buffers Failed";
+            return false;
+        }
+        ImageReader reader(srcfd_, &ring, blockSize_);
+        reader.setStart(offset);
+        if (target_->skipsZeroes()) {
+            reader.detectZeroes(total_);
+        }
+        reader.start();
+        bool done = false;
+        char *data = NULL;
+        qint64 size = 0;
+        bool zero = false;
+        while (ring.pop(data, size, &zero)) {
+            if (!target_->write(data, size, zero)) {
+                break;
+            }
+            ring.release();
+            if (size < blockSize_) {
+                done = true;
+                break;
+            }
+        }
+        ring.abort();
+        reader.wait();
+        if (!done) {
+            errmsg = reader.errmsg();
+        }
+        return done;
+    }
+
+    FanoutRing *ring_;
+    CatchUp *catchUp_;
+    int index_;
+    TargetWriter *target_;
+    ImageReader *source_;
+    int srcfd_;
+    qint64 total_;
+    qint64 blockSize_;
+    int buffers_;
+    const ImageDigest *digest_;
+    // where the target fell behind and left the ring, -1 while it did not.
+    qint64 detachedAt_;
+    // went on with a reader of its own, the catch-up ring was out of reach.
+    bool alone_;
+    Result result_;
+};
+#endif
+
+}
+
+namespace XSys {
+
+namespace DiskUtil {
+
+WriteImageOptions::WriteImageOptions()
+    : blockSize(4 * 1024 * 1024), buffers(2), direct(true), verify(false), zeroBlocks(DiscardZeroBlocks) {
+}
+
+static Result writeImage(const QString &src, const QString &targetDev, const WriteImageOptions &options,
+                         Trace::Span &span) {
+#ifdef Q_OS_UNIX
+    qint64 blockSize = qMax(Alignment, (options.blockSize + Alignment - 1) / Alignment * Alignment);
+    qint64 total = 0;
+    int srcfd = openSource(src, total);
+    if (srcfd < 0) {
+        return Result(Result::Faiiled, "Open " + src + " Failed: " + lastError(), "", src);
+    }
+
+    TargetWriter target(targetDev, options, total, options.progress);
+    if (!target.open()) {
+        ::close(srcfd);
+        return Result(Result::Faiiled, target.errmsg(), "", targetDev);
+    }
+
+    BlockRing ring(qMax(2, options.buffers), blockSize);
+    if (!ring.isValid()) {
+        ::close(srcfd);
+        return Result(Result::Faiiled, "Allocate Image Buffers Failed", "", targetDev);
+    }
+    ImageDigest digest;
+    BlockHook onBlock;
+    if (options.verify) {
+        onBlock = [&digest](const char *data, qint64 size) { digest.add(data, size); };
+    }
+    ImageReader reader(srcfd, &ring, blockSize, -1, onBlock);
+    if (target.skipsZeroes()) {
+        reader.detectZeroes(total);
+    }
+    reader.start();
+
+    bool done = false;
+    char *data = NULL;
+    qint64 size = 0;
+    bool zero = false;
+    while (ring.pop(data, size, &zero)) {
+        if (!target.write(data, size, zero)) {
+            break;
+        }
+        ring.release();
+        if (size < blockSize) {
+            done = true;
+            break;
+        }
+    }
+    ring.abort();
+    reader.wait();
+    ::close(srcfd);
+
+    if (done) {
+        done = target.finish();
+    }
+    qint64 written = target.written();
+    span.setBytes(written);
+    if (span.isActive()) {
+        span.setArg("zeroBytes", QString::number(target.zeroBytes()));
+        span.setArg("zeroBlocks", target.zeroBlocks());
+    }
+
+    if (!done) {
+        QString errmsg = target.errmsg().isEmpty() ? reader.errmsg() : target.errmsg();
+        qWarning() << "Write Image Failed," << src << "to" << targetDev << errmsg;
+        return Result(Result::Faiiled, errmsg, "", targetDev);
+    }
+
+    if (options.verify) {
+        Trace::Span verifySpan("disk", "VerifyImage");
+        verifySpan.setArg("target", targetDev);
+        verifySpan.setBytes(written);
+        Result ret = verifyTarget(targetDev, written, blockSize, qMax(2, options.buffers), digest.blocks);
+        verifySpan.setResult(ret);
+        if (!ret.isSuccess()) {
+            qWarning() << "Verify Image Failed," << src << "to" << targetDev << ret.errmsg();
+            return ret;
+        }
+        return Result(Result::Success, "", digest.whole.result().toHex(), targetDev);
+    }
+    return Result(Result::Success, "", QString::number(written), targetDev);
+#else
+    Q_UNUSED(options);
+    Q_UNUSED(span);
+    return Result(Result::Faiiled, "WriteImage Not Supported", "", src + " " + targetDev);
+#endif
+}
+
+Result WriteImage(const QString &src, const QString &targetDev, const WriteImageOptions &options) {
+    Trace::Span span("disk", "WriteImage");
+    span.setArg("src", src);
+    span.setArg("target", targetDev);
+    Result ret = writeImage(src, targetDev, options, span);
+    span.setResult(ret);
+    return ret;
+}
+
+static QList<Result> writeImage(const QString &src, const QStringList &targetDevs, const WriteImageOptions &options,
+                                Trace::Span &span) {
+    QList<Result> results;
+#ifdef Q_OS_UNIX
+    qint64 blockSize = qMax(Alignment, (options.blockSize + Alignment - 1) / Alignment * Alignment);
+    qint64 total = 0;
+    int srcfd = openSource(src, total);
+    if (srcfd < 0) {
+        Result ret(Result::Faiiled, "Open " + src + " Failed: " + lastError(), "", src);
+        Q_FOREACH(const QString &targetDev, targetDevs) {
+            Q_UNUSED(targetDev);
+            results.append(ret);
+        }
+        return results;
+    }
+
+    // targets that can not be opened get their result now and stay out of the ring.
+    QList<TargetWriter *> targets;
+    QList<int> indices;
+    for (int i = 0; i < targetDevs.size(); ++i) {
+        TargetWriter::Progress progress;
+        if (options.targetProgress) {
+            progress = [&options, i](qint64 written, qint64 total, double bytesPerSecond) {
+                options.targetProgress(i, written, total, bytesPerSecond);
+            };
+        }
+        TargetWriter *target = new TargetWriter(targetDevs.at(i), options, total, progress);
+        if (!target->open()) {
+            results.append(Result(Result::Faiiled, target->errmsg(), "", targetDevs.at(i)));
+            delete target;
+            continue;
+        }
+        results.append(Result(Result::Success, "", "", targetDevs.at(i)));
+        indices.append(i);
+        targets.append(target);
+    }
+    if (targets.isEmpty()) {
+        ::close(srcfd);
+        return results;
+    }
+
+    int buffers = qMax(2, options.buffers);
+    FanoutRing ring(buffers * targets.size(), blockSize, targets.size());
+    bool ringValid = ring.isValid();
+    ImageDigest digest;
+    BlockHook onBlock;
+    if (options.verify) {
+        onBlock = [&digest](const char *data, qint64 size) { digest.add(data, size); };
+    }
+    ImageReader reader(srcfd, &ring, blockSize, -1, onBlock);
+    if (targets.first()->skipsZeroes()) {
+        reader.detectZeroes(total);
+    }
+    if (!ringValid) {
+        ring.abort();
+    }
+    CatchUp catchUp(srcfd, total, blockSize, buffers * targets.size(), targets.size(),
+                    targets.first()->skipsZeroes());
+
+    QList<FanoutWriter *> writers;
+    for (int i = 0; i < targets.size(); ++i) {
+        writers.append(new FanoutWriter(&ring, &catchUp, i, targets.at(i), &reader, srcfd, total, blockSize,
+                                         buffers, options.verify ? &digest : NULL));
+        writers.last()->start();
+    }
+    if (ringValid) {
+        reader.start();
+    }
+    Q_FOREACH(FanoutWriter *writer, writers) {
+        writer->wait();
+    }
+    ring.abort();
+    reader.wait();
+    catchUp.abort();
+    ::close(srcfd);
+
+    qint64 written = 0;
+    for (int i = 0; i < writers.size(); ++i) {
+        Result ret = writers.at(i)->result();
+        if (!ringValid) {
+            ret = Result(Result::Faiiled, "Allocate Image Buffers Failed", "", targetDevs.at(indices.at(i)));
+        }
+        if (ret.isSuccess() && options.verify) {
+            ret = Result(Result::Success, "", digest.whole.result().toHex(), targetDevs.at(indices.at(i)));
+        }
+        if (!ret.isSuccess()) {
+            qWarning() << "Write Image Failed," << src << "to" << targetDevs.at(indices.at(i)) << ret.errmsg();
+        }
+        written += targets.at(i)->written();
+        results[indices.at(i)] = ret;
+    }
+    span.setBytes(written);
+    qDeleteAll(writers);
+    qDeleteAll(targets);
+#else
+    Q_UNUSED(options);
+    Q_UNUSED(span);
+    Q_FOREACH(const QString &targetDev, targetDevs) {
+        results.append(Result(Result::Faiiled, "WriteImage Not Supported", "", src + " " + targetDev));
+    }
+#endif
+    return results;
+}
+
+QList<Result> WriteImage(const QString &src, const QStringList &targetDevs, const WriteImageOptions &options) {
+    Trace::Span span("disk", "WriteImageFanout");
+    span.setArg("src", src);
+    span.setArg("targets", targetDevs.join(" "));
+    QList<Result> results = writeImage(src, targetDevs, options, span);
+    bool success = true;
+    Q_FOREACH(const Result &ret, results) {
+        success = success && ret.isSuccess();
+    }
+    span.setSuccess(success);
+    return results;
+}
+
+}
+
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <functional>
+
+#include "../Common/Result.h"
+
+namespace XSys {
+
+namespace DiskUtil {
+    struct WriteImageOptions {
+        // what happens to all-zero blocks and to the holes of a sparse source.
+        enum ZeroBlocks {
+            // write them like any other block.
+            WriteZeroBlocks,
+            // leave them out, the target has to read back zeroes there
+            // already. A regular file target is truncated first and ends up
+            // sparse.
+            SkipZeroBlocks,
+            // BLKDISCARD when the device reports that discarded blocks read
+            // back as zeroes, BLKZEROOUT when it can zero ranges itself
+            // (queue/write_zeroes_max_bytes). Without either the zero blocks
+            // are written like WriteZeroBlocks, the "zeroBlocks" trace
+            // argument of the write tells which one was used. Regular file
+            // targets are handled as with SkipZeroBlocks.
+            DiscardZeroBlocks
+        };
+
+        WriteImageOptions();
+
+        // bytes per read and per write, rounded up to a multiple of 4096.
+        qint64 blockSize;
+        // number of blocks in flight between the reader and the writer, per
+        // target when writing to several.
+        int buffers;
+        // bypass the page cache of the target, falls back to buffered io.
+        bool direct;
+        // hash the source while it streams and read the target back after
+        // the write, Result::result() then holds the source SHA-1 in hex.
+        bool verify;
+        ZeroBlocks zeroBlocks;
+        // called after every block on the writing thread.
+        std::function<void(qint64 written, qint64 total, double bytesPerSecond)> progress;
+        // progress of several targets, target is the index in targetDevs.
+        std::function<void(int target, qint64 written, qint64 total, double bytesPerSecond)> targetProgress;
+    };
+
+    // copy a raw image to a block device or a regular file. A block device
+    // is unmounted through UmountDisk first. Source reads run on their own
+    // thread and overlap the device writes.
+    Result WriteImage(const QString &src, const QString &targetDev,
+                      const WriteImageOptions &options = WriteImageOptions());
+
+    // copy one image to several targets at once. A single reader fills a
+    // ring shared by one writer thread per target, so the source is read
+    // once. A target that falls a whole ring behind while another one waits
+    // for data is detached and reads the rest of the source on its own; a
+    // failed target just leaves the ring. Every target gets its own Result,
+    // in the order of targetDevs.
+    QList<Result> WriteImage(const QString &src, const QStringList &targetDevs,
+                             const WriteImageOptions &options = WriteImageOptions());
+}
+
+}
@@ -0,0 +1,233 @@
+#include "MountTable.h"
+
+#include <QDebug>
+#include <QHash>
+#include <QMutex>
+#include <QByteArray>
+
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#include <poll.h>
+#include <sys/sysmacros.h>
+#endif
+
+#ifdef Q_OS_MAC
+#include <sys/param.h>
+#include <sys/ucred.h>
+#include <sys/mount.h>
+#endif
+
+namespace {
+
+using XSys::DiskUtil::MountEntry;
+
+inline quint64 devKey(quint32 devMajor, quint32 devMinor) {
+    return (quint64(devMajor) << 32) | devMinor;
+}
+
+#ifdef Q_OS_LINUX
+// mountinfo escapes space, tab, newline and backslash as \ooo.
+QString unescape(const QByteArray &field) {
+    QByteArray out;
+    out.reserve(field.size());
+    for (int i = 0; i < field.size(); ++i) {
+        if ('\\' == field[i] && i + 3 < field.size()) {
+            bool ok = false;
+            int ch = field.mid(i + 1, 3).toInt(&ok, 8);
+            if (ok) {
+                out.append(char(ch));
+                i += 3;
+                continue;
+            }
+        }
+        out.append(field[i]);
+    }
+    return QString::fromLocal8Bit(out);
+}
+
+/*
+    36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw,errors=continue
+    (1)(2)(3)   (4)   (5)      (6)      (7)   (8) (9)   (10)         (11)
+*/
+bool parseLine(const QByteArray &line, MountEntry &entry) {
+    QList<QByteArray> fields = line.split(' ');
+    int sep = fields.indexOf("-");
+    if (sep < 6 || fields.size() < sep + 3) {
+        return false;
+    }
+    QList<QByteArray> devnum = fields.at(2).split(':');
+    if (2 != devnum.size()) {
+        return false;
+    }
+    entry.devMajor = devnum.at(0).toUInt();
+    entry.devMinor = devnum.at(1).toUInt();
+    entry.mountPoint = unescape(fields.at(4));
+    entry.options = QString::fromLatin1(fields.at(5));
+    entry.fsType = unescape(fields.at(sep + 1));
+    entry.device = unescape(fields.at(sep + 2));
+    return true;
+}
+#endif
+
+class MountTable {
+public:
+    static MountTable &instance() {
+        static MountTable table;
+        return table;
+    }
+
+    MountEntry byDevice(const QString &device) {
+        QMutexLocker locker(&mutex_);
+        refresh();
+        return byDevice_.value(device);
+    }
+
+    MountEntry byDevNum(quint32 devMajor, quint32 devMinor) {
+        QMutexLocker locker(&mutex_);
+        refresh();
+        return byDevNum_.value(devKey(devMajor, devMinor));
+    }
+
+    QList<MountEntry> entries() {
+        QMutexLocker locker(&mutex_);
+        refresh();
+        return entries_;
+    }
+
+private:
+    MountTable() : fd_(-1), loaded_(false) {
+#ifdef Q_OS_LINUX
+        fd_ = ::open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+        if (fd_ < 0) {
+            qWarning() << "Open /proc/self/mountinfo Failed" << errno;
+        }
+#endif
+    }
+
+    ~MountTable() {
+#ifdef Q_OS_UNIX
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+#endif
+    }
+
+    // mountinfo raises POLLPRI|POLLERR after any mount or umount.
+    bool changed() {
+#ifdef Q_OS_LINUX
+        if (!loaded_ || fd_ < 0) {
+            return true;
+        }
+        struct pollfd pfd;
+        pfd.fd = fd_;
+        pfd.events = POLLPRI;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) < 0) {
+            return true;
+        }
+        return 0 != (pfd.revents & (POLLPRI | POLLERR));
+#else
+        return true;
+#endif
+    }
+
+    void refresh() {
+        if (!changed()) {
+            return;
+        }
+        entries_.clear();
+        byDevice_.clear();
+        byDevNum_.clear();
+        load();
+        for (int i = 0; i < entries_.size(); ++i) {
+            const MountEntry &entry = entries_.at(i);
+            byDevice_.insert(entry.device, entry);
+            byDevNum_.insert(devKey(entry.devMajor, entry.devMinor), entry);
+        }
+        loaded_ = true;
+    }
+
+    void load() {
+#ifdef Q_OS_LINUX
+        QByteArray data;
+        if (fd_ >= 0 && 0 == ::lseek(fd_, 0, SEEK_SET)) {
+            char buf[16 * 1024];
+            for (;;) {
+                ssize_t n = ::read(fd_, buf, sizeof(buf));
+                if (n < 0 && EINTR == errno) continue;
+                if (n <= 0) break;
+                data.append(buf, n);
+            }
+        }
+        Q_FOREACH(const QByteArray &line, data.split('\n')) {
+            MountEntry entry;
+            if (parseLine(line, entry)) {
+                entries_.append(entry);
+            }
+        }
+#endif
+#ifdef Q_OS_MAC
+        struct statfs *mnts = NULL;
+        int count = getmntinfo(&mnts, MNT_NOWAIT);
+        for (int i = 0; i < count; ++i) {
+            MountEntry entry;
+            entry.device = QString::fromLocal8Bit(mnts[i].f_mntfromname);
+            entry.mountPoint = QString::fromLocal8Bit(mnts[i].f_mntonname);
+            entry.fsType = QString::fromLocal8Bit(mnts[i].f_fstypename);
+            struct stat st;
+            if (0 == ::stat(mnts[i].f_mntfromname, &st) && S_ISBLK(st.st_mode)) {
+                entry.devMajor = major(st.st_rdev);
+                entry.devMinor = minor(st.st_rdev);
+            }
+            entries_.append(entry);
+        }
+#endif
+    }
+
+    QMutex mutex_;
+    int fd_;
+    bool loaded_;
+    QList<MountEntry> entries_;
+    QHash<QString, MountEntry> byDevice_;
+    QHash<quint64, MountEntry> byDevNum_;
+};
+
+}
+
+namespace XSys {
+
+namespace DiskUtil {
+
+MountEntry FindMount(const QString &targetDev) {
+#ifdef Q_OS_UNIX
+    // match the block device itself, so /dev/sdb1 never matches /dev/sdb10
+    // and symlinks like /dev/disk/by-uuid/* resolve to the right entry.
+    struct stat st;
+    if (0 == ::stat(targetDev.toLocal8Bit().constData(), &st) && S_ISBLK(st.st_mode)) {
+        MountEntry entry = FindMount(major(st.st_rdev), minor(st.st_rdev));
+        if (entry.isValid()) {
+            return entry;
+        }
+    }
+#endif
+    return MountTable::instance().byDevice(targetDev);
+}
+
+MountEntry FindMount(quint32 devMajor, quint32 devMinor) {
+    return MountTable::instance().byDevNum(devMajor, devMinor);
+}
+
+QList<MountEntry> Mounts() {
+    return MountTable::instance().entries();
+}
+
+}
+
+}
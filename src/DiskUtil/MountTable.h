@@ -0,0 +1,28 @@
+#pragma once
+
+#include <QString>
+#include <QList>
+
+namespace XSys {
+
+namespace DiskUtil {
+    struct MountEntry {
+        MountEntry() : devMajor(0), devMinor(0) {}
+        bool isValid() const { return !mountPoint.isEmpty(); }
+
+        QString device;
+        QString mountPoint;
+        QString fsType;
+        QString options;
+        quint32 devMajor;
+        quint32 devMinor;
+    };
+
+    // lookups are served from a cached table that is only reparsed
+    // after the kernel reports a change of /proc/self/mountinfo.
+    MountEntry FindMount(const QString &targetDev);
+    MountEntry FindMount(quint32 devMajor, quint32 devMinor);
+    QList<MountEntry> Mounts();
+}
+
+}
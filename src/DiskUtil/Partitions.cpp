@@ -0,0 +1,316 @@
+#include "Partitions.h"
+#include "MountTable.h"
+
+#include "../Common/Trace.h"
+#include "../Common/RawIo.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QMutex>
+#include <QElapsedTimer>
+
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#include <sys/mount.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <linux/fs.h>
+#include <linux/blkpg.h>
+#endif
+
+namespace {
+
+using XSys::Result;
+
+#ifdef Q_OS_LINUX
+const int SysfsPollMsecs = 100;
+#endif
+
+QString sysBlockPath(const QString &targetDev) {
+    QString name = QFileInfo(targetDev).canonicalFilePath().section('/', -1);
+    if (name.isEmpty()) {
+        return "";
+    }
+    return "/sys/class/block/" + name;
+}
+
+#ifdef Q_OS_LINUX
+// the node exists and its device number is the kernel's current partition
+// of that name. BLKRRPART and BLKPG update sysfs before they return, so
+// after a rescan a node left from the old table no longer matches.
+bool isLivePartition(const QString &device) {
+    struct stat st;
+    if (0 != ::stat(device.toLocal8Bit().constData(), &st) || !S_ISBLK(st.st_mode)) {
+        return false;
+    }
+    QString sysPath = QString("/sys/dev/block/%1:%2").arg(major(st.st_rdev)).arg(minor(st.st_rdev));
+    QString name = QFileInfo(sysPath).canonicalFilePath().section('/', -1);
+    return !name.isEmpty() && name == QFileInfo(device).canonicalFilePath().section('/', -1)
+            && QFileInfo(sysPath + "/start").exists();
+}
+
+QString partitionName(const QString &disk, int number) {
+    // nvme0n1 -> nvme0n1p1, sdb -> sdb1
+    QString prefix = disk.section('/', -1);
+    return prefix + (prefix.at(prefix.size() - 1).isDigit() ? "p" : "") + QString::number(number);
+}
+
+// drop and re-add the four MBR primary partitions one by one. A GPT disk
+// only carries a protective MBR, it is left to BLKRRPART.
+bool blkpgUpdate(int fd, const QString &disk) {
+    unsigned char mbr[512];
+    if (ssize_t(sizeof(mbr)) != ::pread(fd, mbr, sizeof(mbr), 0) || 0x55 != mbr[510] || 0xAA != mbr[511]) {
+        return false;
+    }
+    for (int i = 0; i < 4; ++i) {
+        if (0xEE == mbr[446 + i * 16 + 4]) {
+            qWarning() << "BLKPG update skipped," << disk << "has a GPT";
+            return false;
+        }
+    }
+    // MBR entries count logical sectors, 4096 on some USB bridges.
+    int sectorSize = 512;
+    if (0 != ioctl(fd, BLKSSZGET, &sectorSize) || sectorSize < 512) {
+        sectorSize = 512;
+    }
+    bool ret = true;
+    for (int i = 0; i < 4; ++i) {
+        const unsigned char *entry = mbr + 446 + i * 16;
+        quint32 start = XSys::RawIo::le32(entry + 8);
+        quint32 sectors = XSys::RawIo::le32(entry + 12);
+
+        struct blkpg_partition part;
+        memset(&part, 0, sizeof(part));
+        part.pno = i + 1;
+        struct blkpg_ioctl_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.op = BLKPG_DEL_PARTITION;
+        arg.datalen = sizeof(part);
+        arg.data = &part;
+        ioctl(fd, BLKPG, &arg);
+
+        if (0 == entry[4] || 0 == sectors) {
+            continue;
+        }
+        part.start = qint64(start) * sectorSize;
+        part.length = qint64(sectors) * sectorSize;
+        strncpy(part.devname, partitionName(disk, i + 1).toLatin1().constData(), sizeof(part.devname) - 1);
+        arg.op = BLKPG_ADD_PARTITION;
+        if (0 != ioctl(fd, BLKPG, &arg)) {
+            qWarning() << "BLKPG add partition" << part.pno << "failed:" << strerror(errno);
+            ret = false;
+        }
+    }
+    return ret;
+}
+
+struct UmountState {
+    QMutex mutex;
+    QMap<QString, Result> results;
+};
+
+class UmountWorker : public QRunnable {
+public:
+    UmountWorker(UmountState *state, const QString &device, const QStringList &mountPoints, bool lazy)
+        : state_(state), device_(device), mountPoints_(mountPoints), lazy_(lazy) {}
+
+    void run() {
+        XSys::Trace::Span span("disk", "Umount");
+        span.setArg("device", device_);
+        Result result(Result::Success, "", device_);
+        Q_FOREACH(const QString &mountPoint, mountPoints_) {
+            QByteArray path = mountPoint.toLocal8Bit();
+            if (0 == umount2(path.constData(), MNT_FORCE)) {
+                continue;
+            }
+            QString errmsg = QString::fromLocal8Bit(strerror(errno));
+            if (lazy_ && 0 == umount2(path.constData(), MNT_DETACH)) {
+                qWarning() << "Umount" << mountPoint << "failed:" << errmsg << ", lazily detached";
+                continue;
+            }
+            result = Result(Result::Faiiled, "Umount " + mountPoint + " Failed: " + errmsg, "", device_);
+            break;
+        }
+        span.setResult(result);
+        QMutexLocker locker(&state_->mutex);
+        state_->results.insert(device_, result);
+    }
+
+private:
+    UmountState *state_;
+    QString device_;
+    QStringList mountPoints_;
+    bool lazy_;
+};
+#endif
+
+}
+
+namespace XSys {
+
+namespace DiskUtil {
+
+QString ParentDisk(const QString &targetDev) {
+    QString sysPath = sysBlockPath(targetDev);
+    if (sysPath.isEmpty() || !QFileInfo(sysPath + "/partition").exists()) {
+        return targetDev;
+    }
+    // /sys/class/block/sdb1 -> /sys/devices/.../block/sdb/sdb1
+    return "/dev/" + QFileInfo(sysPath).canonicalFilePath().section('/', -2, -2);
+}
+
+QStringList ListPartitions(const QString &disk) {
+    QStringList partitions;
+    QString sysPath = sysBlockPath(disk);
+    if (sysPath.isEmpty()) {
+        return partitions;
+    }
+    QDir sysDisk(sysPath);
+    Q_FOREACH(const QString &name, sysDisk.entryList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name)) {
+        if (QFileInfo(sysDisk.filePath(name + "/partition")).exists()) {
+            partitions.append("/dev/" + name);
+        }
+    }
+    return partitions;
+}
+
+QMap<QString, Result> UmountPartitions(const QString &disk, bool lazy) {
+#ifdef Q_OS_LINUX
+    QMap<QString, QStringList> mounted;
+    QList<MountEntry> mounts = Mounts();
+    QStringList devices = ListPartitions(disk);
+    devices.prepend(disk);
+    Q_FOREACH(const QString &device, devices) {
+        struct stat st;
+        if (0 != ::stat(device.toLocal8Bit().constData(), &st) || !S_ISBLK(st.st_mode)) {
+            continue;
+        }
+        // deepest mount first, so stacked mounts come off cleanly.
+        for (int i = mounts.size() - 1; i >= 0; --i) {
+            const MountEntry &entry = mounts.at(i);
+            if (entry.devMajor == major(st.st_rdev) && entry.devMinor == minor(st.st_rdev)) {
+                mounted[device].append(entry.mountPoint);
+            }
+        }
+    }
+
+    UmountState state;
+    if (mounted.isEmpty()) {
+        return state.results;
+    }
+    QThreadPool pool;
+    pool.setMaxThreadCount(mounted.size());
+    for (QMap<QString, QStringList>::const_iterator it = mounted.constBegin(); it != mounted.constEnd(); ++it) {
+        pool.start(new UmountWorker(&state, it.key(), it.value(), lazy));
+    }
+    pool.waitForDone();
+    return state.results;
+#else
+    Q_UNUSED(lazy);
+    QMap<QString, Result> results;
+    results.insert(disk, Result(Result::Faiiled, "UmountPartitions Not Supported", "", disk));
+    return results;
+#endif
+}
+
+static Result rescanPartitions(const QString &disk) {
+#ifdef Q_OS_LINUX
+    int fd = ::open(disk.toLocal8Bit().constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return Result(Result::Faiiled, "Open " + disk + " Failed: " + QString::fromLocal8Bit(strerror(errno)), "", disk);
+    }
+    Result ret(Result::Success, "", disk);
+    if (0 != ioctl(fd, BLKRRPART)) {
+        int err = errno;
+        QString errmsg = QString::fromLocal8Bit(strerror(err));
+        if (EBUSY != err || !blkpgUpdate(fd, disk)) {
+            ret = Result(Result::Faiiled, "Rescan " + disk + " Failed: " + errmsg, "", disk);
+        }
+    }
+    ::close(fd);
+    return ret;
+#else
+    return Result(Result::Faiiled, "RescanPartitions Not Supported", "", disk);
+#endif
+}
+
+static Result waitForPartition(const QString &targetDev, int msecs) {
+#ifdef Q_OS_LINUX
+    if (isLivePartition(targetDev)) {
+        return Result(Result::Success, "", targetDev);
+    }
+    // watch before the second check, so a node created in between is not missed.
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0) {
+        return Result(Result::Faiiled, "inotify Failed: " + QString::fromLocal8Bit(strerror(errno)), "", targetDev);
+    }
+    QString dir = QFileInfo(targetDev).absolutePath();
+    if (inotify_add_watch(fd, dir.toLocal8Bit().constData(), IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0) {
+        ::close(fd);
+        return Result(Result::Faiiled, "Watch " + dir + " Failed: " + QString::fromLocal8Bit(strerror(errno)), "", targetDev);
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    bool found = isLivePartition(targetDev);
+    while (!found) {
+        int remaining = msecs - int(timer.elapsed());
+        if (remaining <= 0) {
+            break;
+        }
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        // sysfs sends no inotify events, a node that already exists is
+        // checked against it again every SysfsPollMsecs.
+        if (poll(&pfd, 1, qMin(remaining, SysfsPollMsecs)) < 0 && EINTR != errno) {
+            break;
+        }
+        char events[4096];
+        while (::read(fd, events, sizeof(events)) > 0) {}
+        found = isLivePartition(targetDev);
+    }
+    ::close(fd);
+    if (!found) {
+        return Result(Result::Faiiled, "Wait For " + targetDev + " Timeout", "", targetDev);
+    }
+    return Result(Result::Success, "", targetDev);
+#else
+    Q_UNUSED(msecs);
+    return Result(Result::Faiiled, "WaitForPartition Not Supported", "", targetDev);
+#endif
+}
+
+Result RescanPartitions(const QString &disk) {
+    Trace::Span span("disk", "RescanPartitions");
+    span.setArg("disk", disk);
+    Result ret = rescanPartitions(disk);
+    span.setResult(ret);
+    return ret;
+}
+
+Result WaitForPartition(const QString &targetDev, int msecs) {
+    Trace::Span span("disk", "WaitForPartition");
+    span.setArg("device", targetDev);
+    Result ret = waitForPartition(targetDev, msecs);
+    span.setResult(ret);
+    return ret;
+}
+
+}
+
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <QString>
+#include <QStringList>
+#include <QMap>
+
+#include "../Common/Result.h"
+
+namespace XSys {
+
+namespace DiskUtil {
+    // the whole disk device of a partition, or disk itself, from sysfs.
+    QString ParentDisk(const QString &targetDev);
+    // partition device nodes of a disk, read from /sys/class/block.
+    QStringList ListPartitions(const QString &disk);
+
+    // force unmount every mounted partition of disk concurrently, detach
+    // lazily when lazy is set and the forced umount fails. Only mounted
+    // partitions appear in the result, nothing mounted costs no syscall.
+    QMap<QString, Result> UmountPartitions(const QString &disk, bool lazy = false);
+
+    // ask the kernel to re-read the partition table with BLKRRPART, when
+    // the disk is busy update each MBR primary partition through BLKPG.
+    // A busy GPT disk fails, its table is not parsed here.
+    Result RescanPartitions(const QString &disk);
+    // block until the device node exists and is the kernel's current
+    // partition of that name, woken by inotify on /dev and polling sysfs.
+    Result WaitForPartition(const QString &targetDev, int msecs);
+}
+
+}
@@ -1,12 +1,543 @@
 #include "FileSystem.h"
 
+#include "../Common/Trace.h"
+
 #include <QDebug>
 #include <QStandardPaths>
+#include <QTemporaryDir>
 #include <QTime>
 #include <QFile>
 #include <QFileInfo>
 #include <QDir>
 #include <QCryptographicHash>
+#include <QDirIterator>
+#include <QThreadPool>
+#include <QThread>
+#include <QRunnable>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QHash>
+#include <QCoreApplication>
+
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+#include <stdio.h>
+
+#ifdef Q_OS_LINUX
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+#endif
+
+// size of the reusable copy buffer, memory use of a copy never exceeds it.
+static const qint64 CopyBufferSize = 1024 * 1024;
+
+#ifdef Q_OS_UNIX
+// write the whole buffer, retry on short write and EINTR.
+static bool writeAll(int fd, const char *data, qint64 size, QString &errmsg) {
+    while (size > 0) {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0) {
+            if (EINTR == errno) continue;
+            errmsg = QString::fromLocal8Bit(strerror(errno));
+            return false;
+        }
+        if (0 == n) {
+            errmsg = "Write returned zero bytes";
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// copy from the current offset of srcfd to the current offset of desfd.
+// try the kernel zero-copy paths first, then fall back to a chunked copy.
+static qint64 fdCopy(int srcfd, int desfd, QString &errmsg, const XSys::FS::CopyProgress &progress) {
+    qint64 total = 0;
+#ifdef Q_OS_LINUX
+    bool kernelCopy = true;
+#ifdef __NR_copy_file_range
+    while (kernelCopy) {
+        ssize_t n = syscall(__NR_copy_file_range, srcfd, NULL, desfd, NULL, CopyBufferSize, 0);
+        if (n > 0) { total += n; if (progress) progress(n); continue; }
+        if (0 == n) return total;
+        if (EINTR == errno) continue;
+        if (ENOSYS != errno && EXDEV != errno && EINVAL != errno && EOPNOTSUPP != errno) {
+            errmsg = QString::fromLocal8Bit(strerror(errno));
+            return -1;
+        }
+        kernelCopy = false;
+    }
+#endif
+    kernelCopy = true;
+    while (kernelCopy) {
+        ssize_t n = sendfile(desfd, srcfd, NULL, CopyBufferSize);
+        if (n > 0) { total += n; if (progress) progress(n); continue; }
+        if (0 == n) return total;
+        if (EINTR == errno) continue;
+        if (ENOSYS != errno && EINVAL != errno) {
+            errmsg = QString::fromLocal8Bit(strerror(errno));
+            return -1;
+        }
+        kernelCopy = false;
+    }
+#endif
+    QByteArray buffer(CopyBufferSize, Qt::Uninitialized);
+    for (;;) {
+        ssize_t n = ::read(srcfd, buffer.data(), buffer.size());
+        if (n < 0) {
+            if (EINTR == errno) continue;
+            errmsg = QString::fromLocal8Bit(strerror(errno));
+            return -1;
+        }
+        if (0 == n) break;
+        if (!writeAll(desfd, buffer.constData(), n, errmsg)) {
+            return -1;
+        }
+        total += n;
+        if (progress) progress(n);
+    }
+    return total;
+}
+
+// copy size bytes at offset of srcfd to the current offset of desfd, the
+// offset of srcfd itself is left alone. Same kernel paths as fdCopy.
+static qint64 rangeCopy(int srcfd, qint64 offset, qint64 size, int desfd, QString &errmsg,
+                        const XSys::FS::CopyProgress &progress) {
+    qint64 total = 0;
+#ifdef Q_OS_LINUX
+    bool kernelCopy = true;
+#ifdef __NR_copy_file_range
+    while (kernelCopy && total < size) {
+        loff_t in = offset + total;
+        ssize_t n = syscall(__NR_copy_file_range, srcfd, &in, desfd, NULL, qMin(CopyBufferSize, size - total), 0);
+        if (n > 0) { total += n; if (progress) progress(n); continue; }
+        if (0 == n) break;
+        if (EINTR == errno) continue;
+        if (ENOSYS != errno && EXDEV != errno && EINVAL != errno && EOPNOTSUPP != errno) {
+            errmsg = QString::fromLocal8Bit(strerror(errno));
+            return -1;
+        }
+        kernelCopy = false;
+    }
+#endif
+    kernelCopy = true;
+    while (kernelCopy && total < size) {
+        off_t in = offset + total;
+        ssize_t n = sendfile(desfd, srcfd, &in, qMin(CopyBufferSize, size - total));
+        if (n > 0) { total += n; if (progress) progress(n); continue; }
+        if (0 == n) break;
+        if (EINTR == errno) continue;
+        if (ENOSYS != errno && EINVAL != errno) {
+            errmsg = QString::fromLocal8Bit(strerror(errno));
+            return -1;
+        }
+        kernelCopy = false;
+    }
+#endif
+    QByteArray buffer(CopyBufferSize, Qt::Uninitialized);
+    while (total < size) {
+        ssize_t n = ::pread(srcfd, buffer.data(), qMin(qint64(buffer.size()), size - total), offset + total);
+        if (n < 0) {
+            if (EINTR == errno) continue;
+            errmsg = QString::fromLocal8Bit(strerror(errno));
+            return -1;
+        }
+        if (0 == n) break;
+        if (!writeAll(desfd, buffer.constData(), n, errmsg)) {
+            return -1;
+        }
+        total += n;
+        if (progress) progress(n);
+    }
+    if (total < size) {
+        errmsg = "Unexpected end of source";
+        return -1;
+    }
+    return total;
+}
+#endif
+
+// stream src into des with a fixed size buffer, return bytes copied or -1.
+// with hash set the data has to pass through user space, so the kernel
+// copy is skipped and every chunk is hashed on its way to des.
+static qint64 streamCopy(QFile &src, QFile &des, QString &errmsg, const XSys::FS::CopyProgress &progress,
+                         QCryptographicHash *hash = NULL) {
+#ifdef Q_OS_UNIX
+    // plain files have a real fd, qt resource files do not.
+    if (!hash && src.handle() >= 0 && des.handle() >= 0 && des.flush()) {
+        return fdCopy(src.handle(), des.handle(), errmsg, progress);
+    }
+#endif
+    qint64 total = 0;
+    QByteArray buffer(CopyBufferSize, Qt::Uninitialized);
+    for (;;) {
+        qint64 n = src.read(buffer.data(), buffer.size());
+        if (n < 0) {
+            errmsg = src.errorString();
+            return -1;
+        }
+        if (0 == n) break;
+        if (hash) hash->addData(buffer.constData(), n);
+        qint64 offset = 0;
+        while (offset < n) {
+            qint64 written = des.write(buffer.constData() + offset, n - offset);
+            if (written <= 0) {
+                errmsg = des.errorString();
+                return -1;
+            }
+            offset += written;
+        }
+        total += n;
+        if (progress) progress(n);
+    }
+    return total;
+}
+
+// open both files and stream src into des.
+static bool copyFile(const QString &srcName, const QString &desName, QString &errmsg,
+                     const XSys::FS::CopyProgress &progress = XSys::FS::CopyProgress(),
+                     QCryptographicHash *hash = NULL) {
+    XSys::Trace::Span span("fs", "CopyFile");
+    span.setArg("src", srcName);
+    span.setArg("des", desName);
+    span.setSuccess(false);
+    QFile srcFile(srcName);
+    QFile desFile(desName);
+    if(!srcFile.open(QIODevice::ReadOnly)) {
+        errmsg = "Can not open " + srcName + ": " + srcFile.errorString();
+        return false;
+    }
+    if(!desFile.open(QIODevice::WriteOnly)) {
+        errmsg = "Can not open " + desName + ": " + desFile.errorString();
+        return false;
+    }
+    qint64 copied = streamCopy(srcFile, desFile, errmsg, progress, hash);
+    if(copied < 0) {
+        return false;
+    }
+    span.setBytes(copied);
+    srcFile.close();
+    desFile.close();
+    if(QFileDevice::NoError != desFile.error()) {
+        errmsg = desFile.errorString();
+        return false;
+    }
+    span.setSuccess(true);
+    return true;
+}
+
+// offset of the first byte where the two files differ, -1 when they are
+// equal or one can not be read.
+static qint64 firstDifference(const QString &srcName, const QString &desName) {
+    QFile srcFile(srcName);
+    QFile desFile(desName);
+    if(!srcFile.open(QIODevice::ReadOnly) || !desFile.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+    QByteArray srcBuffer(1024 * 1024, Qt::Uninitialized);
+    QByteArray desBuffer(srcBuffer.size(), Qt::Uninitialized);
+    qint64 pos = 0;
+    for (;;) {
+        qint64 srcRead = srcFile.read(srcBuffer.data(), srcBuffer.size());
+        qint64 desRead = desFile.read(desBuffer.data(), desBuffer.size());
+        if (srcRead < 0 || desRead < 0) {
+            return -1;
+        }
+        qint64 n = qMin(srcRead, desRead);
+        if (0 != memcmp(srcBuffer.constData(), desBuffer.constData(), n)) {
+            for (qint64 i = 0; i < n; ++i) {
+                if (srcBuffer.at(int(i)) != desBuffer.at(int(i))) return pos + i;
+            }
+        }
+        if (srcRead != desRead) {
+            return pos + n;
+        }
+        if (0 == n) {
+            return -1;
+        }
+        pos += n;
+    }
+}
+
+// hash desName as stored on the media and compare it with digest, the
+// source is only read again to locate a mismatch.
+static bool verifyCopy(const QString &srcName, const QString &desName, const QByteArray &digest, QString &errmsg) {
+    QFile desFile(desName);
+    if(!desFile.open(QIODevice::ReadOnly)) {
+        errmsg = "Can not open " + desName + ": " + desFile.errorString();
+        return false;
+    }
+#ifdef Q_OS_UNIX
+    // flush the copy and drop it from the page cache, so it is read back from the media.
+    ::fsync(desFile.handle());
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(desFile.handle(), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+#endif
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    if(!hash.addData(&desFile)) {
+        errmsg = "Can not read " + desName + ": " + desFile.errorString();
+        return false;
+    }
+    if(hash.result() != digest) {
+        desFile.close();
+        qint64 offset = firstDifference(srcName, desName);
+        errmsg = "Verify Failed, " + desName + " differs from source";
+        if (offset >= 0) {
+            errmsg += QString(" at offset %1").arg(offset);
+        }
+        return false;
+    }
+    return true;
+}
+
+static bool copyFileVerified(const QString &srcName, const QString &desName, QString &errmsg,
+                             const XSys::FS::CopyProgress &progress, QByteArray &digest) {
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    if(!copyFile(srcName, desName, errmsg, progress, &hash)) {
+        return false;
+    }
+    digest = hash.result();
+    return verifyCopy(srcName, desName, digest, errmsg);
+}
+
+static bool copyFile(const QString &srcName, const QString &desName) {
+    QString errmsg;
+    if(!copyFile(srcName, desName, errmsg)) {
+        qWarning() << "Copy File Failed, " << srcName << " to " << desName << errmsg;
+        return false;
+    }
+    return true;
+}
+
+struct CopyTreeEntry {
+    QString src;
+    QString des;
+};
+
+// shared by the calling thread and the small file workers of one CopyTree.
+struct CopyTreeState {
+    CopyTreeState(const XSys::FS::CopyTreeOptions &opts)
+        : options(opts), copiedBytes(0), totalBytes(0), copiedFiles(0), totalFiles(0) {}
+
+    void report(qint64 bytes, int files) {
+        QMutexLocker locker(&mutex);
+        copiedBytes += bytes;
+        copiedFiles += files;
+        if (options.progress) {
+            options.progress(copiedBytes, totalBytes, copiedFiles, totalFiles);
+        }
+    }
+
+    void fail(const QString &msg) {
+        QMutexLocker locker(&mutex);
+        if (!failed.load()) {
+            errmsg = msg;
+            failed.store(1);
+        }
+    }
+
+    bool copy(const CopyTreeEntry &entry) {
+        QString msg;
+        XSys::FS::CopyProgress progress = [this](qint64 bytes) { report(bytes, 0); };
+        QByteArray digest;
+        bool ok = options.verify ? copyFileVerified(entry.src, entry.des, msg, progress, digest)
+                                 : copyFile(entry.src, entry.des, msg, progress);
+        if (!ok) {
+            fail("Copy File Failed: " + entry.src + " to " + entry.des + ", " + msg);
+            return false;
+        }
+        report(0, 1);
+        return true;
+    }
+
+    const XSys::FS::CopyTreeOptions &options;
+    QList<CopyTreeEntry> smallFiles;
+    QAtomicInt next;
+    QAtomicInt failed;
+    QMutex mutex;
+    QString errmsg;
+    qint64 copiedBytes;
+    qint64 totalBytes;
+    int copiedFiles;
+    int totalFiles;
+};
+
+// pulls small files from the shared list until it is empty or a copy fails.
+class CopyTreeWorker : public QRunnable {
+public:
+    explicit CopyTreeWorker(CopyTreeState *state) : state_(state) {}
+
+    void run() {
+        while (!state_->failed.load()) {
+            int index = state_->next.fetchAndAddOrdered(1);
+            if (index >= state_->smallFiles.size()) {
+                return;
+            }
+            state_->copy(state_->smallFiles.at(index));
+        }
+    }
+
+private:
+    CopyTreeState *state_;
+};
+
+#ifdef Q_OS_UNIX
+// shared by every task of one RemoveTree.
+struct RmTreeState {
+    RmTreeState() : maxTasks(0) {}
+
+    void fail(const QString &path, int err) {
+        QMutexLocker locker(&mutex);
+        if (!failed.load()) {
+            errmsg = "Remove " + path + " Failed: " + QString::fromLocal8Bit(strerror(err));
+            failedPath = path;
+            failed.store(1);
+        }
+    }
+
+    QThreadPool pool;
+    QAtomicInt failed;
+    QAtomicInt tasks;
+    int maxTasks;
+    QMutex mutex;
+    QString errmsg;
+    QString failedPath;
+};
+
+// an open directory, removed from its parent once pending drops to zero.
+struct RmTreeNode {
+    RmTreeNode(RmTreeNode *p, int dirfd, const QByteArray &n, const QString &fullpath)
+        : parent(p), fd(dirfd), pending(1), name(n), path(fullpath) {}
+
+    RmTreeNode *parent;
+    int fd;
+    QAtomicInt pending;
+    QByteArray name;
+    QString path;
+};
+
+static void rmTreeDone(RmTreeState *state, RmTreeNode *node) {
+    while (node && !node->pending.deref()) {
+        RmTreeNode *parent = node->parent;
+        ::close(node->fd);
+        if (!state->failed.load()) {
+            int ret = parent ? unlinkat(parent->fd, node->name.constData(), AT_REMOVEDIR)
+                             : ::rmdir(node->path.toLocal8Bit().constData());
+            if (0 != ret) {
+                state->fail(node->path, errno);
+            }
+        }
+        delete node;
+        node = parent;
+    }
+}
+
+static void rmTreeDir(RmTreeState *state, RmTreeNode *node);
+
+class RmTreeTask : public QRunnable {
+public:
+    RmTreeTask(RmTreeState *state, RmTreeNode *node) : state_(state), node_(node) {}
+
+    void run() {
+        rmTreeDir(state_, node_);
+        state_->tasks.deref();
+    }
+
+private:
+    RmTreeState *state_;
+    RmTreeNode *node_;
+};
+
+// unlink the entries of node relative to its fd, subdirectories go to the
+// pool while it has room and are handled inline otherwise.
+static void rmTreeDir(RmTreeState *state, RmTreeNode *node) {
+    int fd = dup(node->fd);
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    if (!dir) {
+        state->fail(node->path, errno);
+        if (fd >= 0) ::close(fd);
+        rmTreeDone(state, node);
+        return;
+    }
+    while (!state->failed.load()) {
+        errno = 0;
+        struct dirent *entry = readdir(dir);
+        if (!entry) {
+            if (0 != errno) state->fail(node->path, errno);
+            break;
+        }
+        const char *name = entry->d_name;
+        if (0 == strcmp(name, ".") || 0 == strcmp(name, "..")) {
+            continue;
+        }
+        bool isDir = DT_DIR == entry->d_type;
+        if (DT_UNKNOWN == entry->d_type) {
+            struct stat st;
+            isDir = 0 == fstatat(node->fd, name, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode);
+        }
+        QString path = node->path + "/" + QString::fromLocal8Bit(name);
+        if (!isDir) {
+            if (0 != unlinkat(node->fd, name, 0)) {
+                state->fail(path, errno);
+            }
+            continue;
+        }
+        int childfd = openat(node->fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (childfd < 0) {
+            state->fail(path, errno);
+            continue;
+        }
+        RmTreeNode *child = new RmTreeNode(node, childfd, QByteArray(name), path);
+        node->pending.ref();
+        if (state->tasks.fetchAndAddOrdered(1) < state->maxTasks) {
+            state->pool.start(new RmTreeTask(state, child));
+        } else {
+            state->tasks.deref();
+            rmTreeDir(state, child);
+        }
+    }
+    closedir(dir);
+    rmTreeDone(state, node);
+}
+#else
+static bool rmDirQt(const QString &dirpath, QString &failedPath) {
+    QDir dir(dirpath);
+    if(!dir.exists(dirpath)) {
+        return true;
+    }
+    Q_FOREACH(QFileInfo info, dir.entryInfoList(QDir::NoDotAndDotDot | QDir::System | QDir::Hidden  | QDir::AllDirs | QDir::Files, QDir::DirsFirst)) {
+        bool result = info.isDir() ? rmDirQt(info.absoluteFilePath(), failedPath)
+                                   : QFile::remove(info.absoluteFilePath());
+        if(!result) {
+            if(failedPath.isEmpty()) failedPath = info.absoluteFilePath();
+            return false;
+        }
+    }
+    if(!dir.rmdir(dirpath)) {
+        failedPath = dirpath;
+        return false;
+    }
+    return true;
+}
+#endif
 
 static QString randString(const QString &str) {
     QString seedStr = str + QTime::currentTime().toString(Qt::SystemLocaleLongDate) + QString("%1").arg(qrand());
@@ -36,7 +567,7 @@ bool InsertFileData(const QString &filename, const QByteArray &data) {
         qWarning()<<"Insert Tmp FileData Failed, Can not open"<<filename;
         return false;
     }
-    if(!file.write(data)) {
+    if(file.write(data) != data.size()) {
         qWarning()<<"Insert Tmp FileData Failed, Can not Write"<<filename;
         return false;
     }
@@ -49,25 +580,55 @@ bool InsertFileData(const QString &filename, const QByteArray &data) {
 
 QString InsertTmpFile(const QString &fileurl) {
     QString filename = TmpFilePath(fileurl);
-    QFile file(fileurl);
-    if(!file.open(QIODevice::ReadOnly)) {
-        qWarning()<<"Insert Tmp File Failed, Can not open"<<fileurl;
-        return filename;
-    }
-    if(!InsertFileData(filename, file.readAll())) {
+    if(!copyFile(fileurl, filename)) {
         qWarning()<<"Insert Tmp File Failed"<<fileurl;
         return filename;
     }
-    file.close();
     return filename;
 }
 
+QString InsertBlob(const QString &fileurl, bool executable) {
+    static QMutex mutex;
+    static QHash<QString, QString> blobs;
+    Trace::Span span("fs", "InsertBlob");
+    span.setArg("src", fileurl);
+    QMutexLocker locker(&mutex);
+
+    // blobs are executed, so they live in a directory only this process
+    // can write, made with mode 0700 and removed at exit. A shared cache
+    // in the temp dir could be swapped between the check and the exec.
+    static QTemporaryDir blobRoot(QStandardPaths::standardLocations(QStandardPaths::TempLocation).first()
+                                  + "/xsys-blobs-XXXXXX");
+    if(!blobRoot.isValid()) {
+        qWarning()<<"Insert Blob Failed, Can not create blob dir";
+        span.setSuccess(false);
+        return "";
+    }
+
+    QString blobPath = blobs.value(fileurl);
+    if(blobPath.isEmpty() || !QFileInfo(blobPath).exists()) {
+        // one sub directory per blob keeps equal file names apart.
+        QString subDir = blobPath.isEmpty() ? QString::number(blobs.size()) : QFileInfo(blobPath).dir().dirName();
+        QDir blobDir(blobRoot.filePath(subDir));
+        blobDir.mkpath(".");
+        blobPath = QDir::toNativeSeparators(blobDir.filePath(QFileInfo(fileurl).fileName()));
+        if(!copyFile(fileurl, blobPath)) {
+            RmFile(blobPath);
+            qWarning()<<"Insert Blob Failed"<<fileurl;
+            span.setSuccess(false);
+            return "";
+        }
+        blobs.insert(fileurl, blobPath);
+    }
+
+    if(executable && !QFileInfo(blobPath).isExecutable()) {
+        QFile::setPermissions(blobPath, QFile::permissions(blobPath) | QFile::ExeOwner | QFile::ExeUser);
+    }
+    return blobPath;
+}
+
 bool InsertFile(const QString &fileurl, const QString &fullpath) {
-    QFile file(fileurl);
-    if(!file.open(QIODevice::ReadOnly)) return false;
-    if(!InsertFileData(fullpath, file.readAll())) return false;
-    file.close();
-    return true;
+    return copyFile(fileurl, fullpath);
 }
 
 bool RmFile(QFile &fn) {
@@ -86,58 +647,348 @@ bool RmFile(const QString &filename) {
 }
 
 bool CpFile(const QString &srcName, const QString &desName) {
-    bool ret = true;
-    QFile srcFile(srcName);
-    QFile desFile(desName);
-    srcFile.open(QIODevice::ReadOnly);
-    desFile.open(QIODevice::WriteOnly);
-    QByteArray data = srcFile.readAll();
-    qint64 writeBytes = desFile.write(data);
-    if(writeBytes != data.size()) {
-        qWarning() << "Copy File Failed, " << srcName << " to " << desName;
-        ret = false;
-    }
-    srcFile.close();
-    desFile.close();
+    bool ret = copyFile(srcName, desName);
 #ifdef Q_OS_UNIX
     //SynExec("sync", "");
 #endif
     return ret;
 }
 
-bool RmDir(const QString &dirpath) {
-    bool result = true;
-    QDir dir(dirpath);
+CopyTreeOptions::CopyTreeOptions()
+    : threads(0), largeFileSize(16 * 1024 * 1024), verify(false) {
+}
+
+static Result copyTree(const QString &srcDir, const QString &desDir, const CopyTreeOptions &options,
+                       Trace::Span &span) {
+    QDir src(srcDir);
+    if(!src.exists()) {
+        return Result(Result::Faiiled, "Source Dir Not Exist: " + srcDir);
+    }
 
-    if(dir.exists(dirpath)) {
-        Q_FOREACH(QFileInfo info, dir.entryInfoList(QDir::NoDotAndDotDot | QDir::System | QDir::Hidden  | QDir::AllDirs | QDir::Files, QDir::DirsFirst)) {
-            if(info.isDir()) {
-                result = RmDir(info.absoluteFilePath());
-            } else {
-                result = QFile::remove(info.absoluteFilePath());
+    // walk the tree once, create every directory before any copy starts.
+    CopyTreeState state(options);
+    QList<CopyTreeEntry> largeFiles;
+    QDir des(desDir);
+    if(!des.mkpath(".")) {
+        return Result(Result::Faiiled, "Create Dir Failed: " + desDir);
+    }
+    QDirIterator it(srcDir, QDir::NoDotAndDotDot | QDir::System | QDir::Hidden | QDir::AllDirs | QDir::Files,
+                    QDirIterator::Subdirectories);
+    while(it.hasNext()) {
+        it.next();
+        QFileInfo info = it.fileInfo();
+        QString relativePath = src.relativeFilePath(info.absoluteFilePath());
+        if(info.isDir()) {
+            if(!des.mkpath(relativePath)) {
+                return Result(Result::Faiiled, "Create Dir Failed: " + des.filePath(relativePath));
             }
+            continue;
+        }
+        CopyTreeEntry entry;
+        entry.src = info.absoluteFilePath();
+        entry.des = des.filePath(relativePath);
+        if(info.size() >= options.largeFileSize) {
+            largeFiles.append(entry);
+        } else {
+            state.smallFiles.append(entry);
+        }
+        state.totalBytes += info.size();
+        state.totalFiles++;
+    }
 
-            if(!result) {
-                return result;
+    // small files go to the pool, large files stream on this thread meanwhile.
+    QThreadPool pool;
+    int threads = options.threads > 0 ? options.threads : QThread::idealThreadCount();
+    threads = qBound(1, threads, qMax(1, state.smallFiles.size()));
+    pool.setMaxThreadCount(threads);
+    if(!state.smallFiles.isEmpty()) {
+        for(int i = 0; i < threads; ++i) {
+            pool.start(new CopyTreeWorker(&state));
+        }
+    }
+
+    Q_FOREACH(const CopyTreeEntry &entry, largeFiles) {
+        if(state.failed.load() || !state.copy(entry)) {
+            break;
+        }
+    }
+    pool.waitForDone();
+    span.setBytes(state.copiedBytes);
+
+    if(state.failed.load()) {
+        qWarning() << "Copy Tree Failed, " << srcDir << " to " << desDir << state.errmsg;
+        return Result(Result::Faiiled, state.errmsg);
+    }
+#ifdef Q_OS_UNIX
+    //SynExec("sync", "");
+#endif
+    return Result(Result::Success, "");
+}
+
+Result CopyTree(const QString &srcDir, const QString &desDir, const CopyTreeOptions &options) {
+    Trace::Span span("fs", "CopyTree");
+    span.setArg("src", srcDir);
+    span.setArg("des", desDir);
+    Result ret = copyTree(srcDir, desDir, options, span);
+    span.setResult(ret);
+    return ret;
+}
+
+Result CopyRange(const QString &srcName, qint64 offset, qint64 size, const QString &desName,
+                 const CopyProgress &progress) {
+    Trace::Span span("fs", "CopyRange");
+    span.setArg("src", srcName);
+    span.setArg("des", desName);
+    QFile srcFile(srcName);
+    QFile desFile(desName);
+    if(offset < 0 || size < 0) {
+        Result ret(Result::Faiiled, "Invalid Range Of " + srcName, "", srcName);
+        span.setResult(ret);
+        return ret;
+    }
+    if(!srcFile.open(QIODevice::ReadOnly)) {
+        Result ret(Result::Faiiled, "Can not open " + srcName + ": " + srcFile.errorString(), "", srcName);
+        span.setResult(ret);
+        return ret;
+    }
+    if(!desFile.open(QIODevice::WriteOnly)) {
+        Result ret(Result::Faiiled, "Can not open " + desName + ": " + desFile.errorString(), "", desName);
+        span.setResult(ret);
+        return ret;
+    }
+    QString errmsg;
+    qint64 copied = -1;
+#ifdef Q_OS_UNIX
+    if(srcFile.handle() >= 0 && desFile.handle() >= 0 && desFile.flush()) {
+        copied = rangeCopy(srcFile.handle(), offset, size, desFile.handle(), errmsg, progress);
+    } else
+#endif
+    if(!srcFile.seek(offset)) {
+        errmsg = srcFile.errorString();
+    } else {
+        copied = 0;
+        QByteArray buffer(CopyBufferSize, Qt::Uninitialized);
+        while(copied < size) {
+            qint64 n = srcFile.read(buffer.data(), qMin(qint64(buffer.size()), size - copied));
+            if(n <= 0 || desFile.write(buffer.constData(), n) != n) {
+                errmsg = n < 0 ? srcFile.errorString() : (0 == n ? QString("Unexpected end of source") : desFile.errorString());
+                copied = -1;
+                break;
             }
+            copied += n;
+            if(progress) progress(n);
+        }
+    }
+    desFile.close();
+    if(copied >= 0 && QFileDevice::NoError != desFile.error()) {
+        errmsg = desFile.errorString();
+        copied = -1;
+    }
+    if(copied < 0) {
+        Result ret(Result::Faiiled, "Copy Range Of " + srcName + " Failed: " + errmsg, "", desName);
+        span.setResult(ret);
+        return ret;
+    }
+    span.setBytes(copied);
+    Result ret(Result::Success, "", desName);
+    span.setResult(ret);
+    return ret;
+}
+
+Result CpFileVerified(const QString &srcName, const QString &desName) {
+    QString errmsg;
+    QByteArray digest;
+    Trace::Span span("fs", "CpFileVerified");
+    span.setArg("src", srcName);
+    span.setArg("des", desName);
+    if(!copyFileVerified(srcName, desName, errmsg, CopyProgress(), digest)) {
+        span.setSuccess(false);
+        qWarning() << "Copy File Failed, " << srcName << " to " << desName << errmsg;
+        return Result(Result::Faiiled, errmsg, "", desName);
+    }
+    return Result(Result::Success, "", digest.toHex(), desName);
+}
+
+static Result removeTree(const QString &dirpath) {
+#ifdef Q_OS_UNIX
+    QString path = QDir::cleanPath(dirpath);
+    int fd = ::open(path.toLocal8Bit().constData(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0) {
+        // like before, a missing path or a non directory leaves nothing to remove.
+        if(ENOENT == errno || ENOTDIR == errno) {
+            return Result(Result::Success, "");
         }
-        result = dir.rmdir(dirpath);
+        return Result(Result::Faiiled, "Remove " + path + " Failed: " + QString::fromLocal8Bit(strerror(errno)), "", path);
+    }
+
+    RmTreeState state;
+    int threads = qBound(2, QThread::idealThreadCount(), 8);
+    state.pool.setMaxThreadCount(threads);
+    state.maxTasks = threads * 4;
+    rmTreeDir(&state, new RmTreeNode(NULL, fd, QByteArray(), path));
+    state.pool.waitForDone();
+
+    if(state.failed.load()) {
+        return Result(Result::Faiiled, state.errmsg, "", state.failedPath);
+    }
+#else
+    QString failedPath;
+    if(!rmDirQt(dirpath, failedPath)) {
+        return Result(Result::Faiiled, "Remove " + failedPath + " Failed", "", failedPath);
     }
+#endif
 #ifdef Q_OS_UNIX
     // SynExec("sync", "");
 #endif
-    return result;
+    return Result(Result::Success, "");
 }
 
-bool MoveDir(const QString &oldName, const QString &newName) {
-    RmFile(newName);
-    RmDir(newName);
-    QDir dir(oldName);
-    return dir.rename(oldName, newName);
+Result RemoveTree(const QString &dirpath) {
+    Trace::Span span("fs", "RemoveTree");
+    span.setArg("path", dirpath);
+    Result ret = removeTree(dirpath);
+    span.setResult(ret);
+    return ret;
+}
+
+bool RmDir(const QString &dirpath) {
+    Result ret = RemoveTree(dirpath);
+    if(!ret.isSuccess()) {
+        qWarning() << "Remove Dir Failed," << dirpath << ret.errmsg();
+    }
+    return ret.isSuccess();
+}
+
+#ifdef Q_OS_LINUX
+static int renameFlags(const QByteArray &from, const QByteArray &to, unsigned int flags) {
+#ifdef SYS_renameat2
+    return syscall(SYS_renameat2, AT_FDCWD, from.constData(), AT_FDCWD, to.constData(), flags);
+#else
+    Q_UNUSED(from); Q_UNUSED(to); Q_UNUSED(flags);
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+#endif
 
+static Result removePath(const QString &path) {
+    QFileInfo info(path);
+    if(info.isDir() && !info.isSymLink()) {
+        return RemoveTree(path);
+    }
+    if((info.exists() || info.isSymLink()) && !RmFile(path)) {
+        return Result(Result::Faiiled, "Remove File Failed: " + path, "", path);
+    }
+    return Result(Result::Success, "");
+}
+
+static Result renameFailed(const QString &from, const QString &to, int err) {
+    return Result(Result::Faiiled, "Rename " + from + " to " + to + " Failed: "
+                  + QString::fromLocal8Bit(strerror(err)), "", from);
+}
+
+// put from in the place of to, the old to is removed only once from is in place.
+static Result replacePath(const QString &from, const QString &to, int &err) {
+    QByteArray fromPath = QFile::encodeName(from);
+    QByteArray toPath = QFile::encodeName(to);
+    err = 0;
+    QFileInfo des(to);
+    if(!des.exists() && !des.isSymLink()) {
+#ifdef Q_OS_LINUX
+        if(0 == renameFlags(fromPath, toPath, RENAME_NOREPLACE)) {
+            return Result(Result::Success, "");
+        }
+        if(ENOSYS != errno && EINVAL != errno) {
+            err = errno;
+            return renameFailed(from, to, err);
+        }
+#endif
+        if(0 != ::rename(fromPath.constData(), toPath.constData())) {
+            err = errno;
+            return renameFailed(from, to, err);
+        }
+        return Result(Result::Success, "");
+    }
+
+#ifdef Q_OS_LINUX
+    // swap both atomically, the old destination then sits at from.
+    if(0 == renameFlags(fromPath, toPath, RENAME_EXCHANGE)) {
+        return removePath(from);
+    }
+    if(ENOSYS != errno && EINVAL != errno) {
+        err = errno;
+        return renameFailed(from, to, err);
+    }
+#endif
+    // no exchange support: park the destination, rename, then drop it.
+    QString aside = to + ".xsys-old";
+    removePath(aside);
+    QByteArray asidePath = QFile::encodeName(aside);
+    if(0 != ::rename(toPath.constData(), asidePath.constData())) {
+        err = errno;
+        return renameFailed(to, aside, err);
+    }
+    if(0 != ::rename(fromPath.constData(), toPath.constData())) {
+        err = errno;
+        ::rename(asidePath.constData(), toPath.constData());
+        return renameFailed(from, to, err);
+    }
+    return removePath(aside);
+}
+
+static Result moveTree(const QString &oldName, const QString &newName) {
+    QString from = QDir::cleanPath(oldName);
+    QString to = QDir::cleanPath(newName);
+    QFileInfo src(from);
+    if(!src.exists() && !src.isSymLink()) {
+        return Result(Result::Faiiled, "Move Source Not Exist: " + from, "", from);
+    }
+
+    // same filesystem, no data is copied.
+    int err = 0;
+    Result ret = replacePath(from, to, err);
+    if(ret.isSuccess() || EXDEV != err) {
+        return ret;
+    }
+
+    // across filesystems, stream a copy next to the destination and swap it in.
+    QString staging = to + ".xsys-new";
+    removePath(staging);
+    if(src.isDir()) {
+        ret = CopyTree(from, staging);
+    } else if(!CpFile(from, staging)) {
+        ret = Result(Result::Faiiled, "Copy File Failed: " + from + " to " + staging, "", from);
+    } else {
+        ret = Result(Result::Success, "");
+    }
+    if(ret.isSuccess()) {
+        ret = replacePath(staging, to, err);
+    }
+    if(!ret.isSuccess()) {
+        removePath(staging);
+        return ret;
+    }
+    return removePath(from);
+}
+
+Result MoveTree(const QString &oldName, const QString &newName) {
+    Trace::Span span("fs", "MoveTree");
+    span.setArg("src", oldName);
+    span.setArg("des", newName);
+    Result ret = moveTree(oldName, newName);
+    span.setResult(ret);
+    return ret;
+}
+
+bool MoveDir(const QString &oldName, const QString &newName) {
+    Result ret = MoveTree(oldName, newName);
+    if(!ret.isSuccess()) {
+        qWarning() << "Move Dir Failed," << oldName << "to" << newName << ret.errmsg();
+    }
 #ifdef Q_OS_UNIX
     //SynExec("sync", "");
 #endif
+    return ret.isSuccess();
 }
 
 }
@@ -1,21 +1,56 @@
 #pragma once
 
 #include <QString>
+#include <functional>
+
+#include "../Common/Result.h"
+
 class QFile;
 
 namespace XSys {
 namespace FS {
 
+// called with the number of bytes just written, may run on a worker thread.
+typedef std::function<void(qint64 bytes)> CopyProgress;
+
+struct CopyTreeOptions {
+    CopyTreeOptions();
+
+    // workers for small files, 0 means QThread::idealThreadCount().
+    int threads;
+    // files of at least this size are streamed one by one on the calling thread.
+    qint64 largeFileSize;
+    // read every file back after the copy and compare it with the source hash.
+    bool verify;
+    // aggregate progress, serialized, may run on a worker thread.
+    std::function<void(qint64 copiedBytes, qint64 totalBytes, int copiedFiles, int totalFiles)> progress;
+};
+
 QString TmpFilePath(const QString &filename = "");
 QString InsertTmpFile(const QString &fileurl);
+// extract fileurl once per process into a private 0700 temp dir that is
+// removed at exit, return its path, "" on failure.
+QString InsertBlob(const QString &fileurl, bool executable = false);
 bool InsertFile(const QString &fileurl, const QString &fullpath);
 bool InsertFileData(const QString &name, const QByteArray &data = "");
 QString SynExec(const QString &exec, const QString &param, const QString &execPipeIn = "");
 bool RmFile(QFile &file);
 bool RmFile(const QString &filename);
 bool CpFile(const QString &srcName, const QString &desName);
+// copy and read des back, Result::result() holds the SHA-1 of the data in hex.
+Result CpFileVerified(const QString &srcName, const QString &desName);
+// copy size bytes at offset of srcName into desName, a file inside an
+// image goes through the same kernel copy as a whole file.
+Result CopyRange(const QString &srcName, qint64 offset, qint64 size, const QString &desName,
+                 const CopyProgress &progress = CopyProgress());
+Result CopyTree(const QString &srcDir, const QString &desDir, const CopyTreeOptions &options = CopyTreeOptions());
 bool MoveDir(const QString &oldName, const QString &newName);
+// rename in place when possible, copy then delete across filesystems; an
+// existing destination is removed only after the new data is in place.
+Result MoveTree(const QString &oldName, const QString &newName);
 bool RmDir(const QString &dirpath);
+// remove a tree in parallel, Result::cmd() names the path that failed.
+Result RemoveTree(const QString &dirpath);
 
 }
 }
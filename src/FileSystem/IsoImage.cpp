@@ -0,0 +1,515 @@
+#include "IsoImage.h"
+
+#include "../Common/Trace.h"
+#include "../Common/RawIo.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+
+#include <algorithm>
+#include <limits.h>
+#include <string.h>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+using XSys::Result;
+using XSys::FS::IsoEntry;
+using XSys::RawIo::le16;
+using XSys::RawIo::le32;
+
+// logical sector of ISO9660, volume descriptors start at sector 16.
+const qint64 IsoSectorSize = 2048;
+const qint64 FirstDescriptor = 16;
+const int MinRecordSize = 34;
+const int MaxDepth = 64;
+// System Use Sharing Protocol continuation areas followed per record.
+const int MaxContinuations = 16;
+
+const quint8 FlagDirectory = 0x02;
+const quint8 FlagMultiExtent = 0x80;
+
+// Rock Ridge file type bits of st_mode.
+const quint32 ModeTypeMask = 0170000;
+const quint32 ModeSymLink = 0120000;
+
+// one directory record with its Rock Ridge fields.
+struct Record {
+    Record() : extent(0), size(0), flags(0), mode(0), relocated(false), childLink(-1) {}
+
+    qint64 extent;
+    qint64 size;
+    quint8 flags;
+    QString name;
+    QString rockName;
+    quint32 mode;
+    bool relocated;
+    qint64 childLink;
+};
+
+QString stripVersion(const QString &name) {
+    int semicolon = name.lastIndexOf(';');
+    return semicolon < 0 ? name : name.left(semicolon);
+}
+
+}
+
+namespace XSys {
+namespace FS {
+
+class IsoImagePrivate {
+public:
+    IsoImagePrivate() : map(NULL), size(0), blockSize(IsoSectorSize), rockRidge(false), suspSkip(0) {}
+
+    bool inImage(qint64 offset, qint64 length) const {
+        return offset >= 0 && length >= 0 && offset <= size && length <= size - offset;
+    }
+
+    Result failed(const QString &errmsg) const {
+        return Result(Result::Faiiled, errmsg, "", file.fileName());
+    }
+
+    // walk one System Use area, then the continuation areas it points to.
+    void parseSusp(const uchar *p, qint64 length, Record &record, int depth) const {
+        qint64 ceOffset = -1;
+        qint64 ceLength = 0;
+        qint64 i = 0;
+        while (i + 4 <= length) {
+            const uchar *e = p + i;
+            int entryLength = e[2];
+            if (entryLength < 4 || i + entryLength > length) {
+                break;
+            }
+            if ('N' == e[0] && 'M' == e[1] && entryLength >= 5) {
+                // the current and parent flags name "." and "..".
+                if (!(e[4] & 0x06)) {
+                    record.rockName += QString::fromUtf8(reinterpret_cast<const char *>(e + 5), entryLength - 5);
+                }
+            } else if ('P' == e[0] && 'X' == e[1] && entryLength >= 8) {
+                record.mode = le32(e + 4);
+            } else if ('C' == e[0] && 'L' == e[1] && entryLength >= 8) {
+                record.childLink = le32(e + 4);
+            } else if ('R' == e[0] && 'E' == e[1]) {
+                record.relocated = true;
+            } else if ('C' == e[0] && 'E' == e[1] && entryLength >= 28) {
+                ceOffset = qint64(le32(e + 4)) * blockSize + le32(e + 12);
+                ceLength = le32(e + 20);
+            } else if ('S' == e[0] && 'T' == e[1]) {
+                break;
+            }
+            i += entryLength;
+        }
+        if (ceOffset >= 0 && depth < MaxContinuations && inImage(ceOffset, ceLength)) {
+            parseSusp(map + ceOffset, ceLength, record, depth + 1);
+        }
+    }
+
+    // the System Use area after the name of a record.
+    void parseRecordSusp(const uchar *p, int skip, Record &record) const {
+        int nameLength = p[32];
+        int start = 33 + nameLength + (0 == nameLength % 2 ? 1 : 0) + skip;
+        if (start < p[0]) {
+            parseSusp(p + start, p[0] - start, record, 0);
+        }
+    }
+
+    bool hasRockRidge(const uchar *root, qint64 rootSize) const {
+        // "SP" opens the System Use area of the first record of the root.
+        qint64 offset = qint64(le32(root + 2)) * blockSize;
+        if (rootSize < MinRecordSize || !inImage(offset, MinRecordSize)) {
+            return false;
+        }
+        const uchar *dot = map + offset;
+        // the record length byte may claim more than the image holds.
+        if (dot[0] < MinRecordSize || !inImage(offset, dot[0])) {
+            return false;
+        }
+        int start = 33 + dot[32] + (0 == dot[32] % 2 ? 1 : 0);
+        if (start + 7 > dot[0] || 'S' != dot[start] || 'P' != dot[start + 1]
+                || 0xBE != dot[start + 4] || 0xEF != dot[start + 5]) {
+            return false;
+        }
+        suspSkip = dot[start + 6];
+        Record record;
+        parseSusp(dot + start, dot[0] - start, record, 0);
+        return 0 != record.mode;
+    }
+
+    Result walk(qint64 extent, qint64 dirSize, const QString &prefix, bool joliet, int depth) {
+        qint64 offset = extent * blockSize;
+        if (depth > MaxDepth || visited.contains(extent)) {
+            return failed("Directory Loop In " + file.fileName() + " At " + prefix);
+        }
+        if (!inImage(offset, dirSize)) {
+            return failed("Broken Directory In " + file.fileName() + " At " + prefix);
+        }
+        visited.insert(extent);
+
+        int pending = -1;
+        qint64 pos = 0;
+        while (pos < dirSize) {
+            const uchar *p = map + offset + pos;
+            int length = p[0];
+            if (0 == length) {
+                // records never cross a sector, the rest of this one is padding.
+                pos = (pos / IsoSectorSize + 1) * IsoSectorSize;
+                continue;
+            }
+            int nameLength = p[32];
+            if (length < MinRecordSize || pos + length > dirSize || 33 + nameLength > length) {
+                return failed("Broken Directory Record In " + file.fileName() + " At " + prefix);
+            }
+            pos += length;
+            if (1 == nameLength && (0 == p[33] || 1 == p[33])) {
+                continue;
+            }
+
+            Record record;
+            record.extent = le32(p + 2);
+            record.size = le32(p + 10);
+            record.flags = p[25];
+            if (joliet) {
+                QVector<ushort> name;
+                for (int i = 0; i + 1 < nameLength; i += 2) {
+                    name.append(quint16(p[33 + i] << 8) | p[34 + i]);
+                }
+                record.name = stripVersion(QString::fromUtf16(name.constData(), name.size()));
+            } else {
+                record.name = stripVersion(QString::fromLatin1(reinterpret_cast<const char *>(p + 33), nameLength));
+                if (record.name.endsWith('.')) {
+                    record.name.chop(1);
+                }
+                record.name = record.name.toLower();
+            }
+            if (rockRidge) {
+                parseRecordSusp(p, suspSkip, record);
+                if (record.relocated) {
+                    // reached through the "CL" record that points at it.
+                    continue;
+                }
+                if (!record.rockName.isEmpty()) {
+                    record.name = record.rockName;
+                }
+            }
+            if (record.name.isEmpty() || record.name.contains('/') || "." == record.name || ".." == record.name) {
+                qWarning() << "Skip invalid name in" << file.fileName() << prefix << record.name;
+                continue;
+            }
+
+            QString path = prefix.isEmpty() ? record.name : prefix + "/" + record.name;
+            if (pending >= 0) {
+                // the next extent of a multi-extent file.
+                IsoEntry &entry = entries[pending];
+                if (entry.path != path || record.extent * blockSize != entry.offset + entry.size) {
+                    return failed("Fragmented File Not Supported: " + entry.path);
+                }
+                entry.size += record.size;
+                if (!inImage(entry.offset, entry.size)) {
+                    return failed("File Beyond End Of Image: " + path);
+                }
+                if (!(record.flags & FlagMultiExtent)) {
+                    pending = -1;
+                }
+                continue;
+            }
+            if (index.contains(path)) {
+                continue;
+            }
+
+            IsoEntry entry;
+            entry.path = path;
+            entry.mode = record.mode;
+            entry.isDir = (record.flags & FlagDirectory) || record.childLink >= 0;
+            entry.isSymLink = ModeSymLink == (record.mode & ModeTypeMask);
+            entry.offset = record.extent * blockSize;
+            entry.size = record.size;
+            if (record.childLink >= 0) {
+                // a relocated deep directory, its "." record holds the size.
+                entry.offset = record.childLink * blockSize;
+                entry.size = inImage(entry.offset, MinRecordSize) ? le32(map + entry.offset + 10) : 0;
+            }
+            if (!entry.isDir && !entry.isSymLink && !inImage(entry.offset, entry.size)) {
+                return failed("File Beyond End Of Image: " + path);
+            }
+            index.insert(path, entries.size());
+            entries.append(entry);
+            if (entry.isDir) {
+                Result ret = walk(entry.offset / blockSize, entry.size, path, joliet, depth + 1);
+                if (!ret.isSuccess()) {
+                    return ret;
+                }
+            } else if (record.flags & FlagMultiExtent) {
+                pending = entries.size() - 1;
+            }
+        }
+        return Result(Result::Success, "");
+    }
+
+    QFile file;
+    const uchar *map;
+    qint64 size;
+    qint64 blockSize;
+    QString volumeId;
+    bool rockRidge;
+    mutable int suspSkip;
+    QList<IsoEntry> entries;
+    QHash<QString, int> index;
+    QSet<qint64> visited;
+};
+
+IsoEntry::IsoEntry()
+    : isDir(false), isSymLink(false), mode(0), offset(0), size(0) {
+}
+
+IsoImage::IsoImage()
+    : d(new IsoImagePrivate) {
+}
+
+IsoImage::~IsoImage() {
+    close();
+    delete d;
+}
+
+Result IsoImage::open(const QString &isoPath) {
+    close();
+    Trace::Span span("fs", "OpenIso");
+    span.setArg("image", isoPath);
+    d->file.setFileName(isoPath);
+    if (!d->file.open(QIODevice::ReadOnly)) {
+        Result ret(Result::Faiiled, "Can not open " + isoPath + ": " + d->file.errorString(), "", isoPath);
+        span.setResult(ret);
+        return ret;
+    }
+    d->size = d->file.size();
+    d->map = d->size > 0 ? d->file.map(0, d->size) : NULL;
+    if (!d->map) {
+        Result ret = d->failed("Map " + isoPath + " Failed: " + d->file.errorString());
+        close();
+        span.setResult(ret);
+        return ret;
+    }
+
+    const uchar *primary = NULL;
+    const uchar *joliet = NULL;
+    for (qint64 sector = FirstDescriptor; ; ++sector) {
+        const uchar *p = d->map + sector * IsoSectorSize;
+        if (!d->inImage(sector * IsoSectorSize, IsoSectorSize) || 0 != memcmp(p + 1, "CD001", 5)) {
+            break;
+        }
+        if (255 == p[0]) {
+            break;
+        }
+        if (1 == p[0] && !primary) {
+            primary = p;
+        }
+        // a supplementary descriptor with a UCS-2 escape sequence is Joliet.
+        if (2 == p[0] && !joliet && '%' == p[88] && '/' == p[89]
+                && ('@' == p[90] || 'C' == p[90] || 'E' == p[90])) {
+            joliet = p;
+        }
+    }
+    qint64 blockSize = primary ? le16(primary + 128) : 0;
+    if (!primary || blockSize < 512 || blockSize > IsoSectorSize || (blockSize & (blockSize - 1))) {
+        Result ret = d->failed("Not An ISO9660 Image: " + isoPath);
+        close();
+        span.setResult(ret);
+        return ret;
+    }
+    d->blockSize = blockSize;
+    d->volumeId = QString::fromLatin1(reinterpret_cast<const char *>(primary + 40), 32).trimmed();
+
+    // Rock Ridge keeps POSIX names and modes, Joliet only long names.
+    const uchar *root = primary + 156;
+    d->rockRidge = d->hasRockRidge(root, le32(root + 10));
+    if (!d->rockRidge && joliet) {
+        root = joliet + 156;
+    }
+    Result ret = d->walk(le32(root + 2), le32(root + 10), "", !d->rockRidge && joliet, 0);
+    d->visited.clear();
+    if (!ret.isSuccess()) {
+        close();
+        span.setResult(ret);
+        return ret;
+    }
+    span.setResult(ret);
+    return ret;
+}
+
+void IsoImage::close() {
+    if (d->map) {
+        d->file.unmap(const_cast<uchar *>(d->map));
+    }
+    d->file.close();
+    d->map = NULL;
+    d->size = 0;
+    d->rockRidge = false;
+    d->suspSkip = 0;
+    d->volumeId.clear();
+    d->entries.clear();
+    d->index.clear();
+}
+
+bool IsoImage::isOpen() const {
+    return NULL != d->map;
+}
+
+QString IsoImage::fileName() const {
+    return d->file.fileName();
+}
+
+QString IsoImage::volumeId() const {
+    return d->volumeId;
+}
+
+const QList<IsoEntry> &IsoImage::entries() const {
+    return d->entries;
+}
+
+const IsoEntry *IsoImage::find(const QString &path) const {
+    QString key = QDir::fromNativeSeparators(path);
+    while (key.startsWith('/')) key.remove(0, 1);
+    while (key.endsWith('/')) key.chop(1);
+    int i = d->index.value(key, -1);
+    return i < 0 ? NULL : &d->entries.at(i);
+}
+
+QByteArray IsoImage::data(const IsoEntry &entry) const {
+    // QByteArray holds at most INT_MAX bytes, use extractFile() beyond that.
+    if (!d->map || entry.isDir || entry.size > INT_MAX || !d->inImage(entry.offset, entry.size)) {
+        return QByteArray();
+    }
+    return QByteArray::fromRawData(reinterpret_cast<const char *>(d->map + entry.offset), int(entry.size));
+}
+
+Result IsoImage::extractFile(const IsoEntry &entry, const QString &desName, const CopyProgress &progress) const {
+    if (!isOpen()) {
+        return Result(Result::Faiiled, "Image Not Open", "", desName);
+    }
+    if (entry.isDir) {
+        return QDir().mkpath(desName) ? Result(Result::Success, "", desName)
+                                      : Result(Result::Faiiled, "Create Dir Failed: " + desName, "", desName);
+    }
+    return CopyRange(d->file.fileName(), entry.offset, entry.size, desName, progress);
+}
+
+// compare desName as stored on the media with the mapped source.
+static bool verifyExtracted(const uchar *src, qint64 size, const QString &desName, QString &errmsg) {
+    QFile desFile(desName);
+    if (!desFile.open(QIODevice::ReadOnly)) {
+        errmsg = "Can not open " + desName + ": " + desFile.errorString();
+        return false;
+    }
+#ifdef Q_OS_UNIX
+    ::fsync(desFile.handle());
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(desFile.handle(), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+#endif
+    QByteArray buffer(1024 * 1024, Qt::Uninitialized);
+    qint64 pos = 0;
+    bool longer = false;
+    for (;;) {
+        qint64 n = desFile.read(buffer.data(), buffer.size());
+        if (n < 0) {
+            errmsg = "Can not read " + desName + ": " + desFile.errorString();
+            return false;
+        }
+        if (0 == n) break;
+        qint64 same = qMin(n, size - pos);
+        if (0 != memcmp(buffer.constData(), src + pos, same)) {
+            qint64 i = 0;
+            while (buffer.at(int(i)) == char(src[pos + i])) ++i;
+            pos += i;
+            break;
+        }
+        pos += same;
+        if (same < n) {
+            // the copy is longer than the source.
+            longer = true;
+            break;
+        }
+    }
+    if (pos != size || longer) {
+        errmsg = "Verify Failed, " + desName + QString(" differs from source at offset %1").arg(pos);
+        return false;
+    }
+    return true;
+}
+
+Result IsoImage::extract(const QString &desDir, const CopyTreeOptions &options) const {
+    if (!isOpen()) {
+        return Result(Result::Faiiled, "Image Not Open", "", desDir);
+    }
+    Trace::Span span("fs", "ExtractIso");
+    span.setArg("image", d->file.fileName());
+    span.setArg("des", desDir);
+
+    QDir des(desDir);
+    if (!des.mkpath(".")) {
+        Result ret(Result::Faiiled, "Create Dir Failed: " + desDir, "", desDir);
+        span.setResult(ret);
+        return ret;
+    }
+    QVector<int> files;
+    qint64 totalBytes = 0;
+    for (int i = 0; i < d->entries.size(); ++i) {
+        const IsoEntry &entry = d->entries.at(i);
+        if (entry.isDir) {
+            if (!des.mkpath(entry.path)) {
+                Result ret(Result::Faiiled, "Create Dir Failed: " + des.filePath(entry.path), "", desDir);
+                span.setResult(ret);
+                return ret;
+            }
+        } else if (!entry.isSymLink) {
+            files.append(i);
+            totalBytes += entry.size;
+        }
+    }
+    const QList<IsoEntry> &entries = d->entries;
+    std::sort(files.begin(), files.end(), [&entries](int a, int b) {
+        return entries.at(a).offset < entries.at(b).offset;
+    });
+
+    qint64 copiedBytes = 0;
+    int copiedFiles = 0;
+    CopyProgress progress;
+    if (options.progress) {
+        progress = [&](qint64 bytes) {
+            copiedBytes += bytes;
+            options.progress(copiedBytes, totalBytes, copiedFiles, files.size());
+        };
+    }
+    Q_FOREACH(int i, files) {
+        const IsoEntry &entry = d->entries.at(i);
+        QString desName = des.filePath(entry.path);
+        Result ret = CopyRange(d->file.fileName(), entry.offset, entry.size, desName, progress);
+        QString errmsg;
+        if (ret.isSuccess() && options.verify && !verifyExtracted(d->map + entry.offset, entry.size, desName, errmsg)) {
+            ret = Result(Result::Faiiled, errmsg, "", desName);
+        }
+        if (!ret.isSuccess()) {
+            qWarning() << "Extract Image Failed," << d->file.fileName() << "to" << desDir << ret.errmsg();
+            span.setResult(ret);
+            return ret;
+        }
+        copiedFiles++;
+        if (options.progress) {
+            options.progress(copiedBytes, totalBytes, copiedFiles, files.size());
+        }
+    }
+    span.setBytes(totalBytes);
+    Result ret(Result::Success, "", desDir);
+    span.setResult(ret);
+    return ret;
+}
+
+}
+}
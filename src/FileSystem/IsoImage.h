@@ -0,0 +1,64 @@
+#pragma once
+
+#include <QList>
+#include <QString>
+
+#include "../Common/Result.h"
+#include "FileSystem.h"
+
+namespace XSys {
+namespace FS {
+
+struct IsoEntry {
+    IsoEntry();
+
+    // below the image root with '/' separators, the Rock Ridge or Joliet
+    // name when the image has one, the lower cased ISO9660 name otherwise.
+    QString path;
+    bool isDir;
+    bool isSymLink;
+    // Rock Ridge st_mode, 0 without Rock Ridge.
+    quint32 mode;
+    // file data as a byte range of the image.
+    qint64 offset;
+    qint64 size;
+};
+
+class IsoImagePrivate;
+
+// an ISO9660 image mapped read only, the directory tree is indexed once
+// by open(), so nothing needs a loop mount.
+class IsoImage {
+public:
+    IsoImage();
+    ~IsoImage();
+
+    Result open(const QString &isoPath);
+    void close();
+    bool isOpen() const;
+    QString fileName() const;
+    QString volumeId() const;
+
+    // every directory comes before its content.
+    const QList<IsoEntry> &entries() const;
+    const IsoEntry *find(const QString &path) const;
+    // the file data inside the mapping, no copy, valid until close(). empty
+    // for files larger than INT_MAX bytes.
+    QByteArray data(const IsoEntry &entry) const;
+
+    Result extractFile(const IsoEntry &entry, const QString &desName,
+                       const CopyProgress &progress = CopyProgress()) const;
+    // create every directory, then copy the files in image order, so the
+    // image is read in one sequential pass. threads and largeFileSize of
+    // options are not used.
+    Result extract(const QString &desDir, const CopyTreeOptions &options = CopyTreeOptions()) const;
+
+private:
+    IsoImage(const IsoImage &);
+    IsoImage& operator=(const IsoImage &);
+
+    IsoImagePrivate *d;
+};
+
+}
+}
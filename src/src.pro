@@ -8,7 +8,7 @@ QT       -= gui
 
 TARGET = xsys
 TEMPLATE = lib
-CONFIG += staticlib
+CONFIG += staticlib c++11
 
 win32* {
     DESTDIR = ./
@@ -28,15 +28,38 @@ win32* {
 #}
 
 SOURCES += DiskUtil/DiskUtil.cpp \
+    DiskUtil/MountTable.cpp \
+    DiskUtil/FsProbe.cpp \
+    DiskUtil/Partitions.cpp \
+    DiskUtil/BootSector.cpp \
+    DiskUtil/ImageWriter.cpp \
+    DiskUtil/Devices.cpp \
+    DiskUtil/FatFormat.cpp \
+    DiskUtil/FatVolume.cpp \
     Common/Result.cpp \
+    Common/TaskGraph.cpp \
+    Common/Trace.cpp \
     Cmd/Cmd.cpp \
-    FileSystem/FileSystem.cpp
+    FileSystem/FileSystem.cpp \
+    FileSystem/IsoImage.cpp
 
 HEADERS +=     XSys \
     DiskUtil/DiskUtil.h \
+    DiskUtil/MountTable.h \
+    DiskUtil/FsProbe.h \
+    DiskUtil/Partitions.h \
+    DiskUtil/BootSector.h \
+    DiskUtil/ImageWriter.h \
+    DiskUtil/Devices.h \
+    DiskUtil/FatFormat.h \
+    DiskUtil/FatVolume.h \
     Common/Result.h \
+    Common/TaskGraph.h \
+    Common/Trace.h \
+    Common/RawIo.h \
     Cmd/Cmd.h \
-    FileSystem/FileSystem.h
+    FileSystem/FileSystem.h \
+    FileSystem/IsoImage.h
 
 unix {
     target.path = /usr/lib